@@ -0,0 +1,430 @@
+/*
+ * vfs2db workload driver
+ *
+ * Runs filesystem workloads against a mounted vfs2db instance and prints
+ * one JSON document with latency percentiles and throughput per workload.
+ *
+ *   vfs2db_bench -m <mountpoint> [-t table] [-n ops] [-r records]
+ *                [-w stat,readdir,lstable,read,symlink,scan] [-p pattern]
+ *                [-s seed] [-o output.json]
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define READ_CHUNK (64 * 1024)
+
+/**
+ * Benchmark Options
+ *
+ * mount:       mountpoint of the instance under test
+ * table:       table the workloads run on
+ * ops:         operations per workload
+ * max_records: records sampled from the table listing
+ * workloads:   comma separated workloads to run
+ * pattern:     string searched by the scan workload
+ * seed:        seed of the record/attribute picks
+ */
+typedef struct BenchOptions {
+    const char  *mount;
+    const char  *table;
+    long         ops;
+    long         max_records;
+    const char  *workloads;
+    const char  *pattern;
+    unsigned int seed;
+} BenchOptions;
+
+/**
+ * Workload Result
+ *
+ * lat:    latency of every operation, in ns
+ * n:      operations completed
+ * errors: operations that failed
+ * bytes:  bytes read
+ * items:  workload specific count (entries listed, matches found)
+ * wall:   wall clock time of the whole workload, in ns
+ */
+typedef struct Result {
+    uint64_t *lat;
+    long      n;
+    long      cap;
+    long      errors;
+    uint64_t  bytes;
+    uint64_t  items;
+    uint64_t  wall;
+} Result;
+
+// Files of the sampled records
+typedef struct Sample {
+    char **records;
+    long   n_records;
+    char **files;       // attribute file names of a record
+    bool  *is_link;     // whether the attribute is a symlink (FK)
+    long   n_files;
+} Sample;
+
+static BenchOptions opt = {
+    .mount       = NULL,
+    .table       = "orders",
+    .ops         = 1000,
+    .max_records = 10000,
+    .workloads   = "stat,readdir,lstable,read,symlink,scan",
+    .pattern     = "a",
+    .seed        = 42,
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void result_add(Result *r, uint64_t ns, bool ok) {
+    if (!ok) { r->errors++; return; }
+
+    if (r->n == r->cap) {
+        long cap = r->cap ? r->cap * 2 : 1024;
+        uint64_t *lat = realloc(r->lat, cap * sizeof(uint64_t));
+        if (!lat) { r->errors++; return; }
+        r->lat = lat;
+        r->cap = cap;
+    }
+    r->lat[r->n++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const Result *r, double p) {
+    if (r->n == 0) return 0;
+    long i = (long)(p * (r->n - 1) + 0.5);
+    return r->lat[i] / 1000.0;
+}
+
+static void path_of(char *buf, size_t size, const char *record, const char *file) {
+    if (file) snprintf(buf, size, "%s/%s/%s/%s", opt.mount, opt.table, record, file);
+    else if (record) snprintf(buf, size, "%s/%s/%s", opt.mount, opt.table, record);
+    else snprintf(buf, size, "%s/%s", opt.mount, opt.table);
+}
+
+static char **list_dir(const char *path, long max, long *n) {
+    *n = 0;
+    DIR *dir = opendir(path);
+    if (!dir) return NULL;
+
+    char **names = NULL;
+    long cap = 0;
+    struct dirent *de;
+    while (*n < max && (de = readdir(dir))) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (*n == cap) {
+            cap = cap ? cap * 2 : 256;
+            char **tmp = realloc(names, cap * sizeof(char*));
+            if (!tmp) break;
+            names = tmp;
+        }
+        names[(*n)++] = strdup(de->d_name);
+    }
+    closedir(dir);
+    return names;
+}
+
+/**
+ * Sample the table
+ *
+ * @brief Lists up to max_records records of the table and the attribute
+ *        files of the first one (every record of a table has the same).
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int sample_table(Sample *s) {
+    char path[PATH_MAX];
+
+    path_of(path, sizeof(path), NULL, NULL);
+    s->records = list_dir(path, opt.max_records, &s->n_records);
+    if (s->n_records == 0) {
+        fprintf(stderr, "no records in %s\n", path);
+        return -1;
+    }
+
+    path_of(path, sizeof(path), s->records[0], NULL);
+    s->files = list_dir(path, LONG_MAX, &s->n_files);
+    if (s->n_files == 0) {
+        fprintf(stderr, "no attributes in %s\n", path);
+        return -1;
+    }
+
+    s->is_link = calloc(s->n_files, sizeof(bool));
+    if (!s->is_link) return -1;
+    for (long i = 0; i < s->n_files; i++) {
+        struct stat st;
+        path_of(path, sizeof(path), s->records[0], s->files[i]);
+        s->is_link[i] = lstat(path, &st) == 0 && S_ISLNK(st.st_mode);
+    }
+    return 0;
+}
+
+static long pick(long n) {
+    return rand() % n;
+}
+
+// Random attribute file, restricted to symlinks or regular files
+static long pick_file(const Sample *s, bool link) {
+    long candidates[s->n_files];
+    long n = 0;
+    for (long i = 0; i < s->n_files; i++) {
+        if (s->is_link[i] == link) candidates[n++] = i;
+    }
+    return n ? candidates[pick(n)] : -1;
+}
+
+// stat() of random attribute files
+static void run_stat(const Sample *s, Result *r) {
+    char path[PATH_MAX];
+    for (long i = 0; i < opt.ops; i++) {
+        path_of(path, sizeof(path), s->records[pick(s->n_records)], s->files[pick(s->n_files)]);
+
+        struct stat st;
+        uint64_t t0 = now_ns();
+        bool ok = lstat(path, &st) == 0;
+        result_add(r, now_ns() - t0, ok);
+    }
+}
+
+static long read_dir_all(const char *path) {
+    DIR *dir = opendir(path);
+    if (!dir) return -1;
+
+    long n = 0;
+    while (readdir(dir)) n++;
+    closedir(dir);
+    return n;
+}
+
+// Full listing of random record directories
+static void run_readdir(const Sample *s, Result *r) {
+    char path[PATH_MAX];
+    for (long i = 0; i < opt.ops; i++) {
+        path_of(path, sizeof(path), s->records[pick(s->n_records)], NULL);
+
+        uint64_t t0 = now_ns();
+        long n = read_dir_all(path);
+        result_add(r, now_ns() - t0, n >= 0);
+        if (n > 0) r->items += n;
+    }
+}
+
+// Full listing of the table directory: few, long operations
+static void run_lstable(const Sample *s, Result *r) {
+    (void)s;
+    char path[PATH_MAX];
+    path_of(path, sizeof(path), NULL, NULL);
+
+    long runs = opt.ops < 10 ? opt.ops : 10;
+    for (long i = 0; i < runs; i++) {
+        uint64_t t0 = now_ns();
+        long n = read_dir_all(path);
+        result_add(r, now_ns() - t0, n >= 0);
+        if (n > 0) r->items += n;
+    }
+}
+
+static ssize_t read_file(const char *path, char *buf, const char *pattern, uint64_t *matches) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    ssize_t total = 0, n;
+    size_t plen = pattern ? strlen(pattern) : 0;
+    while ((n = read(fd, buf, READ_CHUNK)) > 0) {
+        total += n;
+        // Matches across two chunks are missed: good enough for a workload
+        if (plen && memmem(buf, n, pattern, plen)) (*matches)++;
+    }
+    close(fd);
+    return n < 0 ? -1 : total;
+}
+
+// Sequential read of whole random attribute files (no symlinks)
+static void run_read(const Sample *s, Result *r) {
+    char path[PATH_MAX];
+    char *buf = malloc(READ_CHUNK);
+    if (!buf) return;
+
+    for (long i = 0; i < opt.ops; i++) {
+        long f = pick_file(s, false);
+        if (f < 0) break;
+        path_of(path, sizeof(path), s->records[pick(s->n_records)], s->files[f]);
+
+        uint64_t t0 = now_ns();
+        ssize_t n = read_file(path, buf, NULL, NULL);
+        result_add(r, now_ns() - t0, n >= 0);
+        if (n > 0) r->bytes += n;
+    }
+    free(buf);
+}
+
+// readlink of a random FK attribute, then stat of the record it points to
+static void run_symlink(const Sample *s, Result *r) {
+    char path[PATH_MAX], target[PATH_MAX];
+    for (long i = 0; i < opt.ops; i++) {
+        long f = pick_file(s, true);
+        if (f < 0) break;
+        path_of(path, sizeof(path), s->records[pick(s->n_records)], s->files[f]);
+
+        struct stat st;
+        uint64_t t0 = now_ns();
+        bool ok = readlink(path, target, sizeof(target)) > 0 && stat(path, &st) == 0;
+        result_add(r, now_ns() - t0, ok);
+    }
+}
+
+// grep -r style: every regular attribute file of every sampled record,
+// in listing order, up to ops files
+static void run_scan(const Sample *s, Result *r) {
+    char path[PATH_MAX];
+    char *buf = malloc(READ_CHUNK);
+    if (!buf) return;
+
+    long done = 0;
+    for (long i = 0; i < s->n_records && done < opt.ops; i++) {
+        for (long f = 0; f < s->n_files && done < opt.ops; f++) {
+            if (s->is_link[f]) continue;
+            path_of(path, sizeof(path), s->records[i], s->files[f]);
+
+            uint64_t t0 = now_ns();
+            ssize_t n = read_file(path, buf, opt.pattern, &r->items);
+            result_add(r, now_ns() - t0, n >= 0);
+            if (n > 0) r->bytes += n;
+            done++;
+        }
+    }
+    free(buf);
+}
+
+typedef struct Workload {
+    const char *name;
+    void      (*run)(const Sample *s, Result *r);
+    const char *items;  // meaning of Result.items, NULL if unused
+} Workload;
+
+static const Workload workloads[] = {
+    { "stat",    run_stat,    NULL },
+    { "readdir", run_readdir, "entries" },
+    { "lstable", run_lstable, "entries" },
+    { "read",    run_read,    NULL },
+    { "symlink", run_symlink, NULL },
+    { "scan",    run_scan,    "matches" },
+};
+
+static bool selected(const char *name) {
+    size_t len = strlen(name);
+    for (const char *p = opt.workloads; p && *p; ) {
+        const char *end = strchr(p, ',');
+        size_t n = end ? (size_t)(end - p) : strlen(p);
+        if (n == len && strncmp(p, name, len) == 0) return true;
+        p = end ? end + 1 : NULL;
+    }
+    return false;
+}
+
+static void print_result(FILE *out, const Workload *w, Result *r, bool first) {
+    qsort(r->lat, r->n, sizeof(uint64_t), cmp_u64);
+
+    double secs = r->wall / 1e9;
+    fprintf(out, "%s    {\"workload\": \"%s\", \"ops\": %ld, \"errors\": %ld, \"seconds\": %.6f, "
+                 "\"ops_per_sec\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f",
+            first ? "" : ",\n", w->name, r->n, r->errors, secs,
+            secs > 0 ? r->n / secs : 0,
+            percentile_us(r, 0.50), percentile_us(r, 0.99), percentile_us(r, 1.0));
+    if (r->bytes) {
+        fprintf(out, ", \"bytes\": %llu, \"mb_per_sec\": %.2f",
+                (unsigned long long)r->bytes, secs > 0 ? r->bytes / secs / (1024 * 1024) : 0);
+    }
+    if (w->items) fprintf(out, ", \"%s\": %llu", w->items, (unsigned long long)r->items);
+    fprintf(out, "}");
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s -m <mountpoint> [-t table] [-n ops] [-r records]\n"
+            "          [-w stat,readdir,lstable,read,symlink,scan] [-p pattern]\n"
+            "          [-s seed] [-o output.json]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    const char *output = NULL;
+
+    int c;
+    while ((c = getopt(argc, argv, "m:t:n:r:w:p:s:o:h")) != -1) {
+        switch (c) {
+            case 'm': opt.mount = optarg; break;
+            case 't': opt.table = optarg; break;
+            case 'n': opt.ops = atol(optarg); break;
+            case 'r': opt.max_records = atol(optarg); break;
+            case 'w': opt.workloads = optarg; break;
+            case 'p': opt.pattern = optarg; break;
+            case 's': opt.seed = (unsigned int)atoi(optarg); break;
+            case 'o': output = optarg; break;
+            default:  usage(argv[0]); return 2;
+        }
+    }
+    if (!opt.mount || opt.ops <= 0 || opt.max_records <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    Sample sample = {0};
+    if (sample_table(&sample) != 0) return 1;
+
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "%s: %s\n", output, strerror(errno));
+        return 1;
+    }
+
+    fprintf(out, "{\n  \"mount\": \"%s\",\n  \"table\": \"%s\",\n  \"ops\": %ld,\n"
+                 "  \"records\": %ld,\n  \"seed\": %u,\n  \"results\": [\n",
+            opt.mount, opt.table, opt.ops, sample.n_records, opt.seed);
+
+    bool first = true;
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        const Workload *w = &workloads[i];
+        if (!selected(w->name)) continue;
+
+        // Same picks whatever the selection: every workload restarts the sequence
+        srand(opt.seed);
+
+        Result r = {0};
+        uint64_t t0 = now_ns();
+        w->run(&sample, &r);
+        r.wall = now_ns() - t0;
+
+        print_result(out, w, &r, first);
+        first = false;
+        free(r.lat);
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) fclose(out);
+
+    for (long i = 0; i < sample.n_records; i++) free(sample.records[i]);
+    for (long i = 0; i < sample.n_files; i++) free(sample.files[i]);
+    free(sample.records);
+    free(sample.files);
+    free(sample.is_link);
+    return 0;
+}
@@ -0,0 +1,144 @@
+import argparse
+import random
+import sqlite3
+import os
+
+# Scaled version of the initdb.py schema:
+#   users (composite PK) <- orders (composite FK) <- history <- history_2 <- ... <- history_<fk_depth - 1>
+# plus extra_<i> tables without foreign keys. Same seed, same database.
+
+BATCH = 10000
+
+
+def parse_args():
+    p = argparse.ArgumentParser(description="Generate a vfs2db benchmark database")
+    p.add_argument("path", help="database file to create (overwritten)")
+    p.add_argument("--users", type=int, default=1000, help="rows in users")
+    p.add_argument("--orders", type=int, default=10000, help="rows in orders")
+    p.add_argument("--history", type=int, default=10000, help="rows in history and in each deeper FK table")
+    p.add_argument("--fk-depth", type=int, default=2,
+                   help="FK hops from the deepest table to users (2 = history -> orders -> users, like initdb.py)")
+    p.add_argument("--extra-tables", type=int, default=0, help="additional tables without foreign keys")
+    p.add_argument("--extra-rows", type=int, default=1000, help="rows in each extra table")
+    p.add_argument("--text-size", type=int, default=32, help="bytes of product_name and of the extra payloads")
+    p.add_argument("--email-size", type=int, default=24, help="bytes of users.email")
+    p.add_argument("--blob-size", type=int, default=0, help="bytes of an orders.receipt BLOB column (0 = no column)")
+    p.add_argument("--seed", type=int, default=42)
+    return p.parse_args()
+
+
+def text(rng, size):
+    alphabet = "abcdefghijklmnopqrstuvwxyz"
+    return "".join(rng.choice(alphabet) for _ in range(size))
+
+
+def batched(rows):
+    batch = []
+    for row in rows:
+        batch.append(row)
+        if len(batch) == BATCH:
+            yield batch
+            batch = []
+    if batch:
+        yield batch
+
+
+def insert(c, sql, rows):
+    for batch in batched(rows):
+        c.executemany(sql, batch)
+
+
+def main():
+    args = parse_args()
+    rng = random.Random(args.seed)
+
+    if os.path.exists(args.path):
+        os.remove(args.path)
+
+    conn = sqlite3.connect(args.path)
+    c = conn.cursor()
+    c.execute("PRAGMA foreign_keys = ON;")
+    c.execute("PRAGMA journal_mode = OFF;")
+    c.execute("PRAGMA synchronous = OFF;")
+
+    receipt = ", receipt BLOB" if args.blob_size > 0 else ""
+
+    c.execute('''
+        CREATE TABLE users (
+            name TEXT,
+            surname TEXT,
+            email TEXT UNIQUE,
+            PRIMARY KEY (name, surname)
+        ) STRICT
+    ''')
+    c.execute(f'''
+        CREATE TABLE orders (
+            id INTEGER PRIMARY KEY AUTOINCREMENT,
+            product_name TEXT NOT NULL,
+            price REAL,
+            user_name TEXT NOT NULL,
+            user_surname TEXT NOT NULL{receipt},
+            FOREIGN KEY (user_name, user_surname) REFERENCES users (name, surname) ON DELETE CASCADE
+        ) STRICT
+    ''')
+
+    # history references orders, each deeper table references the previous one
+    chain = ["history" if d == 1 else f"history_{d}" for d in range(1, args.fk_depth)]
+    parent = "orders"
+    for table in chain:
+        fk = "order_id" if parent == "orders" else "parent_id"
+        c.execute(f'''
+            CREATE TABLE {table} (
+                id INTEGER PRIMARY KEY AUTOINCREMENT,
+                {fk} INTEGER NOT NULL,
+                FOREIGN KEY ({fk}) REFERENCES {parent} (id) ON DELETE CASCADE
+            ) STRICT
+        ''')
+        parent = table
+
+    for i in range(args.extra_tables):
+        c.execute(f"CREATE TABLE extra_{i} (id INTEGER PRIMARY KEY AUTOINCREMENT, payload TEXT) STRICT")
+
+    # (name, surname) is the primary key and email is UNIQUE: both start with the row number
+    users = [(f"name{i}", f"surname{i}") for i in range(args.users)]
+
+    def email(i):
+        prefix = f"{i}@"
+        return prefix + text(rng, max(args.email_size - len(prefix), 0))
+
+    insert(c, "INSERT INTO users (name, surname, email) VALUES (?, ?, ?)",
+           ((n, s, email(i)) for i, (n, s) in enumerate(users)))
+
+    def orders():
+        for _ in range(args.orders):
+            n, s = users[rng.randrange(len(users))]
+            row = (text(rng, args.text_size), round(rng.uniform(1, 2000), 2), n, s)
+            if args.blob_size > 0:
+                row += (rng.randbytes(args.blob_size),)
+            yield row
+
+    if args.blob_size > 0:
+        insert(c, "INSERT INTO orders (product_name, price, user_name, user_surname, receipt) VALUES (?, ?, ?, ?, ?)", orders())
+    else:
+        insert(c, "INSERT INTO orders (product_name, price, user_name, user_surname) VALUES (?, ?, ?, ?)", orders())
+
+    parent, parent_rows = "orders", args.orders
+    for table in chain:
+        fk = "order_id" if parent == "orders" else "parent_id"
+        insert(c, f"INSERT INTO {table} ({fk}) VALUES (?)",
+               ((rng.randrange(parent_rows) + 1,) for _ in range(args.history)))
+        parent, parent_rows = table, args.history
+
+    for i in range(args.extra_tables):
+        insert(c, f"INSERT INTO extra_{i} (payload) VALUES (?)",
+               ((text(rng, args.text_size),) for _ in range(args.extra_rows)))
+
+    conn.commit()
+
+    print(f"Database '{args.path}' created: {args.users} users, {args.orders} orders, "
+          f"{len(chain)} x {args.history} history rows, {args.extra_tables} extra tables.")
+    conn.close()
+
+
+if __name__ == "__main__":
+    main()
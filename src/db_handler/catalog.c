@@ -0,0 +1,917 @@
+#include "catalog.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "db_handler.h"
+
+/**
+ * Column Description
+ *
+ * A column as described by QUERY_GET_TABLE_INFO or by the catalog file,
+ * from which the Schema is built (see schema_build).
+ *
+ * name:     column name
+ * pk_pos:   position of the column in the primary key (1-based), 0 if not part of it
+ * fk_table: referenced table, NULL if the column is not a foreign key
+ * fk_to:    referenced column, NULL if the parent's primary key is implied
+ * fk_id:    foreign key constraint
+ */
+typedef struct ColInfo {
+    char *name;
+    int   pk_pos;
+    char *fk_table;
+    char *fk_to;
+    int   fk_id;
+} ColInfo;
+
+/**
+ * Table Description
+ *
+ * A table as listed by QUERY_GET_TABLES_NAME or by the catalog file.
+ *
+ * n_cols: number of cols, -1 if the columns aren't known (yet)
+ */
+typedef struct TableInfo {
+    char     *name;
+    bool      without_rowid;
+    uint64_t  sql_hash;
+    int       n_cols;
+    ColInfo  *cols;
+} TableInfo;
+
+/**
+ * Catalog File
+ *
+ * The catalog of a previous mount (see catalog_save): a table's columns
+ * are reused only while its CREATE statement (sql_hash) is the same.
+ * Nothing else about the file is trusted: a database copied or restored
+ * over the same inode keeps its schema_version counter, not its schema.
+ */
+typedef struct CatalogFile {
+    TableInfo *tables;
+    int        n_tables;
+} CatalogFile;
+
+// Current snapshot: read lock-free, replaced under catalog_lock
+static _Atomic(DbSchema*) catalog_current = NULL;
+static pthread_mutex_t    catalog_lock = PTHREAD_MUTEX_INITIALIZER;
+static char              *catalog_path = NULL;
+// Something the catalog file doesn't have yet was loaded
+static bool               catalog_dirty = false;
+
+static uint64_t catalog_hash(const char *sql) {
+    // FNV-1a
+    uint64_t h = 1469598103934665603ULL;
+    for (const char *p = sql; p && *p; p++) { h ^= (unsigned char)*p; h *= 1099511628211ULL; }
+    return h;
+}
+
+static char *strdup_or_null(const char *s) {
+    return s ? strdup(s) : NULL;
+}
+
+static void col_info_free(ColInfo *cols, int n) {
+    for (int i = 0; i < n; i++) {
+        free(cols[i].name);
+        free(cols[i].fk_table);
+        free(cols[i].fk_to);
+    }
+    free(cols);
+}
+
+static void table_info_free(TableInfo *tables, int n) {
+    for (int i = 0; i < n; i++) {
+        free(tables[i].name);
+        if (tables[i].n_cols > 0) col_info_free(tables[i].cols, tables[i].n_cols);
+    }
+    free(tables);
+}
+
+// =============================================================
+// Database
+// =============================================================
+
+/*
+ * Tables of the database, without their columns, from a single scan of
+ * sqlite_master.
+ */
+static int catalog_scan(TableInfo **tables, int *n_tables) {
+    LOG_DEBUG("catalog_scan\n");
+
+    DbConn *conn = db_reader();
+    sqlite3_stmt *pstmt = conn ? qm_get_static(&conn->qm, QUERY_GET_TABLES_NAME) : NULL;
+    if (!pstmt) {
+        if (conn) LOG_WARN("\t%s\n", sqlite3_errmsg(conn->db));
+        return -1;
+    }
+
+    TableInfo *list = NULL;
+    int n = 0, cap = 0;
+
+    int rc;
+    while ((rc = sqlite3_step(pstmt)) == SQLITE_ROW) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            TableInfo *grown = realloc(list, cap * sizeof(TableInfo));
+            if (!grown) break;
+            list = grown;
+        }
+
+        TableInfo *t = &list[n];
+        t->name = strdup((const char*)sqlite3_column_text(pstmt, 0));
+        if (!t->name) break;
+        t->without_rowid = sqlite3_column_int(pstmt, 1);
+        t->sql_hash = catalog_hash((const char*)sqlite3_column_text(pstmt, 2));
+        t->n_cols = -1;
+        t->cols = NULL;
+        n++;
+    }
+
+    qm_release(pstmt);
+    if (rc != SQLITE_DONE) {
+        table_info_free(list, n);
+        return -1;
+    }
+
+    *tables = list;
+    *n_tables = n;
+    return 0;
+}
+
+/*
+ * Columns of a table, from QUERY_GET_TABLE_INFO. A column taking part in
+ * several foreign keys is returned once per key: only the first one is kept.
+ */
+static int catalog_scan_columns(const char *table, ColInfo **cols, int *n_cols) {
+    LOG_DEBUG("catalog_scan_columns %s\n", table);
+
+    DbConn *conn = db_reader();
+    sqlite3_stmt *pstmt = conn ? qm_get_static(&conn->qm, QUERY_GET_TABLE_INFO) : NULL;
+    if (!pstmt) {
+        if (conn) LOG_WARN("\t%s\n", sqlite3_errmsg(conn->db));
+        return -1;
+    }
+
+    NameIndex seen;
+    int rc = sqlite3_bind_text(pstmt, 1, table, -1, SQLITE_STATIC);
+    if (rc != SQLITE_OK || ni_init(&seen, 16) != 0) {
+        qm_release(pstmt);
+        return -1;
+    }
+
+    ColInfo *list = NULL;
+    int n = 0, cap = 0;
+
+    while ((rc = sqlite3_step(pstmt)) == SQLITE_ROW) {
+        const char *name = (const char*)sqlite3_column_text(pstmt, 0);
+        if (!name || ni_get(&seen, name) >= 0) continue;
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            ColInfo *grown = realloc(list, cap * sizeof(ColInfo));
+            if (!grown) break;
+            list = grown;
+        }
+
+        ColInfo *c = &list[n];
+        c->name = strdup(name);
+        c->pk_pos = sqlite3_column_int(pstmt, 1);
+        c->fk_table = strdup_or_null((const char*)sqlite3_column_text(pstmt, 2));
+        c->fk_to = strdup_or_null((const char*)sqlite3_column_text(pstmt, 3));
+        c->fk_id = sqlite3_column_int(pstmt, 4);
+        n++;
+
+        if (!c->name || ni_put(&seen, c->name, n - 1) != 0) break;
+    }
+
+    ni_free(&seen);
+    qm_release(pstmt);
+    if (rc != SQLITE_DONE) {
+        col_info_free(list, n);
+        return -1;
+    }
+
+    *cols = list;
+    *n_cols = n;
+    return 0;
+}
+
+// =============================================================
+// Schemas
+// =============================================================
+
+static Schema *schema_new(const TableInfo *t) {
+    Schema *schema = calloc(1, sizeof(Schema));
+    if (!schema) return NULL;
+
+    schema->name = strdup(t->name);
+    if (!schema->name) {
+        free(schema);
+        return NULL;
+    }
+    schema->without_rowid = t->without_rowid;
+    schema->sql_hash = t->sql_hash;
+    atomic_init(&schema->loaded, false);
+    return schema;
+}
+
+static void schema_free(Schema *schema) {
+    for (int i = 0; i < schema->n_fks; i++) free(schema->fks[i]->resolve_sql);
+    ni_free(&schema->col_index);
+    free(schema->cols);
+    free(schema->name);
+    free(schema);
+}
+
+/**
+ * Build Foreign Key Plan
+ *
+ * @brief Builds, once per foreign key column, the join resolving a record
+ *        to the rowid of the record it references: every column of the
+ *        constraint (composite keys included) is matched in a single
+ *        indexed lookup. Left NULL when the referenced columns are implied
+ *        or either table is WITHOUT ROWID.
+ */
+static void build_fk_plan(const DbSchema *snap, Schema *schema, Fk *fk) {
+    // The join goes through both rowids (see resolve_fk_key for the other tables).
+    // Only listed, not loaded: without_rowid is known from the start
+    int ftable_id = ni_get(&snap->table_index, fk->table);
+    const Schema *fschema = ftable_id < 0 ? NULL : snap->tables[ftable_id];
+    if (schema->without_rowid || !fschema || fschema->without_rowid) return;
+
+    const char **from = malloc(2 * schema->n_fks * sizeof(char*));
+    if (!from) return;
+    const char **to = from + schema->n_fks;
+    int n = 0;
+
+    for (int i = 0; i < schema->n_fks; i++) {
+        const Fk *other = schema->fks[i];
+        if (other->id != fk->id) continue;
+        if (!other->to) {
+            free(from);
+            return;
+        }
+
+        from[n] = other->from;
+        to[n] = other->to;
+        n++;
+    }
+
+    fk->resolve_sql = qm_build_join_sql(QUERY_RESOLVE_FK, schema->name, fk->table, from, to, n);
+    LOG_DEBUG("	fk plan %s.%s: %s\n", schema->name, fk->from, fk->resolve_sql ? fk->resolve_sql : "(none)");
+    free(from);
+}
+
+static char *arena_copy(char **arena, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *copy = memcpy(*arena, s, len);
+    *arena += len;
+    return copy;
+}
+
+/**
+ * Build Schema
+ *
+ * @brief Fills the columns of a listed table: the columns, the key and
+ *        attribute lists, the foreign keys and every name go in a single
+ *        allocation, so that a table's schema is a few contiguous cache
+ *        lines rather than a pointer per name.
+ *
+ * @param snap Snapshot the referenced tables are looked up in
+ * @param cols Columns of the table, in table order
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int schema_build(const DbSchema *snap, Schema *schema, const ColInfo *cols, int n_cols) {
+    int n_pk = 0, n_attr = 0, n_fks = 0;
+    size_t strings = 0;
+
+    for (int i = 0; i < n_cols; i++) {
+        const ColInfo *c = &cols[i];
+        if (c->pk_pos > n_pk) n_pk = c->pk_pos;
+        // Foreign keys are tracked even when the column is part of the primary key
+        if (c->fk_table) {
+            n_fks++;
+            strings += strlen(c->fk_table) + 1 + (c->fk_to ? strlen(c->fk_to) + 1 : 0);
+        } else if (c->pk_pos == 0) {
+            n_attr++;
+        }
+        strings += strlen(c->name) + 1;
+    }
+    // Positions come from the database (or the catalog file): never past the columns
+    if (n_pk > n_cols) return -1;
+
+    // Pointer-sized members first, names last: no padding needed
+    size_t size = n_cols * sizeof(Column) + n_fks * sizeof(Fk)
+                + (n_cols + n_pk + n_attr + n_fks) * sizeof(char*) + strings;
+    char *mem = calloc(1, size ? size : 1);
+    if (!mem) return -1;
+    if (ni_init(&schema->col_index, n_cols) != 0) {
+        free(mem);
+        return -1;
+    }
+
+    Column *col = (Column*)mem;
+    Fk *fk = (Fk*)(col + n_cols);
+    char **col_names = (char**)(fk + n_fks);
+    char **pk = col_names + n_cols;
+    char **attr = pk + n_pk;
+    Fk **fks = (Fk**)(attr + n_attr);
+    char *arena = (char*)(fks + n_fks);
+
+    schema->cols = col;
+    schema->col_names = col_names;
+    schema->pk = pk;
+    schema->attr = attr;
+    schema->fks = fks;
+    schema->n_cols = n_cols;
+    schema->n_pk = n_pk;
+    schema->n_attr = 0;
+    schema->n_fks = 0;
+
+    for (int i = 0; i < n_cols; i++) {
+        const ColInfo *c = &cols[i];
+        col[i].name = col_names[i] = arena_copy(&arena, c->name);
+        col[i].is_pk = c->pk_pos > 0;
+        col[i].fk = NULL;
+        ni_put(&schema->col_index, col[i].name, i);
+
+        if (c->fk_table) {
+            Fk *f = &fk[schema->n_fks];
+            f->from = col[i].name;
+            f->table = arena_copy(&arena, c->fk_table);
+            // "to" is NULL when the parent's primary key is implied
+            f->to = c->fk_to ? arena_copy(&arena, c->fk_to) : NULL;
+            f->id = c->fk_id;
+            f->resolve_sql = NULL;
+            fks[schema->n_fks++] = f;
+            col[i].fk = f;
+        }
+
+        // Primary key in key order: the .pk paths list the values that way
+        if (col[i].is_pk) pk[c->pk_pos - 1] = col[i].name;
+        else if (!c->fk_table) attr[schema->n_attr++] = col[i].name;
+    }
+
+    for (int i = 0; i < schema->n_fks; i++) build_fk_plan(snap, schema, schema->fks[i]);
+    atomic_store_explicit(&schema->loaded, true, memory_order_release);
+    return 0;
+}
+
+// Whether table_id is in the snapshot under its name, i.e. not dropped
+static bool snapshot_live(const DbSchema *snap, int table_id) {
+    return ni_get(&snap->table_index, snap->tables[table_id]->name) == table_id;
+}
+
+/*
+ * Loads the columns of a table on first use. A dropped table has none
+ * left: its schema stays empty, and what refers to it fails as if missing.
+ */
+static Schema *catalog_load(const DbSchema *snap, int table_id) {
+    Schema *schema = snap->tables[table_id];
+    if (atomic_load_explicit(&schema->loaded, memory_order_acquire)) return schema;
+
+    pthread_mutex_lock(&catalog_lock);
+    if (!atomic_load_explicit(&schema->loaded, memory_order_relaxed)) {
+        ColInfo *cols = NULL;
+        int n_cols = 0;
+        bool live = snapshot_live(snap, table_id);
+
+        if (live && catalog_scan_columns(schema->name, &cols, &n_cols) != 0) {
+            LOG_WARN("catalog: can't load the columns of %s\n", schema->name);
+        } else if (schema_build(snap, schema, cols, n_cols) == 0) {
+            LOG_DEBUG("catalog: loaded %s, %d columns (%d pk, %d fks)\n", schema->name,
+                      schema->n_cols, schema->n_pk, schema->n_fks);
+            catalog_dirty = true;
+        }
+        col_info_free(cols, n_cols);
+    }
+    pthread_mutex_unlock(&catalog_lock);
+
+    return schema;
+}
+
+// =============================================================
+// Snapshots
+// =============================================================
+
+static DbSchema *snapshot_new(int cap) {
+    DbSchema *snap = calloc(1, sizeof(DbSchema));
+    if (!snap) return NULL;
+
+    snap->tables = malloc((cap > 0 ? cap : 1) * sizeof(Schema*));
+    if (!snap->tables || ni_init(&snap->table_index, cap) != 0) {
+        free(snap->tables);
+        free(snap);
+        return NULL;
+    }
+    return snap;
+}
+
+// Only the snapshot: its schemas are shared with the newer ones
+static void snapshot_free(DbSchema *snap) {
+    ni_free(&snap->table_index);
+    free(snap->tables);
+    free(snap);
+}
+
+/*
+ * Snapshot of the listed tables, the ones with known columns built right
+ * away (the referenced tables are all listed first).
+ */
+static DbSchema *snapshot_build(const TableInfo *tables, int n_tables, int64_t schema_version) {
+    DbSchema *snap = snapshot_new(n_tables);
+    if (!snap) return NULL;
+    snap->schema_version = schema_version;
+
+    for (int i = 0; i < n_tables; i++) {
+        Schema *schema = schema_new(&tables[i]);
+        if (!schema) break;
+        snap->tables[snap->n_tables++] = schema;
+        ni_put(&snap->table_index, schema->name, i);
+    }
+
+    if (snap->n_tables < n_tables) {
+        for (int i = 0; i < snap->n_tables; i++) schema_free(snap->tables[i]);
+        snapshot_free(snap);
+        return NULL;
+    }
+
+    for (int i = 0; i < n_tables; i++) {
+        if (tables[i].n_cols < 0) continue;
+        schema_build(snap, snap->tables[i], tables[i].cols, tables[i].n_cols);
+    }
+    return snap;
+}
+
+// =============================================================
+// Catalog File
+// =============================================================
+
+/*
+ * Text, one record per line, names length-prefixed ("<len>:<bytes>",
+ * "-" for NULL) since they may hold anything:
+ *
+ *   vfs2db-catalog 2
+ *   T <without_rowid> <n_cols|-1> <sql_hash> <name>
+ *   C <pk_pos> <fk_id> <name> <fk_table> <fk_to>      (n_cols times)
+ */
+
+static void cf_skip(const char **p, const char *end) {
+    while (*p < end && isspace((unsigned char)**p)) (*p)++;
+}
+
+static bool cf_int(const char **p, const char *end, long long *v) {
+    cf_skip(p, end);
+    char *e;
+    *v = strtoll(*p, &e, 10);
+    if (e == *p || e > end) return false;
+    *p = e;
+    return true;
+}
+
+static bool cf_uint(const char **p, const char *end, unsigned long long *v) {
+    cf_skip(p, end);
+    if (*p >= end || !isdigit((unsigned char)**p)) return false;
+    char *e;
+    *v = strtoull(*p, &e, 10);
+    if (e > end) return false;
+    *p = e;
+    return true;
+}
+
+static bool cf_str(const char **p, const char *end, char **s, bool nullable) {
+    cf_skip(p, end);
+    if (nullable && *p < end && **p == '-') {
+        (*p)++;
+        *s = NULL;
+        return true;
+    }
+
+    unsigned long long len;
+    if (!cf_uint(p, end, &len) || *p >= end || **p != ':' || len > (size_t)(end - *p - 1)) return false;
+    *s = strndup(*p + 1, len);
+    *p += 1 + len;
+    return *s != NULL;
+}
+
+static bool cf_tag(const char **p, const char *end, char tag) {
+    cf_skip(p, end);
+    if (*p >= end || **p != tag) return false;
+    (*p)++;
+    return true;
+}
+
+static void cf_put_str(FILE *f, const char *s) {
+    if (!s) {
+        fputs(" -", f);
+        return;
+    }
+    size_t len = strlen(s);
+    fprintf(f, " %zu:", len);
+    fwrite(s, 1, len, f);
+}
+
+static bool cf_parse_table(const char **p, const char *end, TableInfo *t) {
+    long long wr, n_cols;
+    unsigned long long hash;
+    if (!cf_int(p, end, &wr) || !cf_int(p, end, &n_cols) || !cf_uint(p, end, &hash)
+     || !cf_str(p, end, &t->name, false)) return false;
+
+    t->without_rowid = wr;
+    t->sql_hash = hash;
+    t->n_cols = -1;
+    t->cols = NULL;
+    // Every column takes a line: a count past the end of the file is garbage
+    if (n_cols < -1 || n_cols > end - *p) return false;
+    if (n_cols <= 0) {
+        t->n_cols = (int)n_cols;
+        return true;
+    }
+
+    t->cols = calloc(n_cols, sizeof(ColInfo));
+    if (!t->cols) return false;
+    t->n_cols = (int)n_cols;
+
+    for (int i = 0; i < t->n_cols; i++) {
+        ColInfo *c = &t->cols[i];
+        long long pk_pos, fk_id;
+        if (!cf_tag(p, end, 'C') || !cf_int(p, end, &pk_pos) || !cf_int(p, end, &fk_id)
+         || !cf_str(p, end, &c->name, false) || !cf_str(p, end, &c->fk_table, true)
+         || !cf_str(p, end, &c->fk_to, true)) return false;
+        if (pk_pos < 0 || pk_pos > n_cols) return false;
+        c->pk_pos = (int)pk_pos;
+        c->fk_id = (int)fk_id;
+    }
+    return true;
+}
+
+static int catalog_file_read(const char *path, CatalogFile *file) {
+    memset(file, 0, sizeof(*file));
+    if (!path) return -1;
+
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+
+    char *buf = NULL;
+    long size = -1;
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+        buf = malloc(size + 1);
+        if (buf && fread(buf, 1, size, f) != (size_t)size) {
+            free(buf);
+            buf = NULL;
+        }
+    }
+    fclose(f);
+    if (!buf) return -1;
+    buf[size] = '\0';
+
+    const char *p = buf, *end = buf + size;
+    const size_t magic_len = strlen(CATALOG_FILE_MAGIC);
+    bool ok = (size_t)size > magic_len && strncmp(p, CATALOG_FILE_MAGIC, magic_len) == 0
+           && isspace((unsigned char)p[magic_len]);
+    p += ok ? magic_len : 0;
+
+    int cap = 0;
+    while (ok && (cf_skip(&p, end), p < end)) {
+        if (file->n_tables == cap) {
+            cap = cap ? cap * 2 : 64;
+            TableInfo *grown = realloc(file->tables, cap * sizeof(TableInfo));
+            if (!grown) { ok = false; break; }
+            file->tables = grown;
+        }
+
+        TableInfo *t = &file->tables[file->n_tables];
+        memset(t, 0, sizeof(*t));
+        ok = cf_tag(&p, end, 'T') && cf_parse_table(&p, end, t);
+        // Kept even if incomplete, so that it's freed with the others
+        file->n_tables++;
+    }
+
+    free(buf);
+    if (!ok) {
+        LOG_WARN("catalog: ignoring %s, not a catalog file\n", path);
+        table_info_free(file->tables, file->n_tables);
+        memset(file, 0, sizeof(*file));
+        return -1;
+    }
+    return 0;
+}
+
+static int catalog_file_write(const char *path, const DbSchema *snap) {
+    size_t len = strlen(path) + sizeof(".tmp");
+    char *tmp = malloc(len);
+    if (!tmp) return -1;
+    snprintf(tmp, len, "%s.tmp", path);
+
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        free(tmp);
+        return -1;
+    }
+
+    fputs(CATALOG_FILE_MAGIC "\n", f);
+
+    for (int i = 0; i < snap->n_tables; i++) {
+        if (!snapshot_live(snap, i)) continue;
+
+        const Schema *schema = snap->tables[i];
+        bool loaded = atomic_load_explicit(&schema->loaded, memory_order_acquire);
+        fprintf(f, "T %d %d %llu", schema->without_rowid, loaded ? schema->n_cols : -1,
+                (unsigned long long)schema->sql_hash);
+        cf_put_str(f, schema->name);
+        fputc('\n', f);
+        if (!loaded) continue;
+
+        for (int j = 0; j < schema->n_cols; j++) {
+            const Column *col = &schema->cols[j];
+            int pk_pos = 0;
+            for (int k = 0; col->is_pk && k < schema->n_pk; k++) {
+                if (schema->pk[k] == col->name) pk_pos = k + 1;
+            }
+
+            fprintf(f, "C %d %d", pk_pos, col->fk ? col->fk->id : 0);
+            cf_put_str(f, col->name);
+            cf_put_str(f, col->fk ? col->fk->table : NULL);
+            cf_put_str(f, col->fk ? col->fk->to : NULL);
+            fputc('\n', f);
+        }
+    }
+
+    // Written aside and renamed: a crash never leaves half a catalog
+    bool ok = !ferror(f);
+    ok = fclose(f) == 0 && ok;
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok) unlink(tmp);
+    free(tmp);
+    return ok ? 0 : -1;
+}
+
+// =============================================================
+// Catalog
+// =============================================================
+
+/**
+ * Initialize Catalog
+ *
+ * @brief Lists the tables of the database: their columns are only loaded
+ *        when a table is first used (see catalog_table). The catalog file
+ *        of a previous mount spares that work for every table whose
+ *        CREATE statement is still the same: sqlite_master is always
+ *        scanned, a single query.
+ *
+ * @param cache_path Catalog file, read now and written by catalog_save
+ *                   (NULL or "" to do without)
+ *
+ * @return 0 on success, -1 on failure
+ */
+int catalog_init(const char *cache_path) {
+    LOG_DEBUG("catalog_init\n");
+
+    free(catalog_path);
+    catalog_path = cache_path && *cache_path ? strdup(cache_path) : NULL;
+
+    sqlite3_int64 version;
+    if (get_schema_version(&version) != 0) return -1;
+
+    CatalogFile file;
+    bool cached = catalog_file_read(catalog_path, &file) == 0;
+
+    TableInfo *tables;
+    int n_tables;
+    if (catalog_scan(&tables, &n_tables) != 0) {
+        table_info_free(file.tables, file.n_tables);
+        return -1;
+    }
+
+    // Unchanged tables (same CREATE statement) take their columns from the file
+    NameIndex index = {0};
+    if (cached && ni_init(&index, file.n_tables) == 0) {
+        for (int i = 0; i < file.n_tables; i++) ni_put(&index, file.tables[i].name, i);
+    }
+    int reused = 0;
+    for (int i = 0; i < n_tables; i++) {
+        int j = ni_get(&index, tables[i].name);
+        TableInfo *old = j < 0 ? NULL : &file.tables[j];
+        if (!old || old->sql_hash != tables[i].sql_hash || old->without_rowid != tables[i].without_rowid) continue;
+
+        tables[i].n_cols = old->n_cols;
+        tables[i].cols = old->cols;
+        old->n_cols = -1;
+        old->cols = NULL;
+        reused++;
+    }
+    ni_free(&index);
+
+    DbSchema *snap = snapshot_build(tables, n_tables, version);
+    table_info_free(tables, n_tables);
+    // Rewritten at unmount unless it described exactly these tables
+    catalog_dirty = !cached || reused != n_tables || file.n_tables != n_tables;
+    table_info_free(file.tables, file.n_tables);
+    if (!snap) return -1;
+
+    LOG_INFO("catalog: %d tables, schema version %lld, %d from the catalog file\n", snap->n_tables,
+             (long long)version, reused);
+    atomic_store_explicit(&catalog_current, snap, memory_order_release);
+    return 0;
+}
+
+/**
+ * Refresh Catalog
+ *
+ * @brief Follows DDL run by another connection, once schema_version has
+ *        changed: only the tables created or redefined since get a new
+ *        (lazily loaded) schema, under a new id. The dropped or redefined
+ *        ones keep theirs, out of the name lookups, until the unmount.
+ *
+ * @return 1 if the schema changed, 0 if not, -1 on failure
+ */
+int catalog_refresh(void) {
+    DbSchema *old = atomic_load_explicit(&catalog_current, memory_order_acquire);
+    sqlite3_int64 version;
+    if (!old || get_schema_version(&version) != 0) return -1;
+    if (version == old->schema_version) return 0;
+
+    TableInfo *tables;
+    int n_tables;
+    if (catalog_scan(&tables, &n_tables) != 0) return -1;
+
+    pthread_mutex_lock(&catalog_lock);
+    old = atomic_load_explicit(&catalog_current, memory_order_relaxed);
+    if (version == old->schema_version) { // Refreshed by another thread meanwhile
+        pthread_mutex_unlock(&catalog_lock);
+        table_info_free(tables, n_tables);
+        return 0;
+    }
+
+    DbSchema *snap = snapshot_new(old->n_tables + n_tables);
+    if (!snap) {
+        pthread_mutex_unlock(&catalog_lock);
+        table_info_free(tables, n_tables);
+        return -1;
+    }
+    memcpy(snap->tables, old->tables, old->n_tables * sizeof(Schema*));
+    snap->n_tables = old->n_tables;
+    snap->schema_version = version;
+
+    int changed = 0;
+    for (int i = 0; i < n_tables; i++) {
+        int id = ni_get(&old->table_index, tables[i].name);
+        const Schema *schema = id < 0 ? NULL : old->tables[id];
+
+        if (!schema || schema->sql_hash != tables[i].sql_hash || schema->without_rowid != tables[i].without_rowid) {
+            Schema *created = schema_new(&tables[i]);
+            if (!created) continue;
+            id = snap->n_tables;
+            snap->tables[snap->n_tables++] = created;
+            changed++;
+        }
+        ni_put(&snap->table_index, snap->tables[id]->name, id);
+    }
+
+    snap->retired = old;
+    atomic_store_explicit(&catalog_current, snap, memory_order_release);
+    catalog_dirty = true;
+    pthread_mutex_unlock(&catalog_lock);
+
+    LOG_INFO("catalog: schema version %lld, %d tables created or redefined, %d retired\n",
+             (long long)version, changed, (int)old->table_index.count - (int)(snap->table_index.count - changed));
+    table_info_free(tables, n_tables);
+    return 1;
+}
+
+// Last catalog_check, CLOCK_MONOTONIC milliseconds
+static atomic_uint_least64_t catalog_checked_ms = 0;
+
+/**
+ * Check Catalog
+ *
+ * @brief Refreshes the catalog from the lookups in the root, at most
+ *        every CATALOG_CHECK_MS: DDL is then followed on every mount, not
+ *        only where the invalidation thread runs. The row cache is
+ *        cleared when the schema changed. Nothing to do on read-only
+ *        (immutable) mounts.
+ */
+void catalog_check(void) {
+    if (mount_opts.read_only) return;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+
+    uint_least64_t last = atomic_load_explicit(&catalog_checked_ms, memory_order_relaxed);
+    if (now - last < CATALOG_CHECK_MS) return;
+    // A single thread checks, the others go on with the current snapshot
+    if (!atomic_compare_exchange_strong(&catalog_checked_ms, &last, now)) return;
+
+    if (catalog_refresh() > 0) row_cache_clear();
+}
+
+/**
+ * Save Catalog
+ *
+ * @brief Writes the catalog file, if anything was loaded since it was
+ *        read: the next mount then skips the loading. Failures are only
+ *        logged, the file is a cache.
+ */
+void catalog_save(void) {
+    DbSchema *snap = atomic_load_explicit(&catalog_current, memory_order_acquire);
+    if (!snap || !catalog_path) return;
+
+    pthread_mutex_lock(&catalog_lock);
+    if (catalog_dirty) {
+        if (catalog_file_write(catalog_path, snap) == 0) catalog_dirty = false;
+        else LOG_WARN("catalog: can't write %s\n", catalog_path);
+    }
+    pthread_mutex_unlock(&catalog_lock);
+}
+
+/**
+ * Free Catalog
+ *
+ * @brief Releases every snapshot and schema: nothing may use the catalog
+ *        any longer.
+ */
+void catalog_free(void) {
+    DbSchema *snap = atomic_exchange_explicit(&catalog_current, NULL, memory_order_acq_rel);
+    if (snap) {
+        // The newest snapshot holds every schema ever created
+        for (int i = 0; i < snap->n_tables; i++) schema_free(snap->tables[i]);
+    }
+    while (snap) {
+        DbSchema *retired = snap->retired;
+        snapshot_free(snap);
+        snap = retired;
+    }
+
+    free(catalog_path);
+    catalog_path = NULL;
+}
+
+// =============================================================
+// Catalog Lookups
+// =============================================================
+
+// Number of table ids, dropped tables included
+int catalog_n_tables(void) {
+    DbSchema *snap = atomic_load_explicit(&catalog_current, memory_order_acquire);
+    return snap ? snap->n_tables : 0;
+}
+
+/**
+ * Table Name
+ *
+ * @brief Name of a table, without loading it (e.g. to list the root).
+ *
+ * @return the name, NULL if the table was dropped or redefined
+ */
+const char *catalog_table_name(int table_id) {
+    DbSchema *snap = atomic_load_explicit(&catalog_current, memory_order_acquire);
+    if (!snap || table_id < 0 || table_id >= snap->n_tables || !snapshot_live(snap, table_id)) return NULL;
+    return snap->tables[table_id]->name;
+}
+
+/**
+ * Table Id
+ *
+ * @param name Table name, not necessarily NUL terminated (see ni_get_n)
+ *
+ * @return the id of the live table called name, -1 if there is none
+ */
+int catalog_table_id(const char *name, size_t len) {
+    DbSchema *snap = atomic_load_explicit(&catalog_current, memory_order_acquire);
+    return snap ? ni_get_n(&snap->table_index, name, len) : -1;
+}
+
+/**
+ * Table Schema
+ *
+ * @brief Schema of a table, its columns loaded on first use. Stays valid
+ *        until the unmount, even once the table is dropped.
+ *
+ * @return the schema, NULL if table_id isn't a table id
+ */
+Schema *catalog_table(int table_id) {
+    DbSchema *snap = atomic_load_explicit(&catalog_current, memory_order_acquire);
+    if (!snap || table_id < 0 || table_id >= snap->n_tables) return NULL;
+    return catalog_load(snap, table_id);
+}
+
+Schema *catalog_get_table(const char *table) {
+    DbSchema *snap = atomic_load_explicit(&catalog_current, memory_order_acquire);
+    int i = snap ? ni_get(&snap->table_index, table) : -1;
+    return i < 0 ? NULL : catalog_load(snap, i);
+}
+
+const Column *catalog_get_column(const Schema *schema, const char *column) {
+    if (!schema) return NULL;
+    int i = ni_get(&schema->col_index, column);
+    return i < 0 ? NULL : &schema->cols[i];
+}
+
+const Fk *catalog_get_fk(const char *table, const char *column) {
+    const Column *col = catalog_get_column(catalog_get_table(table), column);
+    return col ? col->fk : NULL;
+}
@@ -0,0 +1,23 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "../utils/types.h"
+
+int           catalog_init(const char *cache_path);
+int           catalog_refresh(void);
+void          catalog_check(void);
+void          catalog_save(void);
+void          catalog_free(void);
+
+int           catalog_n_tables(void);
+const char   *catalog_table_name(int table_id);
+int           catalog_table_id(const char *name, size_t len);
+Schema       *catalog_table(int table_id);
+
+Schema       *catalog_get_table(const char *table);
+const Column *catalog_get_column(const Schema *schema, const char *column);
+const Fk     *catalog_get_fk(const char *table, const char *column);
+
+#endif // CATALOG_H
@@ -1,399 +1,931 @@
 #include "db_handler.h"
 
-int init_db_schema(DbSchema *db_schema) {
-    printf("init_db_schema\n");
-    sqlite3_stmt *pstmt;
+#include "../utils/arena.h"
 
-    int rc = sqlite3_prepare_v2(db, qm_get_query_str(QUERY_GET_TABLES_NAME), -1, &pstmt, NULL);
+/*
+ * Reader connection for a read of table: writes of the open group
+ * transaction that touched it are committed first (see group_commit_sync).
+ */
+static inline DbConn *db_reader_of(const char *table) {
+    group_commit_sync(table);
+    return db_reader();
+}
 
-    if (rc != SQLITE_OK) {
-        printf("\t%s\n", sqlite3_errmsg(db));
-        return -1;
+// Same as db_reader_of, for a read of the single row rowid of table
+static inline DbConn *db_reader_of_row(const char *table, sqlite3_int64 rowid) {
+    group_commit_sync_row(table, rowid);
+    return db_reader();
+}
+
+// =============================================================
+// Row Cache
+// =============================================================
+
+/**
+ * Load Row
+ *
+ * @brief Type, size and (up to ROW_CACHE_MAX_VALUE) value of every column
+ *        of a record, from a single query, ready for row_cache_put.
+ *
+ * @param cols       Filled with a malloc'd array of schema->n_cols columns
+ * @param generation Filled with row_cache_generation() read before the query
+ *
+ * @return 0 on success, 1 if the record doesn't exist, -1 on failure
+ */
+static int load_row(const Schema *schema, sqlite3_int64 rowid, RowCacheCol **cols, uint64_t *generation) {
+    DbConn *conn = db_reader_of_row(schema->name, rowid);
+    if (!conn) return -1;
+
+    const char *const *columns = (const char *const *)schema->col_names;
+
+    *generation = row_cache_generation();
+
+    // Tables without rowid fail here: their callers fall back to the per-attribute queries
+    sqlite3_stmt *pstmt = qm_get_columns(&conn->qm, QUERY_GET_ROW, schema->name, schema->sql_hash, columns, schema->n_cols);
+    if (!pstmt) return -1;
+
+    int rc = sqlite3_bind_int64(pstmt, 1, rowid);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int(pstmt, 2, ROW_CACHE_MAX_VALUE);
+    if (rc == SQLITE_OK) rc = sqlite3_step(pstmt);
+    if (rc != SQLITE_ROW) {
+        qm_release(pstmt);
+        return rc == SQLITE_DONE ? 1 : -1;
     }
 
-    int i = 0;
-    while ((rc = sqlite3_step(pstmt)) == SQLITE_ROW) {
-        const char *name = (const char*)sqlite3_column_text(pstmt, 0);
-        db_schema->tables[i] = malloc(sizeof(Schema));
-        db_schema->tables[i]->name = strdup(name);
-        i++;
+    RowCacheCol *row = calloc(schema->n_cols, sizeof(RowCacheCol));
+    if (!row) { qm_release(pstmt); return -1; }
+
+    for (int i = 0; i < schema->n_cols; i++) {
+        RowCacheCol *col = &row[i];
+        const char *t = (const char*)sqlite3_column_text(pstmt, 3 * i);
+        switch (t ? t[0] : 'n') {
+            case 'i': col->type = SQLITE_INTEGER; break;
+            case 'r': col->type = SQLITE_FLOAT; break;
+            case 't': col->type = SQLITE_TEXT; break;
+            case 'b': col->type = SQLITE_BLOB; break;
+            default:  col->type = SQLITE_NULL; break;
+        }
+        col->size = sqlite3_column_int64(pstmt, 3 * i + 1);
+        col->has_value = col->size <= ROW_CACHE_MAX_VALUE;
+        if (!col->has_value || col->size == 0) continue;
+
+        // Same bytes get_attribute_value would return
+        int k = 3 * i + 2;
+        const void *value = (sqlite3_column_type(pstmt, k) == SQLITE_BLOB)
+            ? sqlite3_column_blob(pstmt, k)
+            : (const void*)sqlite3_column_text(pstmt, k);
+        col->value = malloc(col->size + 1);
+        if (!col->value || !value || sqlite3_column_bytes(pstmt, k) != col->size) {
+            free(col->value);
+            col->value = NULL;
+            col->has_value = false;
+            continue;
+        }
+        memcpy(col->value, value, col->size);
+        col->value[col->size] = '\0';
     }
 
-    db_schema->n_tables = i;
+    qm_release(pstmt);
+    *cols = row;
     return 0;
 }
 
 /**
- * Initialize Schema Structure
- * @todo Handle error cases properly
- * 
- * @brief Initializes the Schema structure by retrieving table information
- *        from the database using PRAGMA statements.
- * 
- * @param schema Pointer to Schema structure to initialize
- * 
- * @return 0 on success, -1 on failure
+ * Get Cached Column
+ *
+ * @brief Serves an attribute from the row cache, loading its whole row on
+ *        a miss: getattr, getxattr and read of the same file then cost a
+ *        single query.
+ *
+ * @param with_value Whether out->value is wanted too
+ * @param out        Filled with the column (out->value, in the calling
+ *                   thread's arena, only if with_value)
+ *
+ * @return 0 on success, 1 if the cache can't serve the attribute (disabled,
+ *         not a rowid table...), -1 if the record doesn't exist
  */
-int init_schema(Schema *schema) {
-    printf("init_schema\n");
-    sqlite3_stmt *pstmt;
+static int get_cached_column(const Tokens *toks, bool with_value, RowCacheCol *out) {
+    const Schema *schema = catalog_table(toks->table_id);
+    if (!row_cache_enabled() || schema->without_rowid) return 1;
 
-    schema->n_pk = 0;
-    schema->n_attr = 0;
-    schema->n_fks = 0;
+    int idx = toks->col_id;
+    sqlite3_int64 rowid = toks->rowid;
 
-    // This query gets: column_name, is_pk, fk_table, fk_column_name
-    char query[1024];
-    snprintf(query, sizeof(query), qm_get_query_str(QUERY_GET_TABLE_INFO), schema->name, schema->name);
-    int rc = sqlite3_prepare_v2(db, query, -1, &pstmt, NULL);
+    if (row_cache_lookup(schema->name, rowid, idx, with_value, out) == 0) return 0;
 
-    if (rc != SQLITE_OK) {
-        printf("\t%s\n", sqlite3_errmsg(db));
-        return -1;
+    RowCacheCol *cols;
+    uint64_t generation;
+    int rc = load_row(schema, rowid, &cols, &generation);
+    if (rc != 0) return rc > 0 ? -1 : 1;
+
+    *out = cols[idx];
+    out->value = NULL;
+    if (with_value && cols[idx].value) {
+        out->value = arena_memdup(cols[idx].value, out->size);
+        if (!out->value) out->has_value = false;
     }
 
-    while ((rc = sqlite3_step(pstmt)) == SQLITE_ROW) {
-        const char *column_name = sqlite3_column_text(pstmt, 0);
-        const bool is_pk = sqlite3_column_int(pstmt, 1);
-        const char *fk_table = sqlite3_column_text(pstmt, 2);
-        const char *fk_column_name = sqlite3_column_text(pstmt, 3);
-
-        // Check if primary key
-        if (is_pk) {
-            // Add to schema pk field
-            schema->pk[schema->n_pk] = strdup(column_name);
-            schema->n_pk++;
-        }
-        // Check if foreign key
-        else if (fk_table != NULL) {
-            // Populate the schema fks field with the foreign key structure
-            Fk *fk = malloc(sizeof(Fk));
-            fk->from = strdup(column_name);
-            fk->table = strdup(fk_table);
-            fk->to = strdup(fk_column_name);
-
-            // Add fk to schema
-            schema->fks[schema->n_fks] = fk;
-            schema->n_fks++;
-        }
-        // Normal attribute
-        else {
-            // Add to schema attr field
-            schema->attr[schema->n_attr] = strdup(column_name);
-            schema->n_attr++;
-        }
+    row_cache_put(schema->name, rowid, cols, schema->n_cols, generation);
+    return 0;
+}
+
+// =============================================================
+// Record Lookups
+// =============================================================
+
+/*
+ * Binds the parts of the key of toks (see Tokens.value) from param on.
+ */
+static int bind_key(sqlite3_stmt *pstmt, int param, const Tokens *toks) {
+    const char *part = toks->value;
+    for (int i = 0; i < toks->n_key; i++) {
+        size_t len = strlen(part);
+        int rc = sqlite3_bind_text(pstmt, param + i, part, (int)len, SQLITE_STATIC);
+        if (rc != SQLITE_OK) return rc;
+        part += len + 1;
     }
+    return SQLITE_OK;
 }
 
-int get_attribute_size(struct tokens* toks) {
-    printf("get_attribute_size\n");
-    sqlite3_stmt *pstmt;
+/*
+ * Statement of a query on the record of toks: selected by rowid, or by
+ * primary key in tables WITHOUT ROWID (see qm_get_keyed). Built for the
+ * table's current definition, which may have changed either.
+ */
+static sqlite3_stmt *get_record_stmt(DbConn *conn, QueryID qid, const Tokens *toks) {
+    const Schema *schema = catalog_table(toks->table_id);
+    bool keyed = schema->without_rowid;
 
-    printf("\ttoks:\n");
-    printf("\t\tattribute: %s\n", toks->attribute);
-    printf("\t\ttable: %s\n", toks->table);
-    printf("\t\trecord: %s\n", toks->record);
+    return qm_get_keyed(&conn->qm, qid, schema->name, toks->attribute, schema->sql_hash,
+                        keyed ? (const char *const *)schema->pk : NULL, keyed ? schema->n_pk : 0);
+}
 
-    char *query_fmt = "SELECT %s FROM %s WHERE rowid = ?";
-    char query_str[1024];
-    snprintf(query_str, sizeof(query_str), query_fmt, toks->attribute, toks->table);
-    printf("\tquery: %s\n", query_str);
+/*
+ * Binds the record of toks to a statement from get_record_stmt: its rowid,
+ * or the parts of its key, as TEXT. The columns' affinity converts them
+ * back (e.g. an INTEGER key column compares to 42, not '42').
+ */
+static int bind_record(sqlite3_stmt *pstmt, QueryID qid, const Tokens *toks) {
+    int param = qm_key_param(qid);
+    if (!catalog_table(toks->table_id)->without_rowid) return sqlite3_bind_int64(pstmt, param, toks->rowid);
 
-    int rc = sqlite3_prepare_v2(db,
-          (const char*) query_str,
-          -1, &pstmt, NULL);
+    return bind_key(pstmt, param, toks);
+}
+
+/**
+ * Lookup Primary Key
+ *
+ * @brief Looks the record of a .pk path up through the primary key index:
+ *        fills its rowid or, in tables WITHOUT ROWID (whose records have
+ *        none), only checks that it exists.
+ *
+ * @param toks Record by key (by_pk, depth >= 2)
+ *
+ * @return 0 on success, 1 if no record has the key, -1 on failure
+ */
+int lookup_pk(Tokens *toks) {
+    LOG_DEBUG("lookup_pk\n");
+
+    const Schema *schema = catalog_table(toks->table_id);
+    DbConn *conn = db_reader_of(schema->name);
+    if (!conn) return -1;
+
+    // Without rowid the first key column is read back from the same index
+    QueryID qid = schema->without_rowid ? QUERY_GET_ATTRIBUTE_TYPE : QUERY_GET_PK_ROWID;
+    sqlite3_stmt *pstmt = qm_get_keyed(&conn->qm, qid, schema->name, schema->without_rowid ? schema->pk[0] : NULL,
+                                       schema->sql_hash, (const char *const *)schema->pk, schema->n_pk);
+    if (!pstmt) {
+        LOG_WARN("\t%s\n", sqlite3_errmsg(conn->db));
+        return -1;
+    }
+
+    int rc = bind_key(pstmt, qm_key_param(qid), toks);
+    if (rc == SQLITE_OK) rc = sqlite3_step(pstmt);
+    if (rc == SQLITE_ROW && !schema->without_rowid) toks->rowid = sqlite3_column_int64(pstmt, 0);
+
+    qm_release(pstmt);
+    if (rc == SQLITE_ROW) return 0;
+    return rc == SQLITE_DONE ? 1 : -1;
+}
+
+int get_attribute_size(const Tokens *toks) {
+    LOG_DEBUG("get_attribute_size\n");
+
+    RowCacheCol cached = {0};
+    int cached_rc = get_cached_column(toks, false, &cached);
+    if (cached_rc <= 0) return cached_rc == 0 ? (int)cached.size : -1;
+
+    DbConn *conn = db_reader_of_row(toks->table, toks->rowid);
+    if (!conn) return -1;
+
+    LOG_DEBUG("\ttoks:\n");
+    LOG_DEBUG("\t\tattribute: %s\n", toks->attribute);
+    LOG_DEBUG("\t\ttable: %s\n", toks->table);
+    LOG_DEBUG("\t\trecord: %lld\n", (long long)toks->rowid);
+
+    sqlite3_stmt *pstmt = get_record_stmt(conn, QUERY_GET_ATTRIBUTE, toks);
+    if (!pstmt) return -1;
+
+    int rc = bind_record(pstmt, QUERY_GET_ATTRIBUTE, toks);
+    if (rc != SQLITE_OK) { qm_release(pstmt); return -1; }
 
-    if (rc != SQLITE_OK) return -1;
-    rc = sqlite3_bind_text(pstmt, 1, toks->record, -1, SQLITE_TRANSIENT);
-    
-    if (rc != SQLITE_OK) { sqlite3_finalize(pstmt); return -1; }
     rc = sqlite3_step(pstmt);
 
     // If there's no record matching the query (should not be possible)
     if (rc != SQLITE_ROW) {
-        printf("\tNo record matching query\n");
-        sqlite3_finalize(pstmt);
+        LOG_DEBUG("\tNo record matching query\n");
+        qm_release(pstmt);
         return -1;
     }
 
     // Calculate the bytes of the attribute
-    size_t att_size = sqlite3_column_bytes(pstmt, 0);
-    printf("\tattribute_size: %ld", att_size);
-    if (att_size < 0) return -1;
+    int att_size = sqlite3_column_bytes(pstmt, 0);
+    LOG_DEBUG("\tattribute_size: %d\n", att_size);
 
-    sqlite3_finalize(pstmt);
+    qm_release(pstmt);
     return att_size; 
 }
 
-int get_attribute_value(struct tokens* toks, char **bytes, size_t *size) {
-    printf("get_attribute_value\n");
+/*
+ * Copy of size bytes of value (plus a NUL), in the calling thread's arena
+ * or malloc'd.
+ */
+static char *copy_value(const void *value, size_t size, bool in_arena) {
+    if (in_arena) return arena_memdup(value, size);
+
+    char *copy = malloc(size + 1);
+    if (!copy) return NULL;
+    if (size > 0) memcpy(copy, value, size);
+    copy[size] = '\0';
+    return copy;
+}
 
-    sqlite3_stmt *pstmt;
+static int attribute_value(const Tokens *toks, char **bytes, size_t *size, size_t max_size, bool in_arena) {
+    LOG_DEBUG("get_attribute_value\n");
 
-    char *query_fmt = "SELECT %s FROM %s WHERE rowid = ?";
-    char query_str[1024];
-    snprintf(query_str, sizeof(query_str), query_fmt, toks->attribute, toks->table);
-    printf("\tquery: %s\n", query_str);
-    
-    int rc = sqlite3_prepare_v2(db, query_str, -1, &pstmt, NULL);
-    if (rc != SQLITE_OK) return -1;
+    // Small values come straight from the row cache, larger ones are only
+    // checked against max_size there
+    RowCacheCol cached = {0};
+    int cached_rc = get_cached_column(toks, true, &cached);
+    if (cached_rc < 0) return -1;
+    if (cached_rc == 0 && ((size_t)cached.size > max_size || cached.has_value)) {
+        *size = (size_t)cached.size;
+        if (*size > max_size) return 1;
+
+        *bytes = in_arena && cached.value ? cached.value : copy_value(cached.value, cached.value ? *size : 0, in_arena);
+        return *bytes ? 0 : -1;
+    }
+
+    DbConn *conn = db_reader_of_row(toks->table, toks->rowid);
+    if (!conn) return -1;
 
-    rc = sqlite3_bind_text(pstmt, 1, toks->record, -1, SQLITE_TRANSIENT);
-    if (rc != SQLITE_OK) { sqlite3_finalize(pstmt); return -1; }
+    sqlite3_stmt *pstmt = get_record_stmt(conn, QUERY_GET_ATTRIBUTE, toks);
+    if (!pstmt) return -1;
+
+    int rc = bind_record(pstmt, QUERY_GET_ATTRIBUTE, toks);
+    if (rc != SQLITE_OK) { qm_release(pstmt); return -1; }
 
     rc = sqlite3_step(pstmt);
     if (rc != SQLITE_ROW) {
-        printf("\tNo record matching query\n");
-        sqlite3_finalize(pstmt);
+        LOG_DEBUG("\tNo record matching query\n");
+        qm_release(pstmt);
         return -1;
     }
 
-    *bytes = strdup(sqlite3_column_text(pstmt, 0));
+    const void *value = (sqlite3_column_type(pstmt, 0) == SQLITE_BLOB)
+        ? sqlite3_column_blob(pstmt, 0)
+        : (const void*)sqlite3_column_text(pstmt, 0);
     *size = (size_t)sqlite3_column_bytes(pstmt, 0);
 
-    sqlite3_finalize(pstmt);
-    return 0;
+    if (*size > max_size) {
+        qm_release(pstmt);
+        return 1;
+    }
+
+    *bytes = copy_value(value, *size, in_arena);
+    qm_release(pstmt);
+    return *bytes ? 0 : -1;
 }
 
-int get_attribute_type(struct tokens *toks) {
-    printf("get_attribute_type\n");
+int get_attribute_value(const Tokens *toks, char **bytes, size_t *size) {
+    return attribute_value(toks, bytes, size, SIZE_MAX, false);
+}
 
-    sqlite3_stmt *pstmt;
+/**
+ * Get Attribute Value (bounded)
+ *
+ * @brief Copies the value of an attribute, unless it is larger than max_size.
+ *        The copy is NUL terminated, but binary values may contain NULs:
+ *        always rely on size.
+ *
+ * @param toks     Path tokens (table, record, attribute)
+ * @param bytes    Filled with a malloc'd copy of the value
+ * @param size     Filled with the size of the value in bytes
+ * @param max_size Largest value that will be copied
+ *
+ * @return 0 on success, 1 if the value is too large (bytes is left NULL
+ *         and size is set), -1 on failure
+ */
+int get_attribute_value_capped(const Tokens *toks, char **bytes, size_t *size, size_t max_size) {
+    return attribute_value(toks, bytes, size, max_size, false);
+}
 
-    char *query_fmt = "SELECT %s FROM %s WHERE rowid = ?";
-    char query_str[1024];
-    snprintf(query_str, sizeof(query_str), query_fmt, toks->attribute, toks->table);
-    printf("\tquery: %s\n", query_str);
-    
-    int rc = sqlite3_prepare_v2(db, query_str, -1, &pstmt, NULL);
-    if (rc != SQLITE_OK) return -1;
+/**
+ * Get Attribute Value (scratch)
+ *
+ * @brief Same as get_attribute_value, the copy in the calling thread's
+ *        arena: for values only needed until the operation returns.
+ */
+int get_attribute_value_arena(const Tokens *toks, char **bytes, size_t *size) {
+    return attribute_value(toks, bytes, size, SIZE_MAX, true);
+}
 
-    rc = sqlite3_bind_text(pstmt, 1, toks->record, -1, SQLITE_TRANSIENT);
-    if (rc != SQLITE_OK) { sqlite3_finalize(pstmt); return -1; }
+/**
+ * Get Data Version
+ *
+ * @brief PRAGMA data_version on the writer connection: it changes whenever
+ *        another connection (e.g. another process) commits, while our own
+ *        writes, all made on that connection, leave it untouched.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int get_data_version(sqlite3_int64 *version) {
+    DbConn *conn = db_writer_acquire();
+    sqlite3_stmt *pstmt = conn ? qm_get_static(&conn->qm, QUERY_GET_DATA_VERSION) : NULL;
 
-    rc = sqlite3_step(pstmt);
-    if (rc != SQLITE_ROW) {
-        printf("\tNo record matching query\n");
-        sqlite3_finalize(pstmt);
-        return -1;
-    }
+    int rc = pstmt ? sqlite3_step(pstmt) : SQLITE_ERROR;
+    if (rc == SQLITE_ROW) *version = sqlite3_column_int64(pstmt, 0);
 
-    int type = sqlite3_column_type(pstmt, 0);
-    
-    sqlite3_finalize(pstmt);
-    return type;
+    qm_release(pstmt);
+    db_writer_release(conn);
+    return rc == SQLITE_ROW ? 0 : -1;
 }
 
-int update_attribute_value(struct tokens* toks, const char* buffer, size_t size, int append) {
-    printf("update_attribute_value\n");
-    sqlite3_stmt *pstmt;
+/**
+ * Get Schema Version
+ *
+ * @brief PRAGMA schema_version: bumped by every DDL statement, whichever
+ *        connection runs it (see catalog_refresh).
+ *
+ * @return 0 on success, -1 on failure
+ */
+int get_schema_version(sqlite3_int64 *version) {
+    DbConn *conn = db_reader();
+    sqlite3_stmt *pstmt = conn ? qm_get_static(&conn->qm, QUERY_GET_SCHEMA_VERSION) : NULL;
 
-    const char* query = (append == 0) 
-        ? "UPDATE %s SET %s = ? WHERE rowid = ?"
-        : "UPDATE %s SET %s = \"%s\" || ? WHERE rowid = ?"; 
-    
-    char query_str[1024];
-    snprintf(query_str, sizeof(query_str), query, toks->table, toks->attribute, toks->attribute);
+    int rc = pstmt ? sqlite3_step(pstmt) : SQLITE_ERROR;
+    if (rc == SQLITE_ROW) *version = sqlite3_column_int64(pstmt, 0);
 
-    printf("\tquery_str: %s\n", query_str);
+    qm_release(pstmt);
+    return rc == SQLITE_ROW ? 0 : -1;
+}
 
-    int rc = sqlite3_prepare_v2(db, query_str, -1, &pstmt, NULL);
-    if (rc != SQLITE_OK) return -1;
+/**
+ * Get Record Attribute Sizes
+ *
+ * @brief Sizes of every attribute of a record, in catalog order, from a
+ *        single query: readdirplus fills the stat of a whole record
+ *        directory without one SELECT per attribute.
+ *
+ * @param toks  Record (table and rowid)
+ * @param sizes Filled with the size of each column of the table
+ *
+ * @return number of columns, -1 on failure or if the record doesn't exist
+ */
+int get_record_attribute_sizes(const Tokens *toks, off_t *sizes) {
+    LOG_DEBUG("get_record_attribute_sizes\n");
+
+    const Schema *schema = catalog_table(toks->table_id);
+    if (schema->n_cols == 0) return -1;
+
+    // With the row cache the same single query also fills the row: the
+    // getattr/read of the listed files that follow are served from it
+    if (row_cache_enabled() && !schema->without_rowid) {
+        RowCacheCol *cols;
+        uint64_t generation;
+        int rc = load_row(schema, toks->rowid, &cols, &generation);
+        if (rc > 0) return -1;
+        if (rc == 0) {
+            for (int i = 0; i < schema->n_cols; i++) sizes[i] = cols[i].size;
+            row_cache_put(schema->name, toks->rowid, cols, schema->n_cols, generation);
+            return schema->n_cols;
+        }
+    }
 
-    rc = sqlite3_bind_text(pstmt, 1, buffer, (int)size, SQLITE_TRANSIENT);
-    if (rc != SQLITE_OK) { sqlite3_finalize(pstmt); return -1; }
+    DbConn *conn = db_reader_of_row(schema->name, toks->rowid);
+    if (!conn) return -1;
 
-    rc = sqlite3_bind_text(pstmt, 2, toks->record, -1, SQLITE_TRANSIENT);
-    if (rc != SQLITE_OK) { sqlite3_finalize(pstmt); return -1; }
+    const char *const *columns = (const char *const *)schema->col_names;
 
-    rc = sqlite3_step(pstmt);
-    sqlite3_finalize(pstmt);
+    sqlite3_stmt *pstmt = schema->without_rowid
+        ? qm_get_columns_keyed(&conn->qm, QUERY_GET_RECORD_SIZES, schema->name, schema->sql_hash,
+                               columns, schema->n_cols, (const char *const *)schema->pk, schema->n_pk)
+        : qm_get_columns(&conn->qm, QUERY_GET_RECORD_SIZES, schema->name, schema->sql_hash, columns, schema->n_cols);
+    if (!pstmt) return -1;
 
-    return (rc == SQLITE_DONE) ? 0 : -1; 
-}
+    int rc = bind_record(pstmt, QUERY_GET_RECORD_SIZES, toks);
+    if (rc == SQLITE_OK) rc = sqlite3_step(pstmt);
+    if (rc != SQLITE_ROW) {
+        qm_release(pstmt);
+        return -1;
+    }
 
-void make_root_select(sqlite3_stmt **pstmt) {
-    int rc = sqlite3_prepare_v2(db,
-          "SELECT name FROM sqlite_schema WHERE type = 'table' AND name NOT LIKE 'sqlite_%';",
-          -1, pstmt, NULL);
-    if (rc != SQLITE_OK) printf("Not okay...\n");
-}
+    for (int i = 0; i < schema->n_cols; i++) {
+        sizes[i] = sqlite3_column_int64(pstmt, i);
+    }
 
-void make_table_select(sqlite3_stmt **pstmt, const char *table) {
-    char *query_fmt = "SELECT rowid from %s";
-    char query_str[1024];
-    snprintf(query_str, sizeof(query_str), query_fmt, table);
-    int rc = sqlite3_prepare_v2(db,
-             (const char*)query_str,
-             -1, pstmt, NULL);
+    qm_release(pstmt);
+    return schema->n_cols;
 }
 
-void make_record_select(sqlite3_stmt **pstmt, const char *table) {
-    char *query_fmt = "SELECT name FROM pragma_table_info(\"%s\");";
-    char query_str[1024];
-    snprintf(query_str, sizeof(query_str), query_fmt, table);
-    int rc = sqlite3_prepare_v2(db,
-          (const char*)query_str,
-          -1, pstmt, NULL);
+/*
+ * Opens an incremental I/O handle on the TEXT or BLOB attribute of toks,
+ * on conn. Fails for other types, for tables WITHOUT ROWID and, when
+ * writable, for indexed or key columns.
+ * Handles never outlive the call that opens them: a read-only one would
+ * pin the snapshot of the connection's reader, a writable one would keep
+ * the group transaction it writes in from committing.
+ */
+static sqlite3_blob *open_attribute_blob(DbConn *conn, const Tokens *toks, bool writable) {
+    sqlite3_blob *blob = NULL;
+    if (catalog_table(toks->table_id)->without_rowid) return NULL;
+
+    int rc = sqlite3_blob_open(conn->db, "main", toks->table, toks->attribute, toks->rowid, writable ? 1 : 0, &blob);
+    if (rc != SQLITE_OK) {
+        LOG_WARN("\t%s\n", sqlite3_errmsg(conn->db));
+        sqlite3_blob_close(blob);
+        return NULL;
+    }
+    return blob;
 }
 
-void get_table_fks(sqlite3_stmt **pstmt, const char *table) {
-    printf("get_table_fks\n");
+/**
+ * Get Attribute Blob Size
+ *
+ * @brief Size of a value that can be read (or, if writable, written) in
+ *        place, without loading it (see read_attribute_blob).
+ *
+ * @return size in bytes, -1 if the value can't be accessed in place
+ */
+int get_attribute_blob_size(const Tokens *toks, bool writable) {
+    LOG_DEBUG("get_attribute_blob_size\n");
+
+    DbConn *conn = writable ? db_writer_acquire() : db_reader_of_row(toks->table, toks->rowid);
+    if (!conn) return -1;
 
-    char* query_fmt = "SELECT * FROM pragma_foreign_key_list('%s')";
-    char query_str[1024];
-    snprintf(query_str, sizeof(query_str), query_fmt, table);
-    
-    printf("\tquery: %s\n", query_str);
+    sqlite3_blob *blob = open_attribute_blob(conn, toks, writable);
+    int res = blob ? sqlite3_blob_bytes(blob) : -1;
+    sqlite3_blob_close(blob);
 
-    int rc = sqlite3_prepare_v2(db, (const char*) query_str, -1, pstmt, NULL);
+    if (writable) db_writer_release(conn);
+    return res;
 }
 
-void get_foreign_table_attribute_name(struct tokens *toks, char **ftable, char **fattribute) {
-    printf("get_foreign_table_attribute_name\n");
-    sqlite3_stmt *pstmt;
+/**
+ * Read Attribute Blob
+ *
+ * @brief Reads up to size bytes at offset through incremental I/O, from
+ *        the current value.
+ *
+ * @return bytes read, -1 on failure
+ */
+int read_attribute_blob(const Tokens *toks, void *buffer, size_t size, off_t offset) {
+    DbConn *conn = db_reader_of_row(toks->table, toks->rowid);
+    if (!conn) return -1;
+
+    sqlite3_blob *blob = open_attribute_blob(conn, toks, false);
+    if (!blob) return -1;
+
+    int res = 0;
+    int bytes = sqlite3_blob_bytes(blob);
+    if (offset < bytes) {
+        if (size > (size_t)(bytes - offset)) size = bytes - offset;
+        res = sqlite3_blob_read(blob, buffer, (int)size, (int)offset) == SQLITE_OK ? (int)size : -1;
+    }
 
-    char* query_fmt = "SELECT \"table\", \"to\" FROM pragma_foreign_key_list('%s') WHERE \"from\" = '%s'";
-    char query_str[1024];
-    snprintf(query_str, sizeof(query_str), query_fmt, toks->table, toks->attribute);
-    
-    printf("\tquery: %s\n", query_str);
+    sqlite3_blob_close(blob);
+    return res;
+}
 
-    int rc = sqlite3_prepare_v2(db, (const char*) query_str, -1, &pstmt, NULL);
-    if (rc != SQLITE_OK) {
-        sqlite3_finalize(pstmt);
-        return;
+/**
+ * Write Attribute Blob
+ *
+ * @brief Overwrites size bytes at offset through incremental I/O. The
+ *        writes share a group transaction (see group_commit_hold), so a
+ *        value filled by many writes costs a few commits, not one each:
+ *        they are committed by commit_attribute_blob at the latest.
+ *        Incremental I/O can't change the size of the value: writes past
+ *        its end are refused.
+ *
+ * @return bytes written, -1 on failure or if the write doesn't fit
+ */
+int write_attribute_blob(const Tokens *toks, const void *buffer, size_t size, off_t offset) {
+    DbConn *conn = db_writer_acquire();
+    if (group_commit_hold(conn, toks->table, toks->rowid) != 0) { db_writer_release(conn); return -1; }
+
+    sqlite3_blob *blob = open_attribute_blob(conn, toks, true);
+
+    int res = -1;
+    if (blob && offset + size <= (size_t)sqlite3_blob_bytes(blob) &&
+        sqlite3_blob_write(blob, buffer, (int)size, (int)offset) == SQLITE_OK) {
+        res = (int)size;
     }
+    if (sqlite3_blob_close(blob) != SQLITE_OK) res = -1;
 
-    rc = sqlite3_step(pstmt);
+    // The row is invalidated once more when the group commits
+    if (res >= 0) group_commit_wrote(conn, size);
+    if (res >= 0) row_cache_invalidate(toks->table, toks->rowid);
 
-    *ftable = strdup(sqlite3_column_text(pstmt, 0));
-    *fattribute = strdup(sqlite3_column_text(pstmt, 1));
+    db_writer_release(conn);
+    return res;
+}
 
-    sqlite3_finalize(pstmt);
+/**
+ * Commit Attribute Blob
+ *
+ * @brief Commits the writes made by write_attribute_blob, on flush. With
+ *        group commit on, the group commits them on its own terms instead,
+ *        like any other write.
+ *
+ * @return 0 on success, -1 if the writes were lost
+ */
+int commit_attribute_blob(void) {
+    return group_commit_enabled() ? 0 : group_commit_flush();
 }
 
-int get_all_fkpk_relationships_length(const char *src_table, const char *dst_table) {
-    printf("get_all_fk_pk_relationships_length\n");
-    sqlite3_stmt *pstmt;
+int get_attribute_type(const Tokens *toks) {
+    LOG_DEBUG("get_attribute_type\n");
 
-    char* query_fmt = "SELECT COUNT(*) FROM pragma_foreign_key_list('%s') WHERE \"table\" = '%s'";
-    char query_str[1024];
-    snprintf(query_str, sizeof(query_str), query_fmt, src_table, dst_table);
+    RowCacheCol cached = {0};
+    int cached_rc = get_cached_column(toks, false, &cached);
+    if (cached_rc <= 0) return cached_rc == 0 ? cached.type : -1;
 
-    printf("\tquery: %s\n", query_str);
+    DbConn *conn = db_reader_of_row(toks->table, toks->rowid);
+    if (!conn) return -1;
 
-    int rc = sqlite3_prepare_v2(db, (const char*) query_str, -1, &pstmt, NULL);
-    if (rc != SQLITE_OK) {
-        sqlite3_finalize(pstmt);
+    // typeof() doesn't need to load the value
+    sqlite3_stmt *pstmt = get_record_stmt(conn, QUERY_GET_ATTRIBUTE_TYPE, toks);
+    if (!pstmt) return -1;
+
+    int rc = bind_record(pstmt, QUERY_GET_ATTRIBUTE_TYPE, toks);
+    if (rc != SQLITE_OK) { qm_release(pstmt); return -1; }
+
+    rc = sqlite3_step(pstmt);
+    if (rc != SQLITE_ROW) {
+        LOG_DEBUG("\tNo record matching query\n");
+        qm_release(pstmt);
         return -1;
     }
 
-    rc = sqlite3_step(pstmt);
+    const char *t = (const char*)sqlite3_column_text(pstmt, 0);
+    int type;
+    switch (t ? t[0] : 'n') {
+        case 'i': type = SQLITE_INTEGER; break;
+        case 'r': type = SQLITE_FLOAT; break;
+        case 't': type = SQLITE_TEXT; break;
+        case 'b': type = SQLITE_BLOB; break;
+        default:  type = SQLITE_NULL; break;
+    }
+    
+    qm_release(pstmt);
+    return type;
+}
+
+/**
+ * Update Attribute Value
+ *
+ * @brief Replaces the whole value of an attribute.
+ *
+ * @param as_blob Bind the buffer as a BLOB instead of TEXT
+ *
+ * @return 0 on success, -1 on failure
+ */
+int update_attribute_value(const Tokens *toks, const char* buffer, size_t size, bool as_blob) {
+    LOG_DEBUG("update_attribute_value\n");
+
+    DbConn *conn = db_writer_acquire();
+
+    // Group commit: the UPDATE joins the open transaction (rows WITHOUT
+    // ROWID have no rowid, the whole table counts as written)
+    bool cached_row = !catalog_table(toks->table_id)->without_rowid;
+    sqlite3_int64 rowid = toks->rowid;
+    if (group_commit_begin(conn, toks->table, cached_row ? &rowid : NULL) != 0) { db_writer_release(conn); return -1; }
+
+    sqlite3_stmt *pstmt = get_record_stmt(conn, QUERY_UPDATE_ATTRIBUTE, toks);
+    if (!pstmt) { db_writer_release(conn); return -1; }
 
-    int length = sqlite3_column_int(pstmt, 0);
+    // A NULL buffer would store NULL: empty values are bound as ""
+    if (!buffer) buffer = "";
 
-    sqlite3_finalize(pstmt);
+    int rc = as_blob
+        ? sqlite3_bind_blob64(pstmt, 1, buffer, size, SQLITE_STATIC)
+        : sqlite3_bind_text64(pstmt, 1, buffer, size, SQLITE_STATIC, SQLITE_UTF8);
+    if (rc == SQLITE_OK) rc = bind_record(pstmt, QUERY_UPDATE_ATTRIBUTE, toks);
+    if (rc == SQLITE_OK) rc = sqlite3_step(pstmt);
 
-    return length;
+    if (rc != SQLITE_DONE) LOG_WARN("\t%s\n", sqlite3_errmsg(conn->db));
+    qm_release(pstmt);
+
+    // Committed (autocommit): a reader can't cache the old value again.
+    // Inside a group the row is invalidated once more at commit
+    if (rc == SQLITE_DONE) group_commit_wrote(conn, size);
+    if (rc == SQLITE_DONE && cached_row) row_cache_invalidate(toks->table, toks->rowid);
+    db_writer_release(conn);
+
+    return (rc == SQLITE_DONE) ? 0 : -1; 
 }
 
-void get_all_fkpk_relationships(const char *src_table, const char *dst_table, struct pkfk_relation *pkfk) {
-    printf("get_all_fk_pk_relationships\n");
-    sqlite3_stmt *pstmt;
+/**
+ * Resize Attribute Value
+ *
+ * @brief Cuts the value of an attribute to size bytes, or pads it with
+ *        zeros, with a single UPDATE: the value never leaves the database.
+ *        Also preallocates a value to be filled in place (see
+ *        write_attribute_blob).
+ *
+ * @param keep    Keep the current value, otherwise it becomes size zeros
+ * @param as_blob Store the result as a BLOB instead of TEXT
+ *
+ * @return 0 on success, -1 on failure
+ */
+int resize_attribute_value(const Tokens *toks, size_t size, bool keep, bool as_blob) {
+    LOG_DEBUG("resize_attribute_value: %zu\n", size);
 
-    char* query_fmt = "SELECT \"from\", \"to\" FROM pragma_foreign_key_list('%s') WHERE \"table\" = '%s'";
-    char query_str[1024];
-    snprintf(query_str, sizeof(query_str), query_fmt, src_table, dst_table);
+    DbConn *conn = db_writer_acquire();
 
-    printf("\tquery: %s\n", query_str);
+    bool cached_row = !catalog_table(toks->table_id)->without_rowid;
+    sqlite3_int64 rowid = toks->rowid;
+    if (group_commit_begin(conn, toks->table, cached_row ? &rowid : NULL) != 0) { db_writer_release(conn); return -1; }
 
-    int rc = sqlite3_prepare_v2(db, (const char*) query_str, -1, &pstmt, NULL);
-    if (rc != SQLITE_OK) {
-        sqlite3_finalize(pstmt);
-        return;
-    }
+    sqlite3_stmt *pstmt = get_record_stmt(conn, QUERY_RESIZE_ATTRIBUTE, toks);
+    if (!pstmt) { db_writer_release(conn); return -1; }
 
-    int i = 0;
-    while ((rc = sqlite3_step(pstmt)) == SQLITE_ROW) {
-        const char *fk_name = (const char*)sqlite3_column_text(pstmt, 0);
-        const char *pk_name = (const char*)sqlite3_column_text(pstmt, 1);
+    int rc = sqlite3_bind_int64(pstmt, 1, (sqlite3_int64)size);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int(pstmt, 2, keep);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_int(pstmt, 3, as_blob);
+    if (rc == SQLITE_OK) rc = bind_record(pstmt, QUERY_RESIZE_ATTRIBUTE, toks);
+    if (rc == SQLITE_OK) rc = sqlite3_step(pstmt);
 
-        printf("\tfk_name: %s\n", fk_name);
-        printf("\tpk_name: %s\n", pk_name);
+    if (rc != SQLITE_DONE) LOG_WARN("\t%s\n", sqlite3_errmsg(conn->db));
+    qm_release(pstmt);
 
-        pkfk[i].fk_name = strdup(fk_name);
-        pkfk[i].pk_name = strdup(pk_name);
+    if (rc == SQLITE_DONE) group_commit_wrote(conn, size);
+    if (rc == SQLITE_DONE && cached_row) row_cache_invalidate(toks->table, toks->rowid);
+    db_writer_release(conn);
 
-        i++;
-    }
+    return (rc == SQLITE_DONE) ? 0 : -1;
 }
 
-void fill_fk_values(const char *table, const char *record, struct pkfk_relation *pkfk, int pkfk_length) {
-    printf("fill_fk_values\n");
+/*
+ * Keyset pagination: returns up to limit rowids greater than after_rowid
+ * and not greater than last_rowid (INT64_MAX for the whole table), in
+ * rowid order, so that each page costs O(limit) whatever the table size.
+ * The statement is owned by the query manager:
+ * callers must release it with qm_release, never sqlite3_finalize.
+ */
+void make_table_select(sqlite3_stmt **pstmt, const char *table, sqlite3_int64 after_rowid, sqlite3_int64 last_rowid, int limit) {
+    DbConn *conn = db_reader_of(table);
+    *pstmt = conn ? qm_get_dynamic(&conn->qm, QUERY_GET_TABLE_ROWIDS, table, NULL) : NULL;
+    if (!*pstmt) return;
+
+    if (sqlite3_bind_int64(*pstmt, 1, after_rowid) != SQLITE_OK
+     || sqlite3_bind_int64(*pstmt, 2, last_rowid) != SQLITE_OK
+     || sqlite3_bind_int(*pstmt, 3, limit) != SQLITE_OK) {
+        qm_release(*pstmt);
+        *pstmt = NULL;
+    }
+}
 
-    sqlite3_stmt *pstmt;
-    
-    int str_len = 0;
-    char query_str[1024];
-    str_len += snprintf(query_str + str_len, sizeof(query_str) - str_len, "SELECT ");
-    
-    int i;
-    for (i = 0; i < pkfk_length-1; i++) {
-        str_len += snprintf(query_str + str_len, sizeof(query_str) - str_len, "%s, ", pkfk[i].fk_name);
+/*
+ * Same pagination over the rows of a query directory: the filter value is
+ * bound as a parameter, so an index on the column serves the lookup.
+ */
+void make_where_select(sqlite3_stmt **pstmt, const Tokens *toks, sqlite3_int64 after_rowid, int limit) {
+    const Schema *schema = catalog_table(toks->table_id);
+    DbConn *conn = db_reader_of(schema->name);
+    *pstmt = conn ? qm_get_dynamic(&conn->qm, QUERY_GET_WHERE_ROWIDS, schema->name, schema->cols[toks->where_col].name) : NULL;
+    if (!*pstmt) return;
+
+    if (sqlite3_bind_text(*pstmt, 1, toks->value, toks->value_len, SQLITE_STATIC) != SQLITE_OK
+     || sqlite3_bind_int64(*pstmt, 2, after_rowid) != SQLITE_OK
+     || sqlite3_bind_int(*pstmt, 3, limit) != SQLITE_OK) {
+        qm_release(*pstmt);
+        *pstmt = NULL;
     }
-    str_len += snprintf(query_str + str_len, sizeof(query_str) - str_len, "%s FROM %s WHERE rowid = ?", pkfk[i].fk_name, table);
+}
 
-    printf("\tquery: %s\n", query_str);
+/**
+ * Match Filter
+ *
+ * @brief Whether a record below a query directory matches its filter.
+ *
+ * @return 1 if it matches, 0 if it doesn't (or doesn't exist), -1 on failure
+ */
+int match_where(const Tokens *toks) {
+    const Schema *schema = catalog_table(toks->table_id);
+    DbConn *conn = db_reader_of_row(schema->name, toks->rowid);
+    if (!conn) return -1;
 
-    int rc = sqlite3_prepare_v2(db, (const char*) query_str, -1, &pstmt, NULL);
-    if (rc != SQLITE_OK) {
-        printf("\t1 not okay...\n"); 
-        sqlite3_finalize(pstmt); 
-        return;
-    } 
-    
-    rc = sqlite3_bind_text(pstmt, 1, record, -1, SQLITE_TRANSIENT);
-    if (rc != SQLITE_OK) {
-        printf("\t2 not okay...\n"); 
-        sqlite3_finalize(pstmt); 
-        return;
-    } 
+    sqlite3_stmt *pstmt = qm_get_dynamic(&conn->qm, QUERY_MATCH_WHERE, schema->name, schema->cols[toks->where_col].name);
+    if (!pstmt) return -1;
 
-    rc = sqlite3_step(pstmt);
+    int rc = sqlite3_bind_int64(pstmt, 1, toks->rowid);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(pstmt, 2, toks->value, toks->value_len, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_step(pstmt);
+    qm_release(pstmt);
 
-    for (int i=0; i<pkfk_length; i++) {
-        pkfk[i].value = strdup(sqlite3_column_text(pstmt, i));
-    }
+    if (rc == SQLITE_ROW) return 1;
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+/*
+ * Same pagination over whole rows: column 0 is the rowid, then every column
+ * of the table in order. Rows with rowid in [first, last], up to limit.
+ */
+void make_rows_select(sqlite3_stmt **pstmt, const Schema *schema, sqlite3_int64 first, sqlite3_int64 last, int limit) {
+    *pstmt = NULL;
+    DbConn *conn = db_reader_of(schema->name);
+    if (!conn || schema->n_cols == 0) return;
 
-    sqlite3_finalize(pstmt);
+    const char *const *columns = (const char *const *)schema->col_names;
+
+    *pstmt = qm_get_columns(&conn->qm, QUERY_GET_ROWS, schema->name, schema->sql_hash, columns, schema->n_cols);
+    if (!*pstmt) return;
+
+    if (sqlite3_bind_int64(*pstmt, 1, first) != SQLITE_OK
+     || sqlite3_bind_int64(*pstmt, 2, last) != SQLITE_OK
+     || sqlite3_bind_int(*pstmt, 3, limit) != SQLITE_OK) {
+        qm_release(*pstmt);
+        *pstmt = NULL;
+    }
 }
 
-int get_rowid_from_pks(const char *table, struct pkfk_relation *pkfk, int pkfk_length) {
-    printf("get_rowid_from_pks\n");
-    sqlite3_stmt *pstmt;
-    
-    int str_len = 0;
-    char query_str[1024];
-    str_len += snprintf(query_str + str_len, sizeof(query_str) - str_len, "SELECT rowid FROM %s WHERE ", table);
-    
-    for (int i = 0; i < pkfk_length; i++) {
-        if (i > 0)
-            str_len += snprintf(query_str + str_len, sizeof(query_str) - str_len, " AND ");
-        str_len += snprintf(query_str + str_len, sizeof(query_str) - str_len, "%s = '%s'", pkfk[i].pk_name, pkfk[i].value);
+/*
+ * Primary keys of a table, for the .pk listing. With a rowid they come in
+ * rowid order with the same keyset pagination (column 0 is the rowid, then
+ * the key) and after is a rowid. Without one they come in key order from
+ * column 0 and after is the number of keys to skip: OFFSET pagination,
+ * since a readdir offset can't hold a key to resume from.
+ */
+void make_pk_select(sqlite3_stmt **pstmt, const Schema *schema, sqlite3_int64 after, int limit) {
+    *pstmt = NULL;
+    DbConn *conn = db_reader_of(schema->name);
+    if (!conn || schema->n_pk == 0) return;
+
+    QueryID qid = schema->without_rowid ? QUERY_GET_PK_KEYS_NOROWID : QUERY_GET_PK_KEYS;
+    *pstmt = qm_get_columns(&conn->qm, qid, schema->name, schema->sql_hash, (const char *const *)schema->pk, schema->n_pk);
+    if (!*pstmt) return;
+
+    int rc = schema->without_rowid
+        ? sqlite3_bind_int(*pstmt, 1, limit)
+        : sqlite3_bind_int64(*pstmt, 1, after);
+    if (rc == SQLITE_OK) {
+        rc = schema->without_rowid
+            ? sqlite3_bind_int64(*pstmt, 2, after)
+            : sqlite3_bind_int(*pstmt, 2, limit);
+    }
+    if (rc != SQLITE_OK) {
+        qm_release(*pstmt);
+        *pstmt = NULL;
     }
+}
 
-    printf("\tquery: %s\n", query_str);
+int get_foreign_table_attribute_name(const Tokens *toks, const char **ftable, const char **fattribute) {
+    LOG_DEBUG("get_foreign_table_attribute_name\n");
 
-    int rc = sqlite3_prepare_v2(db, (const char*) query_str, -1, &pstmt, NULL);
-    if (rc != SQLITE_OK) {
-        sqlite3_finalize(pstmt);
+    const Fk *fk = catalog_table(toks->table_id)->cols[toks->col_id].fk;
+    if (!fk) return -1;
+
+    *ftable = fk->table;
+    *fattribute = fk->to;
+    return 0;
+}
+
+/**
+ * Resolve Foreign Key
+ *
+ * @brief Rowid of the record referenced by a foreign key attribute, through
+ *        the plan built by build_fk_plan: one prepared, indexed lookup.
+ *
+ * @param toks   Foreign key attribute
+ * @param frowid Filled with the rowid of the referenced record
+ *
+ * @return 0 on success, 1 if the key is NULL or doesn't match any record,
+ *         -1 on failure
+ */
+int resolve_fk(const Tokens *toks, sqlite3_int64 *frowid) {
+    LOG_DEBUG("resolve_fk\n");
+
+    const Fk *fk = catalog_table(toks->table_id)->cols[toks->col_id].fk;
+    if (!fk || !fk->resolve_sql) return -1;
+
+    // The join reads the referenced table too
+    group_commit_sync(fk->table);
+    DbConn *conn = db_reader_of_row(toks->table, toks->rowid);
+    if (!conn) return -1;
+
+    sqlite3_stmt *pstmt = qm_get_prepared(&conn->qm, QUERY_RESOLVE_FK, toks->table, toks->attribute, fk->resolve_sql);
+    if (!pstmt) {
+        LOG_WARN("\t%s\n", sqlite3_errmsg(conn->db));
         return -1;
     }
 
-    rc = sqlite3_step(pstmt);
+    int rc = sqlite3_bind_int64(pstmt, 1, toks->rowid);
+    if (rc == SQLITE_OK) rc = sqlite3_step(pstmt);
+    if (rc == SQLITE_ROW) *frowid = sqlite3_column_int64(pstmt, 0);
 
-    int row_id = sqlite3_column_int(pstmt, 0);
-    sqlite3_finalize(pstmt);
-    return row_id;
-}
\ No newline at end of file
+    qm_release(pstmt);
+    if (rc == SQLITE_ROW) return 0;
+    return rc == SQLITE_DONE ? 1 : -1;
+}
+
+/**
+ * Resolve Foreign Key by Key
+ *
+ * @brief The attribute referenced by a foreign key attribute, as a .pk
+ *        path: its key is the value of the constraint's columns in the
+ *        current record, so the referenced table isn't even read.
+ *        Meant for composite keys and tables WITHOUT ROWID, which
+ *        resolve_fk can't handle: a single column between two rowid
+ *        tables keeps the rowid path.
+ *
+ * @param toks  Foreign key attribute
+ * @param ftoks Filled with the referenced attribute (by_pk)
+ *
+ * @return 0 on success, 1 if the key is NULL, 2 if the key path doesn't
+ *         apply (see above, or the constraint doesn't reference the
+ *         primary key, or a value can't be part of a path), -1 on failure
+ */
+int resolve_fk_key(const Tokens *toks, Tokens *ftoks) {
+    LOG_DEBUG("resolve_fk_key\n");
+
+    const Schema *schema = catalog_table(toks->table_id);
+    const Fk *fk = schema->cols[toks->col_id].fk;
+    int ftable_id = fk ? catalog_table_id(fk->table, strlen(fk->table)) : -1;
+    if (ftable_id < 0) return -1;
+
+    const Schema *fschema = catalog_table(ftable_id);
+    if (fschema->n_pk == 0) return 2;
+
+    // Columns of the constraint, in the order of the referenced key: matched
+    // by name or, when the key is implied, by position
+    int from[fschema->n_pk];
+    for (int k = 0; k < fschema->n_pk; k++) from[k] = -1;
+
+    int n = 0, self = -1;
+    for (int i = 0; i < schema->n_fks; i++) {
+        const Fk *other = schema->fks[i];
+        if (other->id != fk->id) continue;
+
+        int k = n;
+        if (other->to) {
+            for (k = 0; k < fschema->n_pk && strcmp(fschema->pk[k], other->to) != 0; k++);
+        }
+        if (k >= fschema->n_pk || from[k] >= 0) return 2;
+
+        from[k] = ni_get(&schema->col_index, other->from);
+        if (other == fk) self = k;
+        n++;
+    }
+    if (n != fschema->n_pk || self < 0) return 2;
+    if (n == 1 && !schema->without_rowid && !fschema->without_rowid) return 2;
+
+    ftoks->depth = 3;
+    ftoks->table_id = ftable_id;
+    ftoks->table = fschema->name;
+    ftoks->col_id = ni_get(&fschema->col_index, fschema->pk[self]);
+    ftoks->attribute = fschema->pk[self];
+    ftoks->rowid = 0;
+    ftoks->export = EXPORT_NONE;
+    ftoks->where = false;
+    ftoks->where_col = -1;
+    ftoks->by_pk = true;
+    ftoks->n_key = n;
+
+    // The values come from the row cache, like the getattr of the link
+    size_t len = 0;
+    for (int k = 0; k < n; k++) {
+        Tokens col = *toks;
+        col.col_id = from[k];
+        col.attribute = schema->cols[from[k]].name;
+
+        int type = get_attribute_type(&col);
+        if (type < 0) return -1;
+        if (type == SQLITE_NULL) return 1;
+        // Keys are matched as text: a BLOB wouldn't compare equal
+        if (type == SQLITE_BLOB) return 2;
+
+        char *bytes = NULL;
+        size_t size;
+        if (get_attribute_value_arena(&col, &bytes, &size) != 0) return -1;
+
+        bool fits = len + size + 1 <= sizeof(ftoks->value) && !memchr(bytes, '\0', size);
+        if (!fits) return 2;
+        memcpy(ftoks->value + len, bytes, size);
+        len += size;
+        ftoks->value[len++] = '\0';
+    }
+
+    ftoks->value_len = len;
+    return 0;
+}
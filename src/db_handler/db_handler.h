@@ -11,26 +11,39 @@
 #include <stddef.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "query_manager.h"
+#include "db_pool.h"
+#include "row_cache.h"
+#include "group_commit.h"
+#include "catalog.h"
 #include "../utils/types.h"
+#include "../utils/log.h"
 
-extern sqlite3 *db;
-
-int  init_db_schema(DbSchema *db_schema);
-int  init_schema(Schema *schema);
-
-int  get_attribute_size(struct tokens* toks);
-int  get_attribute_value(struct tokens* toks, char **bytes, size_t *size);
-int  get_attribute_type(struct tokens *toks);
-int  update_attribute_value(struct tokens* toks, const char *buffer, size_t size, int append);
-void make_root_select(sqlite3_stmt **pstmt);
-void make_table_select(sqlite3_stmt **pstmt, const char *table);
-void make_record_select(sqlite3_stmt **pstmt, const char *table);
-void get_table_fks(sqlite3_stmt **pstmt, const char *table);
-void get_foreign_table_attribute_name(struct tokens *toks, char **ftable, char **fattribute);
-int  get_all_fkpk_relationships_length(const char *src_table, const char *dst_table);
-void get_all_fkpk_relationships(const char *src_table, const char *dst_table, struct pkfk_relation *pkfk);
-void fill_fk_values(const char *table, const char *record, struct pkfk_relation *pkfk, int pkfk_length);
-int  get_rowid_from_pks(const char *table, struct pkfk_relation *pkfk, int pkfk_length);
+extern const char *db_path;
+extern MountOptions mount_opts;
+int  lookup_pk(Tokens *toks);
+int  get_attribute_size(const Tokens *toks);
+int  get_attribute_value(const Tokens *toks, char **bytes, size_t *size);
+int  get_attribute_value_capped(const Tokens *toks, char **bytes, size_t *size, size_t max_size);
+int  get_attribute_value_arena(const Tokens *toks, char **bytes, size_t *size);
+int  get_attribute_type(const Tokens *toks);
+int  get_data_version(sqlite3_int64 *version);
+int  get_schema_version(sqlite3_int64 *version);
+int  get_record_attribute_sizes(const Tokens *toks, off_t *sizes);
+int  get_attribute_blob_size(const Tokens *toks, bool writable);
+int  read_attribute_blob(const Tokens *toks, void *buffer, size_t size, off_t offset);
+int  write_attribute_blob(const Tokens *toks, const void *buffer, size_t size, off_t offset);
+int  commit_attribute_blob(void);
+int  update_attribute_value(const Tokens *toks, const char *buffer, size_t size, bool as_blob);
+int  resize_attribute_value(const Tokens *toks, size_t size, bool keep, bool as_blob);
+void make_table_select(sqlite3_stmt **pstmt, const char *table, sqlite3_int64 after_rowid, sqlite3_int64 last_rowid, int limit);
+void make_where_select(sqlite3_stmt **pstmt, const Tokens *toks, sqlite3_int64 after_rowid, int limit);
+int  match_where(const Tokens *toks);
+void make_pk_select(sqlite3_stmt **pstmt, const Schema *schema, sqlite3_int64 after, int limit);
+void make_rows_select(sqlite3_stmt **pstmt, const Schema *schema, sqlite3_int64 first, sqlite3_int64 last, int limit);
+int  get_foreign_table_attribute_name(const Tokens *toks, const char **ftable, const char **fattribute);
+int  resolve_fk(const Tokens *toks, sqlite3_int64 *frowid);
+int  resolve_fk_key(const Tokens *toks, Tokens *ftoks);
 
 #endif // DB_HANDLER_H
\ No newline at end of file
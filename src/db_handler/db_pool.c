@@ -0,0 +1,308 @@
+#include "db_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include "../utils/const.h"
+#include "../utils/log.h"
+
+static char               *pool_path = NULL;
+static char               *pool_uri = NULL;
+static const MountOptions *pool_opts = NULL;
+static bool                pool_readonly_readers = true;
+
+// Every open connection, so that db_pool_close can finalize them
+static DbConn          *pool_conns = NULL;
+static pthread_mutex_t  pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Reader connection of the calling FUSE worker thread
+static pthread_key_t    pool_reader_key;
+
+// Writes are serialized on a single connection
+static DbConn          *pool_writer = NULL;
+static pthread_mutex_t  pool_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// =============================================================
+// SQLite Tuning
+// =============================================================
+
+static const char *const journal_modes[] = { "delete", "truncate", "persist", "memory", "wal", "off", NULL };
+static const char *const sync_levels[]   = { "off", "normal", "full", "extra", "0", "1", "2", "3", NULL };
+static const char *const temp_stores[]   = { "default", "file", "memory", "0", "1", "2", NULL };
+
+static bool pragma_is_one_of(const char *value, const char *const *allowed) {
+    for (int i = 0; allowed[i]; i++) {
+        if (strcasecmp(value, allowed[i]) == 0) return true;
+    }
+    return false;
+}
+
+static bool pragma_is_integer(const char *value, bool negative) {
+    if (negative && *value == '-') value++;
+    if (*value == '\0' || strlen(value) > 18) return false;
+    return strspn(value, "0123456789") == strlen(value);
+}
+
+/**
+ * Check Mount Options
+ *
+ * @brief Validates the PRAGMA values given at mount time. They are pasted
+ *        in the PRAGMA statements (which can't take parameters), so only
+ *        the keywords and integers SQLite accepts get through.
+ *
+ * @return NULL if they are valid, the name of the first invalid option otherwise
+ */
+const char *db_pool_check_options(const MountOptions *opts) {
+    if (opts->journal_mode && !pragma_is_one_of(opts->journal_mode, journal_modes)) return "journal_mode";
+    if (opts->synchronous && !pragma_is_one_of(opts->synchronous, sync_levels)) return "synchronous";
+    if (opts->cache_size && !pragma_is_integer(opts->cache_size, true)) return "cache_size";
+    if (opts->mmap_size && !pragma_is_integer(opts->mmap_size, false)) return "mmap_size";
+    if (opts->temp_store && !pragma_is_one_of(opts->temp_store, temp_stores)) return "temp_store";
+    return NULL;
+}
+
+/*
+ * Per-connection PRAGMAs of the mount options: synchronous only matters to
+ * the writer, the others apply to every connection. A failure only leaves
+ * SQLite's default. Read-only mounts map the database unless told otherwise.
+ */
+static void db_conn_configure(sqlite3 *db, bool writer) {
+    char sql[256];
+    int n = 0;
+
+    if (writer && pool_opts->synchronous) {
+        n += snprintf(sql + n, sizeof(sql) - n, "PRAGMA synchronous=%s;", pool_opts->synchronous);
+    }
+    if (pool_opts->cache_size) n += snprintf(sql + n, sizeof(sql) - n, "PRAGMA cache_size=%s;", pool_opts->cache_size);
+    const char *mmap_size = pool_opts->mmap_size;
+    if (!mmap_size && pool_opts->read_only) mmap_size = RO_MMAP_SIZE;
+    if (mmap_size) n += snprintf(sql + n, sizeof(sql) - n, "PRAGMA mmap_size=%s;", mmap_size);
+    if (pool_opts->temp_store) n += snprintf(sql + n, sizeof(sql) - n, "PRAGMA temp_store=%s;", pool_opts->temp_store);
+    if (n == 0) return;
+
+    char *err = NULL;
+    if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+        LOG_WARN("%s: %s\n", sql, err ? err : sqlite3_errmsg(db));
+    }
+    sqlite3_free(err);
+}
+
+// =============================================================
+// Connection Pool
+// =============================================================
+
+static DbConn *db_conn_open(bool writer) {
+    DbConn *conn = calloc(1, sizeof(DbConn));
+    if (!conn) return NULL;
+
+    // FULLMUTEX: the writer is used by every thread, in turn
+    int flags = SQLITE_OPEN_FULLMUTEX;
+    if (pool_opts->read_only) flags |= SQLITE_OPEN_READONLY | SQLITE_OPEN_URI;
+    else flags |= (writer || !pool_readonly_readers) ? SQLITE_OPEN_READWRITE : SQLITE_OPEN_READONLY;
+
+    int rc = sqlite3_open_v2(pool_opts->read_only ? pool_uri : pool_path, &conn->db, flags, NULL);
+    if (rc != SQLITE_OK) {
+        LOG_ERROR("sqlite3_open_v2 failed: %s\n", sqlite3_errmsg(conn->db));
+        sqlite3_close(conn->db);
+        free(conn);
+        return NULL;
+    }
+
+    sqlite3_busy_timeout(conn->db, pool_opts->busy_timeout);
+    db_conn_configure(conn->db, writer);
+
+    if (qm_init(&conn->qm, conn->db) != 0) {
+        sqlite3_close(conn->db);
+        free(conn);
+        return NULL;
+    }
+
+    conn->writer = writer;
+
+    pthread_mutex_lock(&pool_lock);
+    conn->next = pool_conns;
+    pool_conns = conn;
+    pthread_mutex_unlock(&pool_lock);
+
+    return conn;
+}
+
+static void db_conn_close(DbConn *conn) {
+    pthread_mutex_lock(&pool_lock);
+    for (DbConn **p = &pool_conns; *p; p = &(*p)->next) {
+        if (*p == conn) { *p = conn->next; break; }
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    qm_cleanup(&conn->qm);
+    // close_v2: anything still open on the connection keeps it alive
+    sqlite3_close_v2(conn->db);
+    free(conn);
+}
+
+// Worker threads exiting take their reader connection with them
+static void db_reader_destructor(void *conn) {
+    if (conn) db_conn_close(conn);
+}
+
+/*
+ * URI of an immutable database: SQLite then skips locking and change
+ * detection altogether. '%', '?' and '#' are percent-encoded in the path.
+ */
+static char *db_immutable_uri(const char *path) {
+    static const char suffix[] = "?mode=ro&immutable=1";
+    char *uri = malloc(strlen("file:") + 3 * strlen(path) + sizeof(suffix));
+    if (!uri) return NULL;
+
+    char *p = stpcpy(uri, "file:");
+    for (const char *s = path; *s; s++) {
+        if (*s == '%' || *s == '?' || *s == '#') p += sprintf(p, "%%%02X", (unsigned char)*s);
+        else *p++ = *s;
+    }
+    strcpy(p, suffix);
+    return uri;
+}
+
+/**
+ * Open Connection Pool
+ *
+ * @brief Opens the writer connection and switches the database to the
+ *        journal mode of the mount options, WAL by default, so that
+ *        readers never block the writer nor each other.
+ *        Reader connections are opened lazily, one per FUSE worker
+ *        thread, read-only where the journal mode allows it.
+ *        Every connection is tuned by the mount options.
+ *        Read-only mounts open every connection, the writer included, on
+ *        the immutable database and leave its journal mode alone.
+ *
+ * @param path Database file
+ * @param opts Mount options, already checked by db_pool_check_options;
+ *             they must outlive the pool
+ *
+ * @return 0 on success, -1 on failure
+ */
+int db_pool_open(const char *path, const MountOptions *opts) {
+    pool_path = strdup(path);
+    if (!pool_path) return -1;
+    pool_opts = opts;
+    if (opts->read_only && !(pool_uri = db_immutable_uri(path))) return -1;
+
+    if (pthread_key_create(&pool_reader_key, db_reader_destructor) != 0) return -1;
+
+    pool_writer = db_conn_open(true);
+    if (!pool_writer) return -1;
+    if (opts->read_only) return 0;
+
+    // Without WAL a read-only connection can't recover a hot journal:
+    // keep readers read-write in that case
+    const char *journal_mode = opts->journal_mode ? opts->journal_mode : "wal";
+    char sql[64];
+    snprintf(sql, sizeof(sql), "PRAGMA journal_mode=%s;", journal_mode);
+
+    sqlite3_stmt *pstmt;
+    pool_readonly_readers = false;
+    if (sqlite3_prepare_v2(pool_writer->db, sql, -1, &pstmt, NULL) == SQLITE_OK) {
+        if (sqlite3_step(pstmt) == SQLITE_ROW) {
+            const char *mode = (const char*)sqlite3_column_text(pstmt, 0);
+            pool_readonly_readers = mode && strcmp(mode, "wal") == 0;
+            // e.g. WAL isn't available on some filesystems
+            if (mode && strcasecmp(mode, journal_mode) != 0) {
+                LOG_WARN("journal_mode=%s not applied, the database stays in %s mode\n", journal_mode, mode);
+            }
+        }
+        sqlite3_finalize(pstmt);
+    }
+
+    return 0;
+}
+
+/**
+ * Close Connection Pool
+ *
+ * @brief Finalizes the cached statements of every connection and closes
+ *        them. No other thread may use the pool anymore.
+ */
+void db_pool_close(void) {
+    // Deleting the key first: no destructor will run on the freed connections
+    pthread_key_delete(pool_reader_key);
+
+    pthread_mutex_lock(&pool_lock);
+    DbConn *conn = pool_conns;
+    pool_conns = NULL;
+    pthread_mutex_unlock(&pool_lock);
+
+    while (conn) {
+        DbConn *next = conn->next;
+        qm_cleanup(&conn->qm);
+        sqlite3_close_v2(conn->db);
+        free(conn);
+        conn = next;
+    }
+
+    pool_writer = NULL;
+    free(pool_path);
+    pool_path = NULL;
+    free(pool_uri);
+    pool_uri = NULL;
+}
+
+/**
+ * Get Reader Connection
+ *
+ * @return the calling thread's reader connection, NULL on failure
+ */
+DbConn *db_reader(void) {
+    DbConn *conn = pthread_getspecific(pool_reader_key);
+    if (conn) return conn;
+
+    conn = db_conn_open(false);
+    if (conn) pthread_setspecific(pool_reader_key, conn);
+    return conn;
+}
+
+/**
+ * Acquire Writer Connection
+ *
+ * @brief Locks the writer connection for the calling thread. Every
+ *        acquire must be paired with db_writer_release.
+ */
+DbConn *db_writer_acquire(void) {
+    pthread_mutex_lock(&pool_writer_lock);
+    return pool_writer;
+}
+
+void db_writer_release(DbConn *conn) {
+    (void)conn;
+    pthread_mutex_unlock(&pool_writer_lock);
+}
+
+static sqlite3_int64 db_status(sqlite3 *db, int op) {
+    int cur = 0, hiwtr = 0;
+    if (sqlite3_db_status(db, op, &cur, &hiwtr, 0) != SQLITE_OK) return 0;
+    return cur;
+}
+
+/**
+ * Pool Status
+ *
+ * @brief Sums the sqlite3_db_status counters of every open connection.
+ *        Connections are only closed after leaving pool_conns, so they
+ *        stay valid while the pool lock is held.
+ */
+void db_pool_status(DbPoolStatus *status) {
+    memset(status, 0, sizeof(*status));
+
+    pthread_mutex_lock(&pool_lock);
+    for (DbConn *conn = pool_conns; conn; conn = conn->next) {
+        status->connections++;
+        status->cache_used  += db_status(conn->db, SQLITE_DBSTATUS_CACHE_USED);
+        status->cache_hit   += db_status(conn->db, SQLITE_DBSTATUS_CACHE_HIT);
+        status->cache_miss  += db_status(conn->db, SQLITE_DBSTATUS_CACHE_MISS);
+        status->cache_write += db_status(conn->db, SQLITE_DBSTATUS_CACHE_WRITE);
+        status->stmt_used   += db_status(conn->db, SQLITE_DBSTATUS_STMT_USED);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
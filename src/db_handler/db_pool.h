@@ -0,0 +1,52 @@
+#ifndef DB_POOL_H
+#define DB_POOL_H
+
+#include <stdbool.h>
+#include <sqlite3.h>
+
+#include "query_manager.h"
+#include "../utils/types.h"
+
+/**
+ * Database Connection Structure
+ *
+ * db:     SQLite connection
+ * qm:     statement cache of the connection
+ * writer: whether this is the (only) connection allowed to write
+ * next:   next connection of the pool
+ */
+typedef struct DbConn {
+    sqlite3       *db;
+    QmCache        qm;
+    bool           writer;
+    struct DbConn *next;
+} DbConn;
+
+/**
+ * Pool Status (sqlite3_db_status summed over every connection)
+ *
+ * connections: open connections
+ * cache_used:  bytes of page cache in use
+ * cache_hit:   page cache hits
+ * cache_miss:  page cache misses
+ * cache_write: dirty pages written to the database file
+ * stmt_used:   bytes used by prepared statements
+ */
+typedef struct DbPoolStatus {
+    int           connections;
+    sqlite3_int64 cache_used;
+    sqlite3_int64 cache_hit;
+    sqlite3_int64 cache_miss;
+    sqlite3_int64 cache_write;
+    sqlite3_int64 stmt_used;
+} DbPoolStatus;
+
+const char *db_pool_check_options(const MountOptions *opts);
+int     db_pool_open(const char *path, const MountOptions *opts);
+void    db_pool_close(void);
+DbConn *db_reader(void);
+DbConn *db_writer_acquire(void);
+void    db_writer_release(DbConn *conn);
+void    db_pool_status(DbPoolStatus *status);
+
+#endif // DB_POOL_H
@@ -0,0 +1,437 @@
+#include "group_commit.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "row_cache.h"
+#include "../utils/log.h"
+
+// Tables tracked by name in a group: past that every table counts as written
+#define GC_MAX_TABLES 64
+// Rows remembered for the row cache: past that the group commits early
+#define GC_MAX_ROWS   65536
+// Bits of the filter of the written rows
+#define GC_ROW_BITS   65536
+// Held groups (see group_commit_hold): bytes and age past which they commit
+#define GC_HOLD_MAX_BYTES (64 * 1024 * 1024)
+#define GC_HOLD_MAX_MS    1000
+
+/**
+ * Written Row
+ *
+ * table: catalog name of the table
+ * rowid: rowid of the row, invalidated in the row cache at commit
+ */
+typedef struct GroupRow {
+    const char    *table;
+    sqlite3_int64  rowid;
+} GroupRow;
+
+static bool             gc_running = false;
+static unsigned int     gc_interval_ms = 0;
+static size_t           gc_max_bytes = 0;
+static pthread_t        gc_thread;
+
+/**
+ * Written Table
+ *
+ * name:  catalog name of the table
+ * whole: whether a write didn't name its row (tables WITHOUT ROWID):
+ *        every read of the table needs the group committed
+ */
+typedef struct GroupTable {
+    const char *name;
+    bool        whole;
+} GroupTable;
+
+// Protects gc_stopping, gc_opened_at, the written tables and the row filter
+static pthread_mutex_t  gc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   gc_cond;
+static bool             gc_stopping = false;
+
+// Open group transaction: only opened and ended with the writer connection
+// held, which also protects the counters and rows below.
+// Written rows are also set in a bit filter, so that reading the other
+// rows of a table doesn't end the group: a false positive only commits it
+// a bit early
+static atomic_bool      gc_open = false;
+static struct timespec  gc_opened_at;
+static GroupTable       gc_tables[GC_MAX_TABLES];
+static int              gc_n_tables = 0;
+static uint64_t         gc_row_filter[GC_ROW_BITS / 64];
+static GroupRow        *gc_rows = NULL;
+static size_t           gc_n_rows = 0;
+static size_t           gc_cap_rows = 0;
+static size_t           gc_bytes = 0;
+static uint64_t         gc_n_writes = 0;
+static bool             gc_max_rows_reached = false;
+static bool             gc_failed = false;
+
+static atomic_uint_least64_t gc_commits  = 0;
+static atomic_uint_least64_t gc_writes   = 0;
+static atomic_uint_least64_t gc_failures = 0;
+
+static size_t gc_row_bit(const char *table, sqlite3_int64 rowid) {
+    // FNV-1a over the table name and the rowid
+    uint64_t h = 1469598103934665603ULL;
+    for (const char *p = table; *p; p++) { h ^= (unsigned char)*p; h *= 1099511628211ULL; }
+    for (int i = 0; i < 8; i++) { h ^= (uint64_t)(rowid >> (i * 8)) & 0xff; h *= 1099511628211ULL; }
+    return h % GC_ROW_BITS;
+}
+
+// With gc_lock held: the written table named table, NULL if not written
+static const GroupTable *gc_find_table(const char *table) {
+    for (int i = 0; i < gc_n_tables && i < GC_MAX_TABLES; i++) {
+        if (strcmp(gc_tables[i].name, table) == 0) return &gc_tables[i];
+    }
+    return NULL;
+}
+
+/*
+ * Whether a read of table (of the row rowid, or of the whole table if NULL)
+ * could see a write of the open group. gc_lock held.
+ */
+static bool gc_is_dirty(const char *table, const sqlite3_int64 *rowid) {
+    if (gc_n_tables > GC_MAX_TABLES) return true;
+
+    const GroupTable *t = gc_find_table(table);
+    if (!t) return false;
+    if (!rowid || t->whole) return true;
+
+    size_t bit = gc_row_bit(table, *rowid);
+    return gc_row_filter[bit / 64] & (1ULL << (bit % 64));
+}
+
+// Commits the group without waiting for a reader to need it
+static void gc_end(DbConn *writer);
+static int  gc_begin(DbConn *writer, const char *table, const sqlite3_int64 *rowid);
+
+static void gc_sync(const char *table, const sqlite3_int64 *rowid) {
+    if (!atomic_load(&gc_open)) return;
+
+    pthread_mutex_lock(&gc_lock);
+    bool dirty = gc_is_dirty(table, rowid);
+    pthread_mutex_unlock(&gc_lock);
+    if (!dirty) return;
+
+    DbConn *conn = db_writer_acquire();
+    if (atomic_load(&gc_open)) gc_end(conn);
+    db_writer_release(conn);
+}
+
+static uint64_t gc_age_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - gc_opened_at.tv_sec) * 1000
+         + (now.tv_nsec - gc_opened_at.tv_nsec) / 1000000;
+}
+
+/*
+ * Commits the open group, with the writer connection held. A group already
+ * rolled back by an error (or whose COMMIT fails) is lost: the failure is
+ * reported by the next group_commit_flush, i.e. the next fsync.
+ * The written rows are invalidated again once committed: a reader may have
+ * cached their old value while the group was open.
+ */
+static void gc_end(DbConn *writer) {
+    bool ok = !sqlite3_get_autocommit(writer->db);
+    if (!ok) {
+        LOG_ERROR("group commit: transaction rolled back by an error, %llu writes lost\n",
+                  (unsigned long long)gc_n_writes);
+    } else {
+        char *err = NULL;
+        ok = sqlite3_exec(writer->db, "COMMIT;", NULL, NULL, &err) == SQLITE_OK;
+        if (!ok) {
+            LOG_ERROR("group commit: %s, %llu writes lost\n", err ? err : "COMMIT failed",
+                      (unsigned long long)gc_n_writes);
+            sqlite3_free(err);
+            sqlite3_exec(writer->db, "ROLLBACK;", NULL, NULL, NULL);
+        }
+    }
+
+    for (size_t i = 0; i < gc_n_rows; i++) row_cache_invalidate(gc_rows[i].table, gc_rows[i].rowid);
+
+    if (ok) {
+        atomic_fetch_add(&gc_commits, 1);
+        atomic_fetch_add(&gc_writes, gc_n_writes);
+    } else {
+        atomic_fetch_add(&gc_failures, 1);
+        gc_failed = true;
+    }
+
+    gc_n_rows = 0;
+    gc_bytes = 0;
+    gc_n_writes = 0;
+    gc_max_rows_reached = false;
+
+    pthread_mutex_lock(&gc_lock);
+    gc_n_tables = 0;
+    memset(gc_row_filter, 0, sizeof(gc_row_filter));
+    atomic_store(&gc_open, false);
+    pthread_mutex_unlock(&gc_lock);
+}
+
+// Commits the groups that have been open for gc_interval_ms
+static void *gc_worker(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&gc_lock);
+    while (!gc_stopping) {
+        if (!atomic_load(&gc_open)) {
+            pthread_cond_wait(&gc_cond, &gc_lock);
+            continue;
+        }
+
+        struct timespec deadline = gc_opened_at;
+        deadline.tv_sec  += gc_interval_ms / 1000;
+        deadline.tv_nsec += (long)(gc_interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) { deadline.tv_sec++; deadline.tv_nsec -= 1000000000L; }
+        if (pthread_cond_timedwait(&gc_cond, &gc_lock, &deadline) != ETIMEDOUT) continue;
+
+        // The writer connection comes first in the lock order
+        pthread_mutex_unlock(&gc_lock);
+        DbConn *conn = db_writer_acquire();
+        if (atomic_load(&gc_open) && gc_age_ms() >= gc_interval_ms) gc_end(conn);
+        db_writer_release(conn);
+        pthread_mutex_lock(&gc_lock);
+    }
+    pthread_mutex_unlock(&gc_lock);
+
+    return NULL;
+}
+
+/**
+ * Start Group Commit
+ *
+ * @brief Makes the writes through the mount share transactions: the first
+ *        write opens one, the following ones join it, and it is committed
+ *        once interval_ms have passed, max_bytes have been written or on
+ *        fsync, whichever comes first. Many small writes then cost a single
+ *        commit (and a single sync of the journal).
+ *        Reads of a row written by the open group (or of a whole table it
+ *        wrote to) commit it first, so they always see what was written
+ *        through the mount.
+ *
+ * @param interval_ms Longest a group stays open, 0 to leave group commit off
+ * @param max_bytes   Bytes written by a group before it commits
+ *
+ * @return 0 on success, -1 on failure
+ */
+int group_commit_start(unsigned int interval_ms, size_t max_bytes) {
+    if (interval_ms == 0) return 0;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    int rc = pthread_cond_init(&gc_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (rc != 0) return -1;
+
+    gc_interval_ms = interval_ms;
+    gc_max_bytes = max_bytes;
+    gc_stopping = false;
+
+    if (pthread_create(&gc_thread, NULL, gc_worker, NULL) != 0) {
+        pthread_cond_destroy(&gc_cond);
+        return -1;
+    }
+
+    gc_running = true;
+    return 0;
+}
+
+/**
+ * Stop Group Commit
+ *
+ * @brief Commits the open group, if any. Must run before the connection
+ *        pool is closed.
+ */
+void group_commit_stop(void) {
+    if (gc_running) {
+        pthread_mutex_lock(&gc_lock);
+        gc_stopping = true;
+        pthread_cond_signal(&gc_cond);
+        pthread_mutex_unlock(&gc_lock);
+        pthread_join(gc_thread, NULL);
+    }
+
+    group_commit_flush();
+    if (gc_running) pthread_cond_destroy(&gc_cond);
+    gc_running = false;
+
+    free(gc_rows);
+    gc_rows = NULL;
+    gc_cap_rows = 0;
+}
+
+bool group_commit_enabled(void) {
+    return gc_running;
+}
+
+/**
+ * Begin Group Write
+ *
+ * @brief Called with the writer connection held, before a write: opens a
+ *        group transaction unless one is already open, and marks the row
+ *        as written. When group commit is off, the write stays on its own
+ *        (autocommit): a group held by group_commit_hold is committed
+ *        first.
+ *
+ * @param table Catalog name of the table about to be written
+ * @param rowid Row about to be written, NULL if it has no rowid
+ *
+ * @return 0 on success, -1 if the transaction can't be opened
+ */
+int group_commit_begin(DbConn *writer, const char *table, const sqlite3_int64 *rowid) {
+    if (!gc_running) {
+        if (atomic_load(&gc_open)) gc_end(writer);
+        return 0;
+    }
+    return gc_begin(writer, table, rowid);
+}
+
+/**
+ * Hold Group Write
+ *
+ * @brief Same as group_commit_begin, for the writes that have to share a
+ *        transaction even when group commit is off (incremental I/O, see
+ *        write_attribute_blob). The group is then committed by
+ *        group_commit_flush, by the next write that doesn't hold it, or
+ *        once GC_HOLD_MAX_BYTES or GC_HOLD_MAX_MS are reached.
+ *
+ * @return 0 on success, -1 if the transaction can't be opened
+ */
+int group_commit_hold(DbConn *writer, const char *table, sqlite3_int64 rowid) {
+    return gc_begin(writer, table, &rowid);
+}
+
+static int gc_begin(DbConn *writer, const char *table, const sqlite3_int64 *rowid) {
+    // An error (e.g. SQLITE_FULL) rolled the open group back
+    if (atomic_load(&gc_open) && sqlite3_get_autocommit(writer->db)) gc_end(writer);
+
+    if (!atomic_load(&gc_open)) {
+        // IMMEDIATE: the write lock is taken now, not at the first write
+        if (sqlite3_exec(writer->db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) != SQLITE_OK) {
+            LOG_WARN("group commit: %s\n", sqlite3_errmsg(writer->db));
+            return -1;
+        }
+
+        pthread_mutex_lock(&gc_lock);
+        clock_gettime(CLOCK_MONOTONIC, &gc_opened_at);
+        atomic_store(&gc_open, true);
+        if (gc_running) pthread_cond_signal(&gc_cond);
+        pthread_mutex_unlock(&gc_lock);
+    }
+
+    // Remembered for the row cache, invalidated again at commit
+    bool commit = false;
+    if (rowid) {
+        if (gc_n_rows == gc_cap_rows) {
+            size_t cap = gc_cap_rows ? gc_cap_rows * 2 : 256;
+            GroupRow *rows = cap <= GC_MAX_ROWS ? realloc(gc_rows, cap * sizeof(GroupRow)) : NULL;
+            if (rows) {
+                gc_rows = rows;
+                gc_cap_rows = cap;
+            }
+        }
+
+        if (gc_n_rows < gc_cap_rows) gc_rows[gc_n_rows++] = (GroupRow){ table, *rowid };
+        else commit = true;
+    }
+
+    // Marked before the write: a reader that doesn't see the mark reads
+    // what was committed before the write started
+    pthread_mutex_lock(&gc_lock);
+    GroupTable *t = (GroupTable*)gc_find_table(table);
+    if (!t && gc_n_tables < GC_MAX_TABLES) {
+        t = &gc_tables[gc_n_tables++];
+        *t = (GroupTable){ table, false };
+    } else if (!t) {
+        // Too many tables: every table counts as written
+        gc_n_tables = GC_MAX_TABLES + 1;
+    }
+    if (t && !rowid) t->whole = true;
+    if (rowid) {
+        size_t bit = gc_row_bit(table, *rowid);
+        gc_row_filter[bit / 64] |= 1ULL << (bit % 64);
+    }
+    pthread_mutex_unlock(&gc_lock);
+
+    // No room left for the row: the group commits once it is written
+    if (commit) gc_max_rows_reached = true;
+    return 0;
+}
+
+/**
+ * Group Write Done
+ *
+ * @brief Called with the writer connection held, after a successful write
+ *        inside the group: commits it if max_bytes is reached.
+ *
+ * @param bytes Bytes written
+ */
+void group_commit_wrote(DbConn *writer, size_t bytes) {
+    if (!atomic_load(&gc_open)) return;
+
+    gc_n_writes++;
+    gc_bytes += bytes;
+
+    // Held groups have no worker to commit them after a while
+    bool full = gc_running ? gc_bytes >= gc_max_bytes
+                           : gc_bytes >= GC_HOLD_MAX_BYTES || gc_age_ms() >= GC_HOLD_MAX_MS;
+    if (full || gc_max_rows_reached) gc_end(writer);
+}
+
+/**
+ * Sync Group
+ *
+ * @brief Called before reading table on a reader connection, which can't
+ *        see the open group: commits it first if it wrote to the table.
+ *        Costs an atomic load when no group is open.
+ */
+void group_commit_sync(const char *table) {
+    gc_sync(table, NULL);
+}
+
+/**
+ * Sync Group Row
+ *
+ * @brief Same as group_commit_sync, for a read of a single row: the group
+ *        is only committed if it wrote to that row.
+ */
+void group_commit_sync_row(const char *table, sqlite3_int64 rowid) {
+    gc_sync(table, &rowid);
+}
+
+/**
+ * Flush Group
+ *
+ * @brief Commits the open group (fsync), held ones included.
+ *
+ * @return 0 on success, -1 if this or an earlier group since the last
+ *         flush was lost
+ */
+int group_commit_flush(void) {
+    if (!gc_running && !atomic_load(&gc_open)) return 0;
+
+    DbConn *conn = db_writer_acquire();
+    if (atomic_load(&gc_open)) gc_end(conn);
+
+    bool failed = gc_failed;
+    gc_failed = false;
+    db_writer_release(conn);
+
+    return failed ? -1 : 0;
+}
+
+void group_commit_get_stats(GroupCommitStats *stats) {
+    if (!stats) return;
+
+    stats->commits  = atomic_load(&gc_commits);
+    stats->writes   = atomic_load(&gc_writes);
+    stats->failures = atomic_load(&gc_failures);
+}
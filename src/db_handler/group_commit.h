@@ -0,0 +1,35 @@
+#ifndef GROUP_COMMIT_H
+#define GROUP_COMMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sqlite3.h>
+
+#include "db_pool.h"
+
+/**
+ * Group Commit Statistics
+ *
+ * commits:  group transactions committed
+ * writes:   writes committed by them
+ * failures: group transactions lost (failed commit or rolled back by an error)
+ */
+typedef struct GroupCommitStats {
+    uint64_t commits;
+    uint64_t writes;
+    uint64_t failures;
+} GroupCommitStats;
+
+int  group_commit_start(unsigned int interval_ms, size_t max_bytes);
+void group_commit_stop(void);
+bool group_commit_enabled(void);
+int  group_commit_begin(DbConn *writer, const char *table, const sqlite3_int64 *rowid);
+int  group_commit_hold(DbConn *writer, const char *table, sqlite3_int64 rowid);
+void group_commit_wrote(DbConn *writer, size_t bytes);
+void group_commit_sync(const char *table);
+void group_commit_sync_row(const char *table, sqlite3_int64 rowid);
+int  group_commit_flush(void);
+void group_commit_get_stats(GroupCommitStats *stats);
+
+#endif // GROUP_COMMIT_H
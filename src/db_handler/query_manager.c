@@ -1,20 +1,645 @@
 #include "query_manager.h"
 
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "../utils/arena.h"
+
+// Size in bytes of a column's value as a file: TEXT needs its size in bytes,
+// length() of a BLOB doesn't load its content
+#define SQL_VALUE_SIZE "CASE typeof(\"%1$s\") " \
+                           "WHEN 'text' THEN length(CAST(\"%1$s\" AS BLOB)) " \
+                           "ELSE ifnull(length(\"%1$s\"), 0) " \
+                       "END"
+
+// Value of the column resized to ?1 bytes: cut, or padded with zeros. With
+// ?2 = 0 the current value is discarded (zeros only, nothing is read)
+#define SQL_RESIZED_VALUE "CASE " \
+                              "WHEN ?2 = 0 OR \"%2$s\" IS NULL THEN zeroblob(?1) " \
+                              "WHEN length(CAST(\"%2$s\" AS BLOB)) >= ?1 THEN substr(CAST(\"%2$s\" AS BLOB), 1, ?1) " \
+                              "ELSE CAST(\"%2$s\" AS BLOB) || zeroblob(?1 - length(CAST(\"%2$s\" AS BLOB))) " \
+                          "END"
+
+// Dynamic templates use positional arguments: %1$s is the table, %2$s the column.
+// Both are already escaped as SQL identifiers when the template is expanded.
+// In column list queries %2$s is the comma separated expansion of
+// sql_column_store over every column.
+// In join queries %2$s is the AND of sql_column_store over every pair of
+// columns and %3$s is the joined table.
+// In the queries on a single record %3$s is the record predicate, see
+// sql_key_param: "rowid = ?N" or, on a key, "a" = ?N AND "b" = ?N+1...
 static const char* sql_store[] = {
-    [QUERY_GET_TABLES_NAME] = "SELECT name FROM sqlite_master WHERE type='table' AND name NOT LIKE 'sqlite_%';",
-    [QUERY_GET_TABLE_INFO]  = "SELECT " 
-                                    "ti.name AS column_name,"
-                                    "ti.pk AS is_pk,"
-                                    "fk.\"table\" AS fk_table,"
-                                    "fk.\"to\" AS fk_column_name "
-                              "FROM "
-                                    "pragma_table_info('%s') ti "
-                                    "LEFT JOIN "
-                                    "pragma_foreign_key_list('%s') fk "
-                              "ON ti.name = fk.\"from\";",
+    // Column 1: whether the table is WITHOUT ROWID, column 2: its CREATE statement
+    [QUERY_GET_TABLES_NAME]    = "SELECT name, "
+                                     "(SELECT wr FROM pragma_table_list WHERE schema='main' AND name = m.name), "
+                                     "sql "
+                                 "FROM sqlite_master AS m WHERE type='table' AND name NOT LIKE 'sqlite_%';",
+    [QUERY_GET_TABLE_INFO]     = "SELECT "
+                                     "ti.name AS column_name,"
+                                     "ti.pk AS is_pk,"
+                                     "fk.\"table\" AS fk_table,"
+                                     "fk.\"to\" AS fk_column_name,"
+                                     "fk.id AS fk_id "
+                                 "FROM "
+                                     "pragma_table_info(?1) ti "
+                                     "LEFT JOIN "
+                                     "pragma_foreign_key_list(?1) fk "
+                                 "ON ti.name = fk.\"from\";",
+    [QUERY_GET_DATA_VERSION]   = "PRAGMA data_version;",
+    [QUERY_GET_SCHEMA_VERSION] = "PRAGMA schema_version;",
+
+    [QUERY_GET_ATTRIBUTE]      = "SELECT \"%2$s\" FROM \"%1$s\" WHERE %3$s;",
+    [QUERY_GET_ATTRIBUTE_TYPE] = "SELECT typeof(\"%2$s\") FROM \"%1$s\" WHERE %3$s;",
+    [QUERY_UPDATE_ATTRIBUTE]   = "UPDATE \"%1$s\" SET \"%2$s\" = ?1 WHERE %3$s;",
+    // Stored as a BLOB if ?3, otherwise as TEXT
+    [QUERY_RESIZE_ATTRIBUTE]   = "UPDATE \"%1$s\" SET \"%2$s\" = CASE WHEN ?3 "
+                                     "THEN CAST(" SQL_RESIZED_VALUE " AS BLOB) "
+                                     "ELSE CAST(" SQL_RESIZED_VALUE " AS TEXT) "
+                                 "END WHERE %3$s;",
+    [QUERY_GET_TABLE_ROWIDS]   = "SELECT rowid FROM \"%1$s\" WHERE rowid > ?1 AND rowid <= ?2 ORDER BY rowid LIMIT ?3;",
+    // An index on the column also gives its rows in rowid order
+    [QUERY_GET_WHERE_ROWIDS]   = "SELECT rowid FROM \"%1$s\" WHERE \"%2$s\" = ?1 AND rowid > ?2 ORDER BY rowid LIMIT ?3;",
+    [QUERY_MATCH_WHERE]        = "SELECT 1 FROM \"%1$s\" WHERE rowid = ?1 AND \"%2$s\" = ?2;",
+    // Always on the primary key, through its index. No column: "%2$.0s"
+    // consumes the argument without printing it
+    [QUERY_GET_PK_ROWID]       = "SELECT rowid FROM \"%1$s\" WHERE %3$s;%2$.0s",
+
+    [QUERY_GET_RECORD_SIZES]   = "SELECT %2$s FROM \"%1$s\" WHERE %3$s;",
+    [QUERY_GET_ROW]            = "SELECT %2$s FROM \"%1$s\" WHERE rowid = ?1;",
+    [QUERY_GET_ROWS]           = "SELECT rowid, %2$s FROM \"%1$s\" WHERE rowid BETWEEN ?1 AND ?2 ORDER BY rowid LIMIT ?3;",
+    // Primary keys of a table (the columns are its pk), in rowid order...
+    [QUERY_GET_PK_KEYS]        = "SELECT rowid, %2$s FROM \"%1$s\" WHERE rowid > ?1 ORDER BY rowid LIMIT ?2;",
+    // ...or in key order without rowid, where there's nothing to resume from
+    [QUERY_GET_PK_KEYS_NOROWID]= "SELECT %2$s FROM \"%1$s\" ORDER BY %2$s LIMIT ?1 OFFSET ?2;",
+
+    [QUERY_RESOLVE_FK]         = "SELECT f.rowid FROM \"%1$s\" AS s JOIN \"%3$s\" AS f ON %2$s WHERE s.rowid = ?;",
 };
 
-char *qm_get_query_str(QueryID qid) {
+// Per-column expressions of the column list queries (%1$s is the column)
+// and of the join queries (%1$s on the left side, %2$s on the right one).
+static const char* sql_column_store[] = {
+    [QUERY_GET_RECORD_SIZES]   = SQL_VALUE_SIZE,
+    // Type, size and, only when not larger than ?2, the value itself
+    [QUERY_GET_ROW]            = "typeof(\"%1$s\"), "
+                                 SQL_VALUE_SIZE ", "
+                                 "CASE WHEN " SQL_VALUE_SIZE " <= ?2 THEN \"%1$s\" END",
+    [QUERY_GET_ROWS]           = "\"%1$s\"",
+    [QUERY_GET_PK_KEYS]        = "\"%1$s\"",
+    [QUERY_GET_PK_KEYS_NOROWID]= "\"%1$s\"",
+
+    // The referenced columns are a primary key or UNIQUE: the join is an index lookup
+    [QUERY_RESOLVE_FK]         = "s.\"%1$s\" = f.\"%2$s\"",
+};
+
+// First parameter of the record predicate (%3$s) of the queries on a
+// single record, 0 for the other queries
+static const int sql_key_param[QUERY_COUNT] = {
+    [QUERY_GET_ATTRIBUTE]      = 1,
+    [QUERY_GET_ATTRIBUTE_TYPE] = 1,
+    [QUERY_UPDATE_ATTRIBUTE]   = 2,
+    [QUERY_RESIZE_ATTRIBUTE]   = 4,
+    [QUERY_GET_PK_ROWID]       = 1,
+    [QUERY_GET_RECORD_SIZES]   = 1,
+};
+
+// =============================================================
+// Statement Cache
+// =============================================================
+
+/**
+ * Cache Entry
+ *
+ * qid:     query identifier
+ * table:   table the statement was built for (NULL for static queries)
+ * column:  column the statement was built for (NULL if not needed)
+ * version: definition of the table the SQL was built from (see qm_get_keyed)
+ * pstmt:   prepared statement owned by the cache
+ * next:    next entry in the same bucket
+ */
+struct QmEntry {
+    QueryID         qid;
+    char           *table;
+    char           *column;
+    uint64_t        version;
+    sqlite3_stmt   *pstmt;
+    struct QmEntry *next;
+};
+
+#define QM_INITIAL_BUCKETS 64
+
+static atomic_uint_least64_t qm_hits    = 0;
+static atomic_uint_least64_t qm_misses  = 0;
+static atomic_size_t         qm_entries = 0;
+
+static uint64_t qm_hash(QueryID qid, const char *table, const char *column) {
+    // FNV-1a over the key fields
+    uint64_t h = 1469598103934665603ULL ^ (uint64_t)qid;
+    h *= 1099511628211ULL;
+    for (const char *p = table; p && *p; p++) { h ^= (unsigned char)*p; h *= 1099511628211ULL; }
+    h ^= 0xff; h *= 1099511628211ULL;
+    for (const char *p = column; p && *p; p++) { h ^= (unsigned char)*p; h *= 1099511628211ULL; }
+    return h;
+}
+
+// Static queries come before QUERY_GET_ATTRIBUTE in QueryID
+static inline bool qm_is_static(QueryID qid) {
+    return qid < QUERY_GET_ATTRIBUTE;
+}
+
+// Column list queries come after the dynamic ones
+static inline bool qm_is_column_list(QueryID qid) {
+    return qid >= QUERY_GET_RECORD_SIZES && qid < QUERY_RESOLVE_FK;
+}
+
+// Join queries come last
+static inline bool qm_is_join(QueryID qid) {
+    return qid >= QUERY_RESOLVE_FK && qid < QUERY_COUNT;
+}
+
+static inline bool qm_str_eq(const char *a, const char *b) {
+    if (a == NULL || b == NULL) return a == b;
+    return strcmp(a, b) == 0;
+}
+
+static int qm_grow(QmCache *qm) {
+    size_t n_buckets = qm->n_buckets * 2;
+    QmEntry **buckets = calloc(n_buckets, sizeof(QmEntry*));
+    if (!buckets) return -1;
+
+    for (size_t i = 0; i < qm->n_buckets; i++) {
+        QmEntry *e = qm->buckets[i];
+        while (e) {
+            QmEntry *next = e->next;
+            size_t b = qm_hash(e->qid, e->table, e->column) % n_buckets;
+            e->next = buckets[b];
+            buckets[b] = e;
+            e = next;
+        }
+    }
+
+    free(qm->buckets);
+    qm->buckets = buckets;
+    qm->n_buckets = n_buckets;
+    return 0;
+}
+
+/**
+ * Build the predicate selecting a record
+ *
+ * @brief "rowid = ?N" without key columns, otherwise the AND of
+ *        "<column> = ?N" over the key columns, numbered from N on.
+ *
+ * @return sqlite3_malloc'd SQL fragment, NULL on failure
+ */
+static char *qm_build_key_sql(QueryID qid, const char *const *key, int n_key) {
+    int param = sql_key_param[qid] > 0 ? sql_key_param[qid] : 1;
+    if (!key || n_key <= 0) return sqlite3_mprintf("rowid = ?%d", param);
+
+    char *pred = NULL;
+    for (int i = 0; i < n_key; i++) {
+        char *next = pred
+            ? sqlite3_mprintf("%s AND \"%w\" = ?%d", pred, key[i], param + i)
+            : sqlite3_mprintf("\"%w\" = ?%d", key[i], param + i);
+        sqlite3_free(pred);
+        if (!next) return NULL;
+        pred = next;
+    }
+    return pred;
+}
+
+/**
+ * Build the SQL text of a query
+ *
+ * @brief Expands the template of a dynamic query with the escaped table and
+ *        column identifiers and the record predicate. Static queries are
+ *        returned as a copy.
+ *
+ * @return malloc'd SQL string, NULL on failure
+ */
+static char *qm_build_sql(QueryID qid, const char *table, const char *column,
+                          const char *const *key, int n_key) {
+    const char *tmpl = sql_store[qid];
+    if (qm_is_static(qid)) return strdup(tmpl);
+
+    // "%w" doubles the double-quotes, making the names safe as quoted identifiers
+    char *e_table  = sqlite3_mprintf("%w", table ? table : "");
+    char *e_column = sqlite3_mprintf("%w", column ? column : "");
+    char *pred     = qm_build_key_sql(qid, key, n_key);
+    char *sql = NULL;
+
+    if (e_table && e_column && pred) {
+        int len = snprintf(NULL, 0, tmpl, e_table, e_column, pred);
+        sql = len >= 0 ? malloc(len + 1) : NULL;
+        if (sql) snprintf(sql, len + 1, tmpl, e_table, e_column, pred);
+    }
+
+    sqlite3_free(e_table);
+    sqlite3_free(e_column);
+    sqlite3_free(pred);
+    return sql;
+}
+
+/**
+ * Build the SQL text of a column list query
+ *
+ * @brief Expands the per-column expression over every column, then the
+ *        template with the escaped table and the resulting list.
+ *
+ * @return malloc'd SQL string, NULL on failure
+ */
+static char *qm_build_columns_sql(QueryID qid, const char *table, const char *const *columns, int n_columns,
+                                  const char *const *key, int n_key) {
+    if (n_columns <= 0) return NULL;
+
+    // The expressions are built in the arena, then joined in a single pass
+    ArenaMark mark = arena_mark();
+    char **exprs = arena_alloc(n_columns * sizeof(char*));
+    size_t list_len = 0;
+    for (int i = 0; exprs && i < n_columns; i++) {
+        char *e_column = sqlite3_mprintf("%w", columns[i]);
+        exprs[i] = e_column ? arena_printf(sql_column_store[qid], e_column) : NULL;
+        sqlite3_free(e_column);
+        if (!exprs[i]) exprs = NULL;
+        else list_len += strlen(exprs[i]) + 2;
+    }
+
+    char *list = exprs ? arena_alloc(list_len + 1) : NULL;
+    if (list) {
+        char *p = list;
+        for (int i = 0; i < n_columns; i++) {
+            if (i > 0) { memcpy(p, ", ", 2); p += 2; }
+            size_t len = strlen(exprs[i]);
+            memcpy(p, exprs[i], len);
+            p += len;
+        }
+        *p = '\0';
+    }
+
+    char *e_table = sqlite3_mprintf("%w", table);
+    char *pred    = qm_build_key_sql(qid, key, n_key);
+    char *sql = NULL;
+
+    if (list && e_table && pred) {
+        const char *tmpl = sql_store[qid];
+        int len = snprintf(NULL, 0, tmpl, e_table, list, pred);
+        sql = len >= 0 ? malloc(len + 1) : NULL;
+        if (sql) snprintf(sql, len + 1, tmpl, e_table, list, pred);
+    }
+
+    sqlite3_free(e_table);
+    sqlite3_free(pred);
+    arena_release(mark);
+    return sql;
+}
+
+/**
+ * Build the SQL text of a join query
+ *
+ * @brief Expands the per-pair expression over every (from, to) pair of
+ *        columns, then the template with the escaped tables and the AND of
+ *        the pairs. The result is meant to be built once and handed to
+ *        qm_get_prepared by every connection.
+ *
+ * @param qid     Query identifier
+ * @param table   Left table
+ * @param ftable  Joined table
+ * @param from    Columns of table
+ * @param to      Columns of ftable, matched by position with from
+ * @param n_pairs Number of pairs
+ *
+ * @return malloc'd SQL string, NULL on failure
+ */
+char *qm_build_join_sql(QueryID qid, const char *table, const char *ftable,
+                        const char *const *from, const char *const *to, int n_pairs) {
+    if (!qm_is_join(qid) || !table || !ftable || n_pairs <= 0) return NULL;
+
+    // Built once per foreign key, possibly outside of any FUSE operation
+    ArenaMark mark = arena_mark();
+    char *on = NULL;
+    for (int i = 0; i < n_pairs; i++) {
+        char *e_from = sqlite3_mprintf("%w", from[i]);
+        char *e_to   = sqlite3_mprintf("%w", to[i]);
+        char *pair = (e_from && e_to) ? arena_printf(sql_column_store[qid], e_from, e_to) : NULL;
+        sqlite3_free(e_from);
+        sqlite3_free(e_to);
+
+        on = !pair ? NULL : on ? arena_printf("%s AND %s", on, pair) : pair;
+        if (!on) break;
+    }
+
+    char *e_table  = sqlite3_mprintf("%w", table);
+    char *e_ftable = sqlite3_mprintf("%w", ftable);
+    char *sql = NULL;
+
+    if (on && e_table && e_ftable) {
+        const char *tmpl = sql_store[qid];
+        int len = snprintf(NULL, 0, tmpl, e_table, on, e_ftable);
+        sql = len >= 0 ? malloc(len + 1) : NULL;
+        if (sql) snprintf(sql, len + 1, tmpl, e_table, on, e_ftable);
+    }
+
+    sqlite3_free(e_table);
+    sqlite3_free(e_ftable);
+    arena_release(mark);
+    return sql;
+}
+
+/**
+ * Initialize Query Manager
+ *
+ * @brief Binds a statement cache to a database connection.
+ *
+ * @param qm Cache to initialize
+ * @param db Connection every cached statement will be prepared on
+ *
+ * @return 0 on success, -1 on failure
+ */
+int qm_init(QmCache *qm, sqlite3 *db) {
+    if (!db) return -1;
+
+    qm->buckets = calloc(QM_INITIAL_BUCKETS, sizeof(QmEntry*));
+    if (!qm->buckets) return -1;
+
+    qm->db = db;
+    qm->n_buckets = QM_INITIAL_BUCKETS;
+    qm->n_entries = 0;
+    return 0;
+}
+
+/**
+ * Cleanup Query Manager
+ *
+ * @brief Finalizes every cached statement. Must run before the connection
+ *        is closed, otherwise sqlite3_close fails with SQLITE_BUSY.
+ */
+void qm_cleanup(QmCache *qm) {
+    if (!qm->buckets) return;
+
+    for (size_t i = 0; i < qm->n_buckets; i++) {
+        QmEntry *e = qm->buckets[i];
+        while (e) {
+            QmEntry *next = e->next;
+            sqlite3_finalize(e->pstmt);
+            free(e->table);
+            free(e->column);
+            free(e);
+            e = next;
+        }
+    }
+
+    atomic_fetch_sub(&qm_entries, qm->n_entries);
+
+    free(qm->buckets);
+    qm->buckets = NULL;
+    qm->n_buckets = 0;
+    qm->n_entries = 0;
+    qm->db = NULL;
+}
+
+const char *qm_get_query_str(QueryID qid) {
     if (qid < 0 || qid >= QUERY_COUNT) return NULL;
     return sql_store[qid];
-}
\ No newline at end of file
+}
+
+sqlite3_stmt *qm_get_static(QmCache *qm, QueryID qid) {
+    return qm_get_dynamic(qm, qid, NULL, NULL);
+}
+
+/*
+ * Cached statement of (qid, table, column). An entry built from another
+ * version of the table's definition is a miss, returned in stale to be
+ * replaced by qm_insert: nobody can hold it, since the caller looks its
+ * own key up.
+ */
+static sqlite3_stmt *qm_lookup(QmCache *qm, QueryID qid, const char *table, const char *column,
+                               uint64_t version, QmEntry **stale) {
+    *stale = NULL;
+
+    size_t b = qm_hash(qid, table, column) % qm->n_buckets;
+    for (QmEntry *e = qm->buckets[b]; e; e = e->next) {
+        if (e->qid == qid && qm_str_eq(e->table, table) && qm_str_eq(e->column, column)) {
+            if (e->version != version) {
+                *stale = e;
+                break;
+            }
+
+            atomic_fetch_add_explicit(&qm_hits, 1, memory_order_relaxed);
+            sqlite3_reset(e->pstmt);
+            sqlite3_clear_bindings(e->pstmt);
+            return e->pstmt;
+        }
+    }
+
+    atomic_fetch_add_explicit(&qm_misses, 1, memory_order_relaxed);
+    return NULL;
+}
+
+/**
+ * Prepare and cache a statement
+ *
+ * @brief Takes ownership of sql. The statement replaces the one of stale,
+ *        if any, otherwise it gets an entry of its own.
+ *
+ * @return prepared statement, NULL on failure
+ */
+static sqlite3_stmt *qm_insert(QmCache *qm, QueryID qid, const char *table, const char *column,
+                               uint64_t version, QmEntry *stale, char *sql) {
+    if (!sql) return NULL;
+
+    sqlite3_stmt *pstmt = NULL;
+    int rc = sqlite3_prepare_v3(qm->db, sql, -1, SQLITE_PREPARE_PERSISTENT, &pstmt, NULL);
+    free(sql);
+    if (rc != SQLITE_OK) {
+        sqlite3_finalize(pstmt);
+        return NULL;
+    }
+
+    if (stale) {
+        sqlite3_finalize(stale->pstmt);
+        stale->version = version;
+        stale->pstmt = pstmt;
+        return pstmt;
+    }
+
+    QmEntry *e = malloc(sizeof(QmEntry));
+    if (!e) { sqlite3_finalize(pstmt); return NULL; }
+
+    e->qid     = qid;
+    e->table   = table ? strdup(table) : NULL;
+    e->column  = column ? strdup(column) : NULL;
+    e->version = version;
+    e->pstmt   = pstmt;
+
+    if ((table && !e->table) || (column && !e->column)) {
+        sqlite3_finalize(pstmt);
+        free(e->table); free(e->column); free(e);
+        return NULL;
+    }
+
+    if (qm->n_entries >= qm->n_buckets) qm_grow(qm);
+
+    size_t b = qm_hash(qid, table, column) % qm->n_buckets;
+    e->next = qm->buckets[b];
+    qm->buckets[b] = e;
+    qm->n_entries++;
+    atomic_fetch_add(&qm_entries, 1);
+
+    return pstmt;
+}
+
+/**
+ * Get Cached Statement
+ *
+ * @brief Returns the prepared statement for (qid, table, column), preparing
+ *        it on the first request. The statement is handed out reset and
+ *        with its bindings cleared, ready to be bound and stepped.
+ *        It stays owned by the cache: never finalize it, call qm_release
+ *        when done and do not hold it across another lookup of the same key.
+ *
+ * @param qm     Cache of the connection the statement will run on
+ * @param qid    Query identifier
+ * @param table  Table name (ignored by static queries)
+ * @param column Column name (ignored by queries that don't need it)
+ *
+ * @return prepared statement, NULL on failure
+ */
+sqlite3_stmt *qm_get_dynamic(QmCache *qm, QueryID qid, const char *table, const char *column) {
+    return qm_get_keyed(qm, qid, table, column, 0, NULL, 0);
+}
+
+/**
+ * Get Cached Keyed Statement
+ *
+ * @brief Same as qm_get_dynamic, for the queries on a single record: the
+ *        record is selected by the key columns instead of the rowid
+ *        (e.g. tables WITHOUT ROWID). Their values are bound from
+ *        qm_key_param(qid) on, in order.
+ *        The key isn't part of the cache key: it must always be the same
+ *        for a given version of the table (its primary key, or NULL for
+ *        the rowid).
+ *
+ * @param version Definition of the table (Schema.sql_hash): DDL changing
+ *                it rebuilds the statement, whose SQL may be stale
+ * @param key     Key columns, NULL for the rowid
+ * @param n_key   Number of key columns
+ *
+ * @return prepared statement, NULL on failure
+ */
+sqlite3_stmt *qm_get_keyed(QmCache *qm, QueryID qid, const char *table, const char *column,
+                           uint64_t version, const char *const *key, int n_key) {
+    if (!qm || !qm->buckets || qid < 0 || qid >= QUERY_COUNT
+     || qm_is_column_list(qid) || qm_is_join(qid)) return NULL;
+
+    if (qm_is_static(qid)) {
+        table = NULL;
+        column = NULL;
+        version = 0;
+    }
+
+    QmEntry *stale;
+    sqlite3_stmt *pstmt = qm_lookup(qm, qid, table, column, version, &stale);
+    if (pstmt) return pstmt;
+
+    return qm_insert(qm, qid, table, column, version, stale, qm_build_sql(qid, table, column, key, n_key));
+}
+
+/**
+ * Get Cached Column List Statement
+ *
+ * @brief Same as qm_get_dynamic, for the queries expanded over a list of
+ *        columns. The statement is cached by table only: columns must
+ *        always be the same for a given version of the table (e.g. all
+ *        of them, in catalog order).
+ *
+ * @param qm        Cache of the connection the statement will run on
+ * @param qid       Query identifier
+ * @param table     Table name
+ * @param version   Definition of the table (see qm_get_keyed)
+ * @param columns   Column names
+ * @param n_columns Number of columns
+ *
+ * @return prepared statement, NULL on failure
+ */
+sqlite3_stmt *qm_get_columns(QmCache *qm, QueryID qid, const char *table, uint64_t version,
+                             const char *const *columns, int n_columns) {
+    return qm_get_columns_keyed(qm, qid, table, version, columns, n_columns, NULL, 0);
+}
+
+/**
+ * Get Cached Keyed Column List Statement
+ *
+ * @brief Same as qm_get_columns, with the record selected by the key
+ *        columns (see qm_get_keyed).
+ *
+ * @return prepared statement, NULL on failure
+ */
+sqlite3_stmt *qm_get_columns_keyed(QmCache *qm, QueryID qid, const char *table, uint64_t version,
+                                   const char *const *columns, int n_columns, const char *const *key, int n_key) {
+    if (!qm || !qm->buckets || !table || !qm_is_column_list(qid) || qid >= QUERY_COUNT) return NULL;
+
+    QmEntry *stale;
+    sqlite3_stmt *pstmt = qm_lookup(qm, qid, table, NULL, version, &stale);
+    if (pstmt) return pstmt;
+
+    return qm_insert(qm, qid, table, NULL, version, stale, qm_build_columns_sql(qid, table, columns, n_columns, key, n_key));
+}
+
+/**
+ * Key Parameter
+ *
+ * @return index of the first parameter bound to the record (the rowid or
+ *         the first key column), 0 if the query isn't on a single record
+ */
+int qm_key_param(QueryID qid) {
+    if (qid < 0 || qid >= QUERY_COUNT) return 0;
+    return sql_key_param[qid];
+}
+
+/**
+ * Get Cached Prepared Statement
+ *
+ * @brief Same as qm_get_dynamic, for the queries whose SQL is built by the
+ *        caller (e.g. join queries built from the catalog by
+ *        qm_build_join_sql). The statement is rebuilt when sql changes
+ *        (e.g. DDL on either side of a join).
+ *
+ * @param qm     Cache of the connection the statement will run on
+ * @param qid    Query identifier
+ * @param table  Table name
+ * @param column Column name
+ * @param sql    SQL text of the statement
+ *
+ * @return prepared statement, NULL on failure
+ */
+sqlite3_stmt *qm_get_prepared(QmCache *qm, QueryID qid, const char *table, const char *column, const char *sql) {
+    if (!qm || !qm->buckets || !table || !sql || !qm_is_join(qid)) return NULL;
+
+    // The SQL depends on more than one table: its own hash is the version
+    uint64_t version = qm_hash(qid, sql, NULL);
+
+    QmEntry *stale;
+    sqlite3_stmt *pstmt = qm_lookup(qm, qid, table, column, version, &stale);
+    if (pstmt) return pstmt;
+
+    return qm_insert(qm, qid, table, column, version, stale, strdup(sql));
+}
+
+/**
+ * Release Cached Statement
+ *
+ * @brief Resets a statement obtained from the cache, so that it doesn't keep
+ *        a read transaction open between two FUSE operations.
+ */
+void qm_release(sqlite3_stmt *pstmt) {
+    if (pstmt) sqlite3_reset(pstmt);
+}
+
+void qm_get_stats(QmStats *stats) {
+    if (!stats) return;
+
+    stats->hits    = atomic_load(&qm_hits);
+    stats->misses  = atomic_load(&qm_misses);
+    stats->entries = atomic_load(&qm_entries);
+}
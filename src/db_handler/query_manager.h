@@ -2,20 +2,88 @@
 #define QUERY_MANAGER_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <sqlite3.h>
 
 typedef enum {
+    // Static queries (no table/column)
     QUERY_GET_TABLES_NAME,
     QUERY_GET_TABLE_INFO,
+    QUERY_GET_DATA_VERSION,
+    QUERY_GET_SCHEMA_VERSION,
+
+    // Dynamic queries (keyed by table and, optionally, column)
+    QUERY_GET_ATTRIBUTE,
+    QUERY_GET_ATTRIBUTE_TYPE,
+    QUERY_UPDATE_ATTRIBUTE,
+    QUERY_RESIZE_ATTRIBUTE,
+    QUERY_GET_TABLE_ROWIDS,
+    QUERY_GET_WHERE_ROWIDS,
+    QUERY_MATCH_WHERE,
+    QUERY_GET_PK_ROWID,
+
+    // Column list queries (keyed by table, expanded over the given columns)
+    QUERY_GET_RECORD_SIZES,
+    QUERY_GET_ROW,
+    QUERY_GET_ROWS,
+    QUERY_GET_PK_KEYS,
+    QUERY_GET_PK_KEYS_NOROWID,
+
+    // Join queries (keyed by table and column, expanded over pairs of columns)
+    QUERY_RESOLVE_FK,
     QUERY_COUNT
 } QueryID;
 
-int  qm_init(sqlite3 *db);
-void qm_cleanup();
+/**
+ * Statement Cache Statistics (summed over every connection)
+ *
+ * hits:    lookups served by an already prepared statement
+ * misses:  lookups that had to call sqlite3_prepare_v3
+ * entries: statements currently held by the caches
+ */
+typedef struct QmStats {
+    uint64_t hits;
+    uint64_t misses;
+    size_t   entries;
+} QmStats;
+
+typedef struct QmEntry QmEntry;
+
+/**
+ * Statement Cache Structure
+ *
+ * One per connection: a prepared statement can only run on the
+ * connection it was prepared on.
+ *
+ * db:        connection every cached statement is prepared on
+ * buckets:   hash buckets of cache entries
+ * n_buckets: number of buckets
+ * n_entries: number of cached statements
+ */
+typedef struct QmCache {
+    sqlite3  *db;
+    QmEntry **buckets;
+    size_t    n_buckets;
+    size_t    n_entries;
+} QmCache;
 
-char         *qm_get_query_str(QueryID qid);
-sqlite3_stmt *qm_get_static(QueryID qid);
+int  qm_init(QmCache *qm, sqlite3 *db);
+void qm_cleanup(QmCache *qm);
 
-// TODO: variadic function to build a dynamic query
+const char   *qm_get_query_str(QueryID qid);
+sqlite3_stmt *qm_get_static(QmCache *qm, QueryID qid);
+sqlite3_stmt *qm_get_dynamic(QmCache *qm, QueryID qid, const char *table, const char *column);
+sqlite3_stmt *qm_get_keyed(QmCache *qm, QueryID qid, const char *table, const char *column,
+                           uint64_t version, const char *const *key, int n_key);
+sqlite3_stmt *qm_get_columns(QmCache *qm, QueryID qid, const char *table, uint64_t version,
+                             const char *const *columns, int n_columns);
+sqlite3_stmt *qm_get_columns_keyed(QmCache *qm, QueryID qid, const char *table, uint64_t version,
+                                   const char *const *columns, int n_columns, const char *const *key, int n_key);
+int           qm_key_param(QueryID qid);
+sqlite3_stmt *qm_get_prepared(QmCache *qm, QueryID qid, const char *table, const char *column, const char *sql);
+char         *qm_build_join_sql(QueryID qid, const char *table, const char *ftable,
+                                const char *const *from, const char *const *to, int n_pairs);
+void          qm_release(sqlite3_stmt *pstmt);
+void          qm_get_stats(QmStats *stats);
 
-#endif // QUERY_MANAGER_H
\ No newline at end of file
+#endif // QUERY_MANAGER_H
@@ -0,0 +1,309 @@
+#include "row_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "../utils/arena.h"
+
+/**
+ * Cached Row
+ *
+ * table:    table of the row
+ * rowid:    rowid of the row
+ * cols:     columns of the row, in catalog order
+ * n_cols:   number of columns
+ * bytes:    memory accounted to the row
+ * next:     next row in the same bucket
+ * lru_prev: more recently used row (NULL for the head of the LRU list)
+ * lru_next: less recently used row (NULL for the tail)
+ */
+typedef struct RowEntry {
+    char            *table;
+    sqlite3_int64    rowid;
+    RowCacheCol     *cols;
+    int              n_cols;
+    size_t           bytes;
+    struct RowEntry *next;
+    struct RowEntry *lru_prev;
+    struct RowEntry *lru_next;
+} RowEntry;
+
+static pthread_mutex_t rc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static RowEntry **rc_buckets = NULL;
+static size_t     rc_n_buckets = 0;
+
+// Most recently used first
+static RowEntry  *rc_lru_head = NULL;
+static RowEntry  *rc_lru_tail = NULL;
+
+static size_t     rc_max_bytes = 0;
+static size_t     rc_bytes = 0;
+static size_t     rc_rows = 0;
+
+// Bumped by every invalidation: rows read before it are not cached
+static atomic_uint_least64_t rc_generation = 0;
+
+static atomic_uint_least64_t rc_hits = 0;
+static atomic_uint_least64_t rc_misses = 0;
+static uint64_t              rc_evictions = 0;
+
+// Rough size of a cached row, used to size the hash table
+#define RC_ROW_ESTIMATE 512
+
+static size_t rc_hash(const char *table, sqlite3_int64 rowid) {
+    // FNV-1a over the table name and the rowid
+    uint64_t h = 1469598103934665603ULL;
+    for (const char *p = table; *p; p++) { h ^= (unsigned char)*p; h *= 1099511628211ULL; }
+    for (int i = 0; i < 8; i++) { h ^= (uint64_t)(rowid >> (i * 8)) & 0xff; h *= 1099511628211ULL; }
+    return h % rc_n_buckets;
+}
+
+static void rc_free_cols(RowCacheCol *cols, int n_cols) {
+    if (!cols) return;
+    for (int i = 0; i < n_cols; i++) free(cols[i].value);
+    free(cols);
+}
+
+static void rc_lru_unlink(RowEntry *e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else rc_lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else rc_lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static void rc_lru_push(RowEntry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = rc_lru_head;
+    if (rc_lru_head) rc_lru_head->lru_prev = e;
+    rc_lru_head = e;
+    if (!rc_lru_tail) rc_lru_tail = e;
+}
+
+static RowEntry *rc_find(const char *table, sqlite3_int64 rowid, RowEntry ***link) {
+    RowEntry **p = &rc_buckets[rc_hash(table, rowid)];
+    for (; *p; p = &(*p)->next) {
+        if ((*p)->rowid == rowid && strcmp((*p)->table, table) == 0) break;
+    }
+    if (link) *link = p;
+    return *p;
+}
+
+// Unlinks and frees a row: rc_lock must be held
+static void rc_remove(RowEntry **link) {
+    RowEntry *e = *link;
+    *link = e->next;
+    rc_lru_unlink(e);
+
+    rc_bytes -= e->bytes;
+    rc_rows--;
+
+    rc_free_cols(e->cols, e->n_cols);
+    free(e->table);
+    free(e);
+}
+
+/**
+ * Initialize Row Cache
+ *
+ * @param max_bytes Memory cap of the cached rows, 0 to disable the cache
+ *
+ * @return 0 on success, -1 on failure
+ */
+int row_cache_init(size_t max_bytes) {
+    if (max_bytes == 0) return 0;
+
+    size_t n_buckets = 1024;
+    while (n_buckets < max_bytes / RC_ROW_ESTIMATE) n_buckets *= 2;
+
+    rc_buckets = calloc(n_buckets, sizeof(RowEntry*));
+    if (!rc_buckets) return -1;
+
+    rc_n_buckets = n_buckets;
+    rc_max_bytes = max_bytes;
+    return 0;
+}
+
+void row_cache_cleanup(void) {
+    row_cache_clear();
+
+    pthread_mutex_lock(&rc_lock);
+    free(rc_buckets);
+    rc_buckets = NULL;
+    rc_n_buckets = 0;
+    rc_max_bytes = 0;
+    pthread_mutex_unlock(&rc_lock);
+}
+
+bool row_cache_enabled(void) {
+    return rc_max_bytes > 0;
+}
+
+/**
+ * Get Generation
+ *
+ * @brief To be read before querying a row that will be handed to
+ *        row_cache_put: a change made in between is then detected.
+ */
+uint64_t row_cache_generation(void) {
+    return atomic_load(&rc_generation);
+}
+
+/**
+ * Lookup Cached Column
+ *
+ * @brief Copies a column of a cached row and marks the row as the most
+ *        recently used. The value, if any and if with_value, is a copy in
+ *        the calling thread's arena (see arena_alloc), NULL otherwise.
+ *
+ * @return 0 on hit, -1 if the row isn't cached (or the copy failed)
+ */
+int row_cache_lookup(const char *table, sqlite3_int64 rowid, int col, bool with_value, RowCacheCol *out) {
+    if (!row_cache_enabled()) return -1;
+
+    pthread_mutex_lock(&rc_lock);
+
+    RowEntry *e = rc_buckets ? rc_find(table, rowid, NULL) : NULL;
+    if (!e || col < 0 || col >= e->n_cols) {
+        pthread_mutex_unlock(&rc_lock);
+        atomic_fetch_add_explicit(&rc_misses, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    *out = e->cols[col];
+    out->value = NULL;
+    if (with_value && e->cols[col].value) {
+        out->value = arena_memdup(e->cols[col].value, out->size);
+        if (!out->value) {
+            pthread_mutex_unlock(&rc_lock);
+            return -1;
+        }
+    }
+
+    rc_lru_unlink(e);
+    rc_lru_push(e);
+    pthread_mutex_unlock(&rc_lock);
+
+    atomic_fetch_add_explicit(&rc_hits, 1, memory_order_relaxed);
+    return 0;
+}
+
+/**
+ * Cache Row
+ *
+ * @brief Takes ownership of cols (malloc'd array and values). The row is
+ *        dropped if it was changed after generation was read, or if it
+ *        doesn't fit the memory cap on its own. Least recently used rows
+ *        are evicted to make room.
+ *
+ * @param generation row_cache_generation() read before the row was queried
+ */
+void row_cache_put(const char *table, sqlite3_int64 rowid, RowCacheCol *cols, int n_cols, uint64_t generation) {
+    size_t bytes = sizeof(RowEntry) + strlen(table) + 1 + n_cols * sizeof(RowCacheCol);
+    for (int i = 0; i < n_cols; i++) {
+        if (cols[i].value) bytes += cols[i].size + 1;
+    }
+
+    if (!row_cache_enabled() || bytes > rc_max_bytes) {
+        rc_free_cols(cols, n_cols);
+        return;
+    }
+
+    RowEntry *e = malloc(sizeof(RowEntry));
+    char *name = strdup(table);
+    if (!e || !name) {
+        free(e);
+        free(name);
+        rc_free_cols(cols, n_cols);
+        return;
+    }
+
+    e->table = name;
+    e->rowid = rowid;
+    e->cols = cols;
+    e->n_cols = n_cols;
+    e->bytes = bytes;
+
+    pthread_mutex_lock(&rc_lock);
+
+    // Checked under the lock: invalidations bump it while holding it
+    if (!rc_buckets || atomic_load(&rc_generation) != generation) {
+        pthread_mutex_unlock(&rc_lock);
+        rc_free_cols(cols, n_cols);
+        free(name);
+        free(e);
+        return;
+    }
+
+    RowEntry **link;
+    if (rc_find(table, rowid, &link)) rc_remove(link);
+
+    while (rc_bytes + bytes > rc_max_bytes && rc_lru_tail) {
+        RowEntry *victim = rc_lru_tail;
+        rc_find(victim->table, victim->rowid, &link);
+        rc_remove(link);
+        rc_evictions++;
+    }
+
+    size_t b = rc_hash(table, rowid);
+    e->next = rc_buckets[b];
+    rc_buckets[b] = e;
+    rc_lru_push(e);
+    rc_bytes += bytes;
+    rc_rows++;
+
+    pthread_mutex_unlock(&rc_lock);
+}
+
+/**
+ * Invalidate Row
+ *
+ * @brief Drops a row changed through the mount.
+ */
+void row_cache_invalidate(const char *table, sqlite3_int64 rowid) {
+    if (!row_cache_enabled()) return;
+
+    pthread_mutex_lock(&rc_lock);
+    atomic_fetch_add(&rc_generation, 1);
+
+    RowEntry **link;
+    if (rc_buckets && rc_find(table, rowid, &link)) rc_remove(link);
+    pthread_mutex_unlock(&rc_lock);
+}
+
+/**
+ * Clear Row Cache
+ *
+ * @brief Drops every row: the database changed in ways we can't track
+ *        (e.g. a commit of another process, see PRAGMA data_version).
+ */
+void row_cache_clear(void) {
+    if (!row_cache_enabled()) return;
+
+    pthread_mutex_lock(&rc_lock);
+    atomic_fetch_add(&rc_generation, 1);
+
+    while (rc_lru_tail) {
+        RowEntry **link;
+        rc_find(rc_lru_tail->table, rc_lru_tail->rowid, &link);
+        rc_remove(link);
+    }
+    pthread_mutex_unlock(&rc_lock);
+}
+
+void row_cache_get_stats(RowCacheStats *stats) {
+    if (!stats) return;
+
+    pthread_mutex_lock(&rc_lock);
+    stats->evictions = rc_evictions;
+    stats->rows      = rc_rows;
+    stats->bytes     = rc_bytes;
+    stats->max_bytes = rc_max_bytes;
+    pthread_mutex_unlock(&rc_lock);
+
+    stats->hits   = atomic_load(&rc_hits);
+    stats->misses = atomic_load(&rc_misses);
+}
@@ -0,0 +1,54 @@
+#ifndef ROW_CACHE_H
+#define ROW_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sqlite3.h>
+
+/**
+ * Cached Column Structure
+ *
+ * size:      size of the value in bytes, as read by a file
+ * type:      SQLite type of the value (SQLITE_INTEGER, ..., SQLITE_NULL)
+ * has_value: whether value holds the value (only small values are kept)
+ * value:     copy of the value, size bytes plus a NUL (NULL if !has_value
+ *            or the value is empty)
+ */
+typedef struct RowCacheCol {
+    sqlite3_int64 size;
+    int           type;
+    bool          has_value;
+    char         *value;
+} RowCacheCol;
+
+/**
+ * Row Cache Statistics
+ *
+ * hits:      lookups served by the cache
+ * misses:    lookups of rows not cached
+ * evictions: rows dropped to stay within the memory cap
+ * rows:      rows currently cached
+ * bytes:     memory accounted to the cached rows
+ * max_bytes: memory cap (0 if the cache is disabled)
+ */
+typedef struct RowCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t   rows;
+    size_t   bytes;
+    size_t   max_bytes;
+} RowCacheStats;
+
+int      row_cache_init(size_t max_bytes);
+void     row_cache_cleanup(void);
+bool     row_cache_enabled(void);
+uint64_t row_cache_generation(void);
+int      row_cache_lookup(const char *table, sqlite3_int64 rowid, int col, bool with_value, RowCacheCol *out);
+void     row_cache_put(const char *table, sqlite3_int64 rowid, RowCacheCol *cols, int n_cols, uint64_t generation);
+void     row_cache_invalidate(const char *table, sqlite3_int64 rowid);
+void     row_cache_clear(void);
+void     row_cache_get_stats(RowCacheStats *stats);
+
+#endif // ROW_CACHE_H
@@ -1,13 +1,22 @@
 #include "syscall_handler/syscall_handler.h"
+#include "syscall_handler/lowlevel.h"
 
-sqlite3* db = NULL;
+const char *db_path = NULL;
+MountOptions mount_opts;
 
 static const struct fuse_operations vfs2db_oper = {
 	.getattr        = vfs2db_getattr,
     .getxattr       = vfs2db_getxattr,
 	.readdir        = vfs2db_readdir,
+    .open           = vfs2db_open,
+    .release        = vfs2db_release,
 	.read           = vfs2db_read,
+    .read_buf       = vfs2db_read_buf,
     .write          = vfs2db_write,
+    .flush          = vfs2db_flush,
+    .fsync          = vfs2db_fsync,
+    .truncate       = vfs2db_truncate,
+    .fallocate      = vfs2db_fallocate,
     .create         = vfs2db_create,
     .readlink       = vfs2db_readlink,
 
@@ -16,22 +25,72 @@ static const struct fuse_operations vfs2db_oper = {
 };
 
 struct options {
-    const char *db_path;
+    const char  *db_path;
+    int          log_level;
+    int          lowlevel;
+    MountOptions mount;
+};
+
+enum {
+    KEY_RO,
 };
 
 #define OPTION(t, p) { t, offsetof(struct options, p), 1 }
 static const struct fuse_opt option_spec[] = {
     OPTION("db=%s", db_path),
+    FUSE_OPT_KEY("ro", KEY_RO),
+    OPTION("log_level=%d", log_level),
+    OPTION("lowlevel", lowlevel),
+    OPTION("entry_timeout=%lf", mount.entry_timeout),
+    OPTION("attr_timeout=%lf", mount.attr_timeout),
+    OPTION("kernel_cache", mount.kernel_cache),
+    OPTION("poll_ms=%u", mount.poll_ms),
+    OPTION("row_cache_mb=%u", mount.row_cache_mb),
+    OPTION("bucket_fanout=%u", mount.bucket_fanout),
+    OPTION("journal_mode=%s", mount.journal_mode),
+    OPTION("synchronous=%s", mount.synchronous),
+    OPTION("cache_size=%s", mount.cache_size),
+    OPTION("mmap_size=%s", mount.mmap_size),
+    OPTION("temp_store=%s", mount.temp_store),
+    OPTION("busy_timeout=%u", mount.busy_timeout),
+    OPTION("group_commit_ms=%u", mount.group_commit_ms),
+    OPTION("group_commit_kb=%u", mount.group_commit_kb),
+    OPTION("catalog_cache=%s", mount.catalog_cache),
     FUSE_OPT_END
 };
 
+// ro is kept for fuse_main as well: the kernel then mounts read-only too
+static int option_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
+    (void)arg; (void)outargs;
+    if (key == KEY_RO) ((struct options*)data)->mount.read_only = 1;
+    return 1;
+}
+
 int main(int argc, char *argv[]) {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-    struct options opt = { NULL };
+    // Same timeouts as libfuse's defaults, external changes checked every second.
+    // SQLite keeps its own defaults (WAL aside), every write commits on its own
+    struct options opt = {
+        .db_path = NULL,
+        .log_level = LOG_LEVEL_WARN,
+        .lowlevel = 0,
+        .mount = {
+            .entry_timeout   = 1.0,
+            .attr_timeout    = 1.0,
+            .kernel_cache    = 0,
+            .poll_ms         = 1000,
+            .row_cache_mb    = 64,
+            .bucket_fanout   = 0,
+            .busy_timeout    = 5000,
+            .group_commit_ms = 0,
+            .group_commit_kb = 4096,
+        },
+    };
 
-    if (fuse_opt_parse(&args, &opt, option_spec, NULL) == -1) {
+    if (fuse_opt_parse(&args, &opt, option_spec, option_proc) == -1) {
         return 1;
     }
+    log_level = opt.log_level;
 
     if (opt.db_path == NULL) {
         fprintf(stderr, "Errore: Devi specificare il path del database come primo argomento.\n");
@@ -39,17 +98,49 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    int check = sqlite3_open_v2(opt.db_path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+    // Bucket names count the rowids of a bucket in 'x' digits: at least one
+    unsigned int fanout = opt.mount.bucket_fanout;
+    while (fanout >= 10 && fanout % 10 == 0) fanout /= 10;
+    bool bad_fanout = opt.mount.bucket_fanout > 0 && (opt.mount.bucket_fanout < 10 || fanout != 1);
+    const char *bad_option = bad_fanout ? "bucket_fanout" : NULL;
+    if (!bad_option) bad_option = db_pool_check_options(&opt.mount);
+    if (bad_option) {
+        fprintf(stderr, "Invalid value for the %s option\n", bad_option);
+        free((char*)opt.db_path);
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+
+    // Only check that the database opens: the connection pool is opened by
+    // vfs2db_init, since connections must not cross fuse_main's fork.
+    // A read-only mount needs an existing database
+    sqlite3 *db = NULL;
+    int flags = opt.mount.read_only ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+    int check = sqlite3_open_v2(opt.db_path, &db, flags, NULL);
     if (check != SQLITE_OK) {
         fprintf(stderr, "sqlite3_open_v2 failed: %s\n", sqlite3_errmsg(db));
-        free(opt.db_path);
+        sqlite3_close(db);
+        free((char*)opt.db_path);
         fuse_opt_free_args(&args);
         return 1;
     }
+    sqlite3_close(db);
 
-    int res = fuse_main(args.argc, args.argv, &vfs2db_oper, NULL);
+    // Callbacks run on several FUSE worker threads: mounting with -s is no longer needed
+    db_path = opt.db_path;
+    mount_opts = opt.mount;
+    // lowlevel: inode-based callbacks (see lowlevel.c) instead of the path-based ones
+    int res = opt.lowlevel
+        ? vfs2db_ll_main(&args)
+        : fuse_main(args.argc, args.argv, &vfs2db_oper, NULL);
 
-    free(opt.db_path);
+    free((char*)opt.db_path);
+    free((char*)opt.mount.journal_mode);
+    free((char*)opt.mount.synchronous);
+    free((char*)opt.mount.cache_size);
+    free((char*)opt.mount.mmap_size);
+    free((char*)opt.mount.temp_store);
+    free((char*)opt.mount.catalog_cache);
     fuse_opt_free_args(&args);
     return res;
 }
\ No newline at end of file
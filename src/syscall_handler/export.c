@@ -0,0 +1,369 @@
+#include "export.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Export Checkpoint
+ *
+ * offset: offset of the stream where a row starts
+ * rowid:  first rowid rendered from there
+ */
+typedef struct ExportCheckpoint {
+    off_t         offset;
+    sqlite3_int64 rowid;
+} ExportCheckpoint;
+
+/**
+ * Export Stream Structure
+ *
+ * Content of a table export file, rendered by a keyset cursor as reads
+ * need it: only the bytes from the last read on are kept.
+ *
+ * table_id: id of the table in the catalog
+ * format:   EXPORT_CSV or EXPORT_JSONL
+ * buf:      rendered bytes, starting at offset start of the stream
+ * len:      bytes in buf
+ * cap:      allocated size of buf
+ * start:    offset of the stream of buf[0]
+ * next:     first rowid not rendered yet
+ * done:     whether the whole table was rendered
+ * cps:      rows to restart the cursor from, by increasing offset
+ * n_cps:    number of checkpoints
+ * cap_cps:  allocated size of cps
+ */
+struct Export {
+    int           table_id;
+    ExportFormat  format;
+
+    char         *buf;
+    size_t        len;
+    size_t        cap;
+    off_t         start;
+    sqlite3_int64 next;
+    bool          done;
+
+    ExportCheckpoint *cps;
+    size_t            n_cps;
+    size_t            cap_cps;
+};
+
+// =============================================================
+// Rendering
+// =============================================================
+
+static int export_reserve(Export *ex, size_t size) {
+    if (ex->len + size <= ex->cap) return 0;
+
+    size_t cap = ex->cap ? ex->cap : 4096;
+    while (cap < ex->len + size) cap *= 2;
+
+    char *buf = realloc(ex->buf, cap);
+    if (!buf) return -1;
+    ex->buf = buf;
+    ex->cap = cap;
+    return 0;
+}
+
+static int export_append(Export *ex, const char *data, size_t size) {
+    if (export_reserve(ex, size) != 0) return -1;
+    memcpy(ex->buf + ex->len, data, size);
+    ex->len += size;
+    return 0;
+}
+
+static inline int export_append_str(Export *ex, const char *str) {
+    return export_append(ex, str, strlen(str));
+}
+
+// BLOBs are rendered as lowercase hex, in both formats
+static int export_append_hex(Export *ex, const unsigned char *data, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    if (export_reserve(ex, size * 2) != 0) return -1;
+
+    for (size_t i = 0; i < size; i++) {
+        ex->buf[ex->len++] = digits[data[i] >> 4];
+        ex->buf[ex->len++] = digits[data[i] & 0xf];
+    }
+    return 0;
+}
+
+// RFC 4180: quoted only when needed, quotes doubled
+static int export_append_csv_text(Export *ex, const char *text, size_t size) {
+    if (!memchr(text, ',', size) && !memchr(text, '"', size)
+     && !memchr(text, '\n', size) && !memchr(text, '\r', size)) {
+        return export_append(ex, text, size);
+    }
+
+    if (export_append(ex, "\"", 1) != 0) return -1;
+    for (size_t i = 0; i < size; i++) {
+        if (text[i] == '"' && export_append(ex, "\"", 1) != 0) return -1;
+        if (export_append(ex, &text[i], 1) != 0) return -1;
+    }
+    return export_append(ex, "\"", 1);
+}
+
+static int export_append_json_text(Export *ex, const char *text, size_t size) {
+    if (export_append(ex, "\"", 1) != 0) return -1;
+
+    size_t run = 0;
+    for (size_t i = 0; i < size; i++) {
+        unsigned char ch = text[i];
+        if (ch >= 0x20 && ch != '"' && ch != '\\') continue;
+
+        if (export_append(ex, text + run, i - run) != 0) return -1;
+        run = i + 1;
+
+        char esc[8];
+        switch (ch) {
+            case '"':  strcpy(esc, "\\\""); break;
+            case '\\': strcpy(esc, "\\\\"); break;
+            case '\n': strcpy(esc, "\\n"); break;
+            case '\r': strcpy(esc, "\\r"); break;
+            case '\t': strcpy(esc, "\\t"); break;
+            default:   snprintf(esc, sizeof(esc), "\\u%04x", ch); break;
+        }
+        if (export_append_str(ex, esc) != 0) return -1;
+    }
+
+    if (export_append(ex, text + run, size - run) != 0) return -1;
+    return export_append(ex, "\"", 1);
+}
+
+// NULL is an empty CSV field and a JSON null
+static int export_append_value(Export *ex, sqlite3_stmt *pstmt, int i, bool json) {
+    switch (sqlite3_column_type(pstmt, i)) {
+        case SQLITE_NULL:
+            return json ? export_append_str(ex, "null") : 0;
+        case SQLITE_BLOB: {
+            const void *data = sqlite3_column_blob(pstmt, i);
+            size_t size = sqlite3_column_bytes(pstmt, i);
+            if (json && export_append(ex, "\"", 1) != 0) return -1;
+            if (export_append_hex(ex, data, size) != 0) return -1;
+            return json ? export_append(ex, "\"", 1) : 0;
+        }
+        case SQLITE_FLOAT:
+            // Inf and NaN have no JSON spelling
+            if (json && !isfinite(sqlite3_column_double(pstmt, i))) return export_append_str(ex, "null");
+            // fall through
+        case SQLITE_INTEGER:
+            return export_append_str(ex, (const char*)sqlite3_column_text(pstmt, i));
+        default: {
+            const char *text = (const char*)sqlite3_column_text(pstmt, i);
+            size_t size = sqlite3_column_bytes(pstmt, i);
+            if (!text) return -1;
+            return json ? export_append_json_text(ex, text, size) : export_append_csv_text(ex, text, size);
+        }
+    }
+}
+
+static int export_append_header(Export *ex, const Schema *schema) {
+    if (export_append_str(ex, "rowid") != 0) return -1;
+    for (int i = 0; i < schema->n_cols; i++) {
+        const char *name = schema->cols[i].name;
+        if (export_append(ex, ",", 1) != 0) return -1;
+        if (export_append_csv_text(ex, name, strlen(name)) != 0) return -1;
+    }
+    return export_append(ex, "\n", 1);
+}
+
+/*
+ * One line per row, rowid first: a CSV record or a JSON object.
+ * The columns of pstmt are the ones of make_rows_select.
+ */
+static int export_append_row(Export *ex, const Schema *schema, sqlite3_stmt *pstmt, bool json) {
+    if (json && export_append_str(ex, "{\"rowid\":") != 0) return -1;
+    if (export_append_value(ex, pstmt, 0, json) != 0) return -1;
+
+    for (int i = 0; i < schema->n_cols; i++) {
+        if (export_append(ex, ",", 1) != 0) return -1;
+        if (json) {
+            const char *name = schema->cols[i].name;
+            if (export_append_json_text(ex, name, strlen(name)) != 0) return -1;
+            if (export_append(ex, ":", 1) != 0) return -1;
+        }
+        if (export_append_value(ex, pstmt, i + 1, json) != 0) return -1;
+    }
+
+    return export_append_str(ex, json ? "}\n" : "\n");
+}
+
+// =============================================================
+// Streaming
+// =============================================================
+
+// Every EXPORT_CHECKPOINT_BYTES of stream, at the beginning of a row
+static int export_checkpoint(Export *ex) {
+    off_t offset = ex->start + ex->len;
+    if (ex->n_cps > 0 && ex->cps[ex->n_cps - 1].offset + EXPORT_CHECKPOINT_BYTES > offset) return 0;
+
+    if (ex->n_cps == ex->cap_cps) {
+        size_t cap = ex->cap_cps ? ex->cap_cps * 2 : 64;
+        ExportCheckpoint *cps = realloc(ex->cps, cap * sizeof(ExportCheckpoint));
+        if (!cps) return -1;
+        ex->cps = cps;
+        ex->cap_cps = cap;
+    }
+
+    ex->cps[ex->n_cps++] = (ExportCheckpoint){ offset, ex->next };
+    return 0;
+}
+
+// Restarts the cursor at a checkpoint: the header is part of offset 0
+static int export_seek(Export *ex, const ExportCheckpoint *cp) {
+    ex->len = 0;
+    ex->start = cp->offset;
+    ex->next = cp->rowid;
+    ex->done = false;
+
+    if (cp->offset == 0 && ex->format == EXPORT_CSV) {
+        return export_append_header(ex, catalog_table(ex->table_id));
+    }
+    return 0;
+}
+
+/*
+ * Renders rows from the first rowid not rendered yet with a single keyset
+ * query, until buf holds want bytes or the batch ends.
+ */
+static int export_fill(Export *ex, size_t want) {
+    const Schema *schema = catalog_table(ex->table_id);
+
+    sqlite3_stmt *pstmt;
+    make_rows_select(&pstmt, schema, ex->next, INT64_MAX, EXPORT_BATCH);
+    if (!pstmt) return -1;
+
+    int rc, n = 0;
+    while ((rc = sqlite3_step(pstmt)) == SQLITE_ROW) {
+        sqlite3_int64 rowid = sqlite3_column_int64(pstmt, 0);
+        if (export_checkpoint(ex) != 0 || export_append_row(ex, schema, pstmt, ex->format == EXPORT_JSONL) != 0) {
+            qm_release(pstmt);
+            return -1;
+        }
+
+        n++;
+        if (rowid == INT64_MAX) { ex->done = true; break; }
+        ex->next = rowid + 1;
+        if (ex->len >= want) break;
+    }
+
+    qm_release(pstmt);
+    if (rc != SQLITE_DONE && rc != SQLITE_ROW) return -1;
+    if (rc == SQLITE_DONE && n < EXPORT_BATCH) ex->done = true;
+    return 0;
+}
+
+/**
+ * Create Export Stream
+ *
+ * @param toks Export file of a table (EXPORT_CSV or EXPORT_JSONL)
+ *
+ * @return the new stream, NULL on failure
+ */
+Export *export_create(const Tokens *toks) {
+    if (toks->export != EXPORT_CSV && toks->export != EXPORT_JSONL) return NULL;
+
+    Export *ex = calloc(1, sizeof(Export));
+    if (!ex) return NULL;
+
+    ex->table_id = toks->table_id;
+    ex->format = toks->export;
+
+    // The beginning of the stream is always a checkpoint
+    ExportCheckpoint first = { 0, INT64_MIN };
+    ex->next = first.rowid;
+    if (export_checkpoint(ex) != 0 || export_seek(ex, &first) != 0) {
+        export_destroy(ex);
+        return NULL;
+    }
+    return ex;
+}
+
+void export_destroy(Export *ex) {
+    if (!ex) return;
+    free(ex->buf);
+    free(ex->cps);
+    free(ex);
+}
+
+/**
+ * Read from Export Stream
+ *
+ * @brief Sequential reads continue the cursor where the previous one
+ *        stopped. Other reads restart it from the last checkpoint before
+ *        their offset, instead of from the beginning.
+ *        Rows changed between two reads may be seen in either state.
+ *
+ * @return bytes copied into buffer, -1 on failure
+ */
+int export_read(Export *ex, char *buffer, size_t size, off_t offset) {
+    // Last checkpoint before offset
+    size_t lo = 0, hi = ex->n_cps;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (ex->cps[mid].offset <= offset) lo = mid;
+        else hi = mid;
+    }
+
+    // Behind the rendered bytes, or ahead of them past a checkpoint
+    if (offset < ex->start || ex->cps[lo].offset > ex->start + (off_t)ex->len) {
+        if (export_seek(ex, &ex->cps[lo]) != 0) return -1;
+    }
+
+    // From here on ex->start <= offset
+    size_t skip = offset - ex->start;
+    while (!ex->done && (skip > ex->len || ex->len - skip < size)) {
+        // Bytes before offset won't be read again: dropped before rendering more
+        size_t drop = skip < ex->len ? skip : ex->len;
+        if (drop > 0) memmove(ex->buf, ex->buf + drop, ex->len - drop);
+        ex->len -= drop;
+        ex->start += drop;
+        skip -= drop;
+
+        // Small reads still render a useful amount per query
+        size_t want = skip + (size > EXPORT_CHECKPOINT_BYTES ? size : EXPORT_CHECKPOINT_BYTES);
+        if (export_fill(ex, want) != 0) return -1;
+    }
+
+    if (skip >= ex->len) return 0;
+
+    size_t bytes_available = ex->len - skip < size ? ex->len - skip : size;
+    memcpy(buffer, ex->buf + skip, bytes_available);
+    return bytes_available;
+}
+
+/**
+ * Render Row
+ *
+ * @brief Content of /table/<rowid>.json: the JSON object of the row, as
+ *        in the .rows.jsonl export.
+ *
+ * @param bytes Filled with the malloc'd content
+ * @param size  Filled with the size of the content
+ *
+ * @return 0 on success, 1 if the record doesn't exist, -1 on failure
+ */
+int export_render_row(const Tokens *toks, char **bytes, size_t *size) {
+    const Schema *schema = catalog_table(toks->table_id);
+    Export ex = { 0 };
+
+    sqlite3_stmt *pstmt;
+    make_rows_select(&pstmt, schema, toks->rowid, toks->rowid, 1);
+    if (!pstmt) return -1;
+
+    int rc = sqlite3_step(pstmt);
+    int res = rc == SQLITE_ROW ? export_append_row(&ex, schema, pstmt, true)
+            : rc == SQLITE_DONE ? 1 : -1;
+    qm_release(pstmt);
+
+    if (res != 0) {
+        free(ex.buf);
+        return res;
+    }
+
+    *bytes = ex.buf;
+    *size = ex.len;
+    return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <sys/types.h>
+
+#include "../db_handler/db_handler.h"
+
+typedef struct Export Export;
+
+Export *export_create(const Tokens *toks);
+void    export_destroy(Export *ex);
+int     export_read(Export *ex, char *buffer, size_t size, off_t offset);
+int     export_render_row(const Tokens *toks, char **bytes, size_t *size);
+
+#endif // EXPORT_H
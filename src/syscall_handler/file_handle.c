@@ -0,0 +1,585 @@
+#include "file_handle.h"
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+// Bytes currently materialized by all the read-only handles
+static atomic_size_t fh_cached_bytes = 0;
+
+// Handles open for writing, whose size may differ from the database's
+static FileHandle      *fh_writers = NULL;
+static pthread_mutex_t  fh_writers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool fh_reserve(size_t size) {
+    size_t cur = atomic_load(&fh_cached_bytes);
+    do {
+        if (cur + size > FH_CACHE_BUDGET) return false;
+    } while (!atomic_compare_exchange_weak(&fh_cached_bytes, &cur, cur + size));
+    return true;
+}
+
+static inline bool fh_writable(const FileHandle *fh) {
+    return (fh->flags & O_ACCMODE) != O_RDONLY;
+}
+
+// Records of tables WITHOUT ROWID are told apart by their key
+static inline bool fh_same_file(const Tokens *a, const Tokens *b) {
+    if (a->table_id != b->table_id || a->col_id != b->col_id || a->rowid != b->rowid) return false;
+    if (!catalog_table(a->table_id)->without_rowid) return true;
+    return a->value_len == b->value_len && memcmp(a->value, b->value, a->value_len) == 0;
+}
+
+/**
+ * Grow the write-back buffer
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int fh_grow(FileHandle *fh, size_t size) {
+    if (size + 1 <= fh->cap) return 0;
+
+    size_t cap = fh->cap ? fh->cap : 4096;
+    while (cap < size + 1) cap *= 2;
+
+    char *bytes = realloc(fh->bytes, cap);
+    if (!bytes) return -1;
+
+    fh->bytes = bytes;
+    fh->cap = cap;
+    return 0;
+}
+
+/**
+ * Load the value into the write-back buffer
+ *
+ * @brief Called before the first change of a writable handle. Blob mode
+ *        ends here, since the value may be about to change size.
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int fh_load(FileHandle *fh) {
+    if (fh->cached) return 0;
+
+    fh->in_place = false;
+
+    int type = get_attribute_type(&fh->toks);
+    if (type < 0) return -1;
+
+    char *bytes = NULL;
+    size_t size = 0;
+    if (get_attribute_value(&fh->toks, &bytes, &size) != 0) return -1;
+
+    fh->bytes = bytes;
+    fh->size = size;
+    fh->cap = size + 1;
+    fh->as_blob = type == SQLITE_BLOB;
+    fh->cached = true;
+    return 0;
+}
+
+/*
+ * Copies the value of a read-only handle (size bytes) through incremental I/O.
+ * From FH_SPLICE_MIN_VALUE up it goes to a memfd, mapped at fh->bytes:
+ * reads can then hand the kernel the memfd instead of a copy (see fh_slice).
+ * Returns 0 on success, -1 on failure.
+ */
+static int fh_materialize(FileHandle *fh, size_t size) {
+    char *bytes = NULL;
+    int fd = size >= FH_SPLICE_MIN_VALUE ? memfd_create("vfs2db", MFD_CLOEXEC) : -1;
+    if (fd >= 0) {
+        if (ftruncate(fd, size) == 0) {
+            bytes = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (bytes == MAP_FAILED) bytes = NULL;
+        }
+        if (!bytes) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    // No memfd: on the heap, NUL terminated like any other copy
+    if (!bytes) {
+        bytes = malloc(size + 1);
+        if (!bytes) return -1;
+        bytes[size] = '\0';
+    }
+
+    if (read_attribute_blob(&fh->toks, bytes, size, 0) != (int)size) {
+        if (fd >= 0) {
+            munmap(bytes, size);
+            close(fd);
+        } else {
+            free(bytes);
+        }
+        return -1;
+    }
+
+    fh->bytes = bytes;
+    fh->fd = fd;
+    fh->size = size;
+    fh->cap = fd >= 0 ? size : size + 1;
+    fh->reserved = size;
+    fh->cached = true;
+    return 0;
+}
+
+/**
+ * Open the value of a new handle
+ *
+ * @brief Picks how the handle accesses its value (see fh_create).
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int fh_open_value(FileHandle *fh, bool writable) {
+    const Tokens *toks = &fh->toks;
+
+    // O_TRUNC: the value is replaced, no need to read it
+    if (writable && (fh->flags & O_TRUNC)) {
+        int type = get_attribute_type(toks);
+        if (type < 0) return -1;
+
+        fh->as_blob = type == SQLITE_BLOB;
+        fh->cached = true;
+        fh->dirty = true;
+        return 0;
+    }
+
+    // Small values are usually in the row cache already: getattr precedes open
+    if (!writable && row_cache_enabled()) {
+        char *bytes = NULL;
+        size_t size = 0;
+        int rc = get_attribute_value_capped(toks, &bytes, &size, ROW_CACHE_MAX_VALUE);
+        if (rc < 0) return -1;
+
+        if (rc == 0) {
+            if (fh_reserve(size)) {
+                fh->bytes = bytes;
+                fh->size = size;
+                fh->cap = size + 1;
+                fh->reserved = size;
+                fh->cached = true;
+            } else {
+                free(bytes);
+            }
+            return 0;
+        }
+    }
+
+    // Incremental I/O gives the size without loading the value
+    int blob_size = get_attribute_blob_size(toks, writable);
+    if (blob_size >= 0) {
+        size_t bytes = blob_size;
+        if (bytes > FH_MAX_VALUE_SIZE) {
+            fh->in_place = true;
+            return 0;
+        }
+
+        // Small enough: materialize it (read-only) or buffer it at the first write
+        if (!writable && fh_reserve(bytes) && fh_materialize(fh, bytes) != 0) {
+            atomic_fetch_sub(&fh_cached_bytes, bytes);
+        }
+        return 0;
+    }
+
+    // Writable handles load the value at their first change
+    if (writable) return 0;
+
+    // Other types go through a SELECT
+    char *bytes = NULL;
+    size_t size = 0;
+    int rc = get_attribute_value_capped(toks, &bytes, &size, FH_MAX_VALUE_SIZE);
+    if (rc < 0) return -1;
+
+    if (rc == 0 && fh_reserve(size)) {
+        fh->bytes = bytes;
+        fh->size = size;
+        fh->cap = size + 1;
+        fh->reserved = size;
+        fh->cached = true;
+    } else {
+        free(bytes);
+    }
+
+    return 0;
+}
+
+/**
+ * Create File Handle
+ *
+ * @brief Creates the per-open state of an attribute file.
+ *        Files opened read-only get their value materialized once, so that
+ *        every read is served as a slice of it, with no copy (see fh_slice).
+ *        TEXT and BLOB values larger than FH_MAX_VALUE_SIZE (or exceeding
+ *        the FH_CACHE_BUDGET shared by all the handles) are accessed in
+ *        blob mode instead: reads/writes stream at their offset, each
+ *        through an incremental I/O handle of its own. The writes share
+ *        a transaction, committed by fh_flush at the latest.
+ *        Writes that don't fit blob mode are buffered by the handle and
+ *        written back with a single UPDATE by fh_flush, unless a truncate
+ *        or fallocate preallocated the value beforehand (see fh_truncate).
+ *        Anything else is read from the database at every call.
+ *
+ * @param toks  Resolved attribute path, copied into the handle
+ * @param flags Open flags
+ *
+ * @return the new handle, NULL on failure
+ */
+FileHandle *fh_create(const Tokens *toks, int flags) {
+    FileHandle *fh = calloc(1, sizeof(FileHandle));
+    if (!fh) return NULL;
+
+    fh->toks = *toks;
+    fh->fd = -1;
+    fh->flags = flags;
+    pthread_mutex_init(&fh->lock, NULL);
+
+    bool writable = fh_writable(fh);
+    if (fh_open_value(fh, writable) != 0) {
+        fh_destroy(fh);
+        return NULL;
+    }
+
+    // Published only once initialized: fh_lookup_size runs on other threads
+    if (writable) {
+        pthread_mutex_lock(&fh_writers_lock);
+        fh->next = fh_writers;
+        fh_writers = fh;
+        pthread_mutex_unlock(&fh_writers_lock);
+    }
+
+    return fh;
+}
+
+/**
+ * Create Virtual File Handle
+ *
+ * @brief Read-only handle serving generated content (e.g. the stats file),
+ *        not backed by any attribute.
+ *
+ * @param bytes Content, owned by the handle from now on
+ * @param size  Size of the content
+ *
+ * @return the new handle, NULL on failure (bytes is not freed)
+ */
+FileHandle *fh_create_virtual(char *bytes, size_t size) {
+    FileHandle *fh = calloc(1, sizeof(FileHandle));
+    if (!fh) return NULL;
+
+    fh->flags = O_RDONLY;
+    fh->fd = -1;
+    fh->bytes = bytes;
+    fh->size = size;
+    fh->cap = size;
+    fh->cached = true;
+    pthread_mutex_init(&fh->lock, NULL);
+    return fh;
+}
+
+/**
+ * Create Export File Handle
+ *
+ * @brief Read-only handle streaming a table export file.
+ *
+ * @param ex Stream, owned by the handle from now on
+ *
+ * @return the new handle, NULL on failure (ex is not destroyed)
+ */
+FileHandle *fh_create_export(Export *ex) {
+    FileHandle *fh = calloc(1, sizeof(FileHandle));
+    if (!fh) return NULL;
+
+    fh->flags = O_RDONLY;
+    fh->fd = -1;
+    fh->export = ex;
+    pthread_mutex_init(&fh->lock, NULL);
+    return fh;
+}
+
+/**
+ * Destroy File Handle
+ *
+ * @brief Releases the handle. Pending writes must be flushed before.
+ */
+void fh_destroy(FileHandle *fh) {
+    if (!fh) return;
+
+    if (fh_writable(fh)) {
+        pthread_mutex_lock(&fh_writers_lock);
+        for (FileHandle **p = &fh_writers; *p; p = &(*p)->next) {
+            if (*p == fh) { *p = fh->next; break; }
+        }
+        pthread_mutex_unlock(&fh_writers_lock);
+    }
+
+    atomic_fetch_sub(&fh_cached_bytes, fh->reserved);
+    if (fh->fd >= 0) {
+        munmap(fh->bytes, fh->size);
+        close(fh->fd);
+    } else {
+        free(fh->bytes);
+    }
+    export_destroy(fh->export);
+    pthread_mutex_destroy(&fh->lock);
+    free(fh);
+}
+
+/**
+ * Read from File Handle
+ *
+ * @brief Reads see the pending writes of the handle.
+ *
+ * @return bytes copied into buffer, -1 if the handle can't serve the read
+ */
+int fh_read(FileHandle *fh, char *buffer, size_t size, off_t offset) {
+    if (!fh || offset < 0) return -1;
+
+    pthread_mutex_lock(&fh->lock);
+
+    int res;
+    if (fh->export) {
+        res = export_read(fh->export, buffer, size, offset);
+    } else if (fh->in_place) {
+        res = read_attribute_blob(&fh->toks, buffer, size, offset);
+    } else if (!fh->cached) {
+        res = -1;
+    } else if ((size_t)offset >= fh->size) {
+        res = 0;
+    } else {
+        size_t bytes_available = fh->size - offset;
+        if (bytes_available > size) bytes_available = size;
+
+        memcpy(buffer, fh->bytes + offset, bytes_available);
+        res = bytes_available;
+    }
+
+    pthread_mutex_unlock(&fh->lock);
+    return res;
+}
+
+/**
+ * Slice of File Handle
+ *
+ * @brief Lends the bytes a read would copy: read-only handles never change
+ *        their value, so it stays valid until the handle is destroyed.
+ *
+ * @param mem Filled with the first byte of the slice
+ * @param fd  Filled with the memfd holding the value, the slice starting
+ *            at offset in it (-1 if the value is on the heap)
+ *
+ * @return bytes in the slice, -1 if the handle can't lend its value
+ *         (writable, not materialized, export stream)
+ */
+int fh_slice(FileHandle *fh, size_t size, off_t offset, const char **mem, int *fd) {
+    if (!fh || offset < 0 || !fh->cached || fh_writable(fh) || fh->export) return -1;
+
+    size_t bytes_available = (size_t)offset < fh->size ? fh->size - offset : 0;
+    if (bytes_available > size) bytes_available = size;
+
+    *mem = fh->bytes + (bytes_available ? offset : 0);
+    *fd = fh->fd;
+    return bytes_available;
+}
+
+static int fh_write_locked(FileHandle *fh, const char *buffer, size_t size, off_t offset) {
+    if (fh->in_place) {
+        int res = write_attribute_blob(&fh->toks, buffer, size, offset);
+        if (res >= 0) {
+            fh->modified = true;
+            return res;
+        }
+    }
+
+    if (fh_load(fh) != 0) return -1;
+
+    size_t end = (size_t)offset + size;
+    if (fh_grow(fh, end) != 0) return -1;
+
+    if ((size_t)offset > fh->size) memset(fh->bytes + fh->size, 0, offset - fh->size);
+    memcpy(fh->bytes + offset, buffer, size);
+    if (end > fh->size) fh->size = end;
+
+    fh->dirty = true;
+    return size;
+}
+
+/**
+ * Write to File Handle
+ *
+ * @brief Blob mode writes in place as long as the value doesn't grow.
+ *        Every other write lands in the write-back buffer, with the usual
+ *        file semantics: bytes at offset are overwritten, the value grows
+ *        as needed and holes are zero filled.
+ *
+ * @return bytes written, -1 on failure
+ */
+int fh_write(FileHandle *fh, const char *buffer, size_t size, off_t offset) {
+    if (!fh || offset < 0) return -1;
+
+    pthread_mutex_lock(&fh->lock);
+    int res = fh_write_locked(fh, buffer, size, offset);
+    pthread_mutex_unlock(&fh->lock);
+    return res;
+}
+
+/*
+ * Resizes the value in the database and, past FH_MAX_VALUE_SIZE, moves the
+ * handle to blob mode on it, so that the writes that follow fill it in
+ * place instead of growing the write-back buffer. Smaller values are
+ * loaded by the first write and stored back with one UPDATE, as usual.
+ * Only while the buffer holds no bytes of its own: not loaded, or emptied
+ * (O_TRUNC, truncate to 0) and not written since.
+ * Only BLOBs are padded without being built in memory: SQLite has no
+ * zeroblob for TEXT, and the CAST that keeps a TEXT value TEXT copies it.
+ * Returns 0 on success, 1 if the buffer has to take the change, -1 on failure.
+ */
+static int fh_preallocate(FileHandle *fh, size_t size) {
+    if (fh->cached && fh->dirty && fh->size > 0) return 1;
+
+    // A buffer not written back yet stands for an empty value
+    bool keep = !(fh->cached && fh->dirty);
+    int type = SQLITE_NULL;
+    if (!fh->cached || size > FH_MAX_VALUE_SIZE) {
+        type = get_attribute_type(&fh->toks);
+        if (type < 0) return -1;
+    }
+    if (!fh->cached) fh->as_blob = type == SQLITE_BLOB;
+
+    // Where incremental I/O is refused (tables WITHOUT ROWID, indexed
+    // columns), the first write would load the whole preallocated value
+    if (size > FH_MAX_VALUE_SIZE) {
+        bool has_blob = type == SQLITE_TEXT || type == SQLITE_BLOB;
+        if (catalog_table(fh->toks.table_id)->without_rowid
+         || (has_blob && get_attribute_blob_size(&fh->toks, true) < 0)) return 1;
+    }
+
+    fh->in_place = false;
+    if (resize_attribute_value(&fh->toks, size, keep, fh->as_blob) != 0) return -1;
+
+    free(fh->bytes);
+    fh->bytes = NULL;
+    fh->size = 0;
+    fh->cap = 0;
+    fh->cached = false;
+    fh->dirty = false;
+    fh->modified = true;
+
+    // No blob mode after all (e.g. was NULL, in an indexed column): writes load the value
+    if (size > FH_MAX_VALUE_SIZE) fh->in_place = get_attribute_blob_size(&fh->toks, true) >= 0;
+    return 0;
+}
+
+// Shrinks or zero-extends the write-back buffer
+static int fh_resize_buffer(FileHandle *fh, size_t size) {
+    if (fh_load(fh) != 0 || fh_grow(fh, size) != 0) return -1;
+
+    if (size > fh->size) memset(fh->bytes + fh->size, 0, size - fh->size);
+    fh->size = size;
+    fh->dirty = true;
+    return 0;
+}
+
+/**
+ * Truncate File Handle
+ *
+ * @brief Resizes the value in the database when the handle has nothing
+ *        buffered: the size is also a hint of the value about to be
+ *        written, which then fills a large preallocated value in place
+ *        (see fh_preallocate). Otherwise shrinks or zero-extends the
+ *        buffered value.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int fh_truncate(FileHandle *fh, off_t size) {
+    if (!fh || size < 0) return -1;
+
+    pthread_mutex_lock(&fh->lock);
+
+    int res = fh_preallocate(fh, size);
+    if (res > 0) res = fh_resize_buffer(fh, size);
+
+    pthread_mutex_unlock(&fh->lock);
+    return res;
+}
+
+/**
+ * Allocate File Handle
+ *
+ * @brief fallocate with no flags: makes the value at least offset + length
+ *        bytes long, zero-extending it like fh_truncate would.
+ *
+ * @return 0 on success, -1 on failure
+ */
+int fh_allocate(FileHandle *fh, off_t offset, off_t length) {
+    if (!fh || offset < 0 || length <= 0) return -1;
+
+    pthread_mutex_lock(&fh->lock);
+
+    size_t end = (size_t)offset + (size_t)length;
+    int size = fh->cached ? (int)fh->size : get_attribute_size(&fh->toks);
+
+    int res = size < 0 ? -1 : 0;
+    if (res == 0 && end > (size_t)size) {
+        res = fh_preallocate(fh, end);
+        if (res > 0) res = fh_resize_buffer(fh, end);
+    }
+
+    pthread_mutex_unlock(&fh->lock);
+    return res;
+}
+
+/**
+ * Flush File Handle
+ *
+ * @brief Writes the buffered value back with a single UPDATE, or commits
+ *        the writes made in place (see commit_attribute_blob).
+ *
+ * @return 1 if the value changed since the last flush, 0 if it didn't,
+ *         -1 on failure
+ */
+int fh_flush(FileHandle *fh) {
+    if (!fh) return 0;
+
+    pthread_mutex_lock(&fh->lock);
+
+    int res = fh->modified ? 1 : 0;
+    if (fh->in_place && fh->modified && commit_attribute_blob() != 0) res = -1;
+    if (fh->dirty) {
+        if (update_attribute_value(&fh->toks, fh->bytes, fh->size, fh->as_blob) != 0) {
+            res = -1;
+        } else {
+            fh->dirty = false;
+            res = 1;
+        }
+    }
+    if (res > 0) fh->modified = false;
+
+    pthread_mutex_unlock(&fh->lock);
+    return res;
+}
+
+/**
+ * Lookup Pending Size
+ *
+ * @brief Size of a file with writes not flushed yet, so that getattr
+ *        doesn't report the stale size stored in the database.
+ *
+ * @return true if an open handle has pending writes for the file
+ */
+bool fh_lookup_size(const Tokens *toks, size_t *size) {
+    bool found = false;
+
+    // Lock order: fh_writers_lock, then the handle's lock
+    pthread_mutex_lock(&fh_writers_lock);
+    for (FileHandle *fh = fh_writers; fh && !found; fh = fh->next) {
+        if (!fh_same_file(&fh->toks, toks)) continue;
+
+        pthread_mutex_lock(&fh->lock);
+        if (fh->dirty) {
+            *size = fh->size;
+            found = true;
+        }
+        pthread_mutex_unlock(&fh->lock);
+    }
+    pthread_mutex_unlock(&fh_writers_lock);
+
+    return found;
+}
@@ -0,0 +1,65 @@
+#ifndef FILE_HANDLE_H
+#define FILE_HANDLE_H
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "../db_handler/db_handler.h"
+#include "export.h"
+
+/**
+ * File Handle Structure
+ *
+ * Per-open state of an attribute file, stored in fuse_file_info->fh.
+ *
+ * toks:     resolved attribute path (depth 0 for virtual files)
+ * bytes:    value materialized by the handle (NULL if not cached)
+ * fd:       memfd holding the value, mapped at bytes (-1 if bytes is on the heap)
+ * size:     size of the value in bytes
+ * cap:      allocated size of bytes
+ * reserved: bytes accounted against FH_CACHE_BUDGET
+ * cached:   whether reads can be served from bytes
+ * dirty:    whether bytes has to be written back to the database
+ * modified: whether the value was changed in place (blob mode) since the last flush
+ * as_blob:  whether the value is written back as a BLOB (otherwise TEXT)
+ * in_place: whether reads/writes go to the value in place (blob mode)
+ * export:   stream of a table export file (NULL for any other file)
+ * flags:    open flags
+ * lock:     serializes the operations on the handle (same fd, several threads)
+ * next:     next handle open for writing (see fh_lookup_size)
+ */
+typedef struct FileHandle {
+    Tokens toks;
+
+    char   *bytes;
+    int     fd;
+    size_t  size;
+    size_t  cap;
+    size_t  reserved;
+    bool    cached;
+    bool    dirty;
+    bool    modified;
+    bool    as_blob;
+    bool    in_place;
+
+    Export *export;
+    int     flags;
+
+    pthread_mutex_t    lock;
+    struct FileHandle *next;
+} FileHandle;
+
+FileHandle *fh_create(const Tokens *toks, int flags);
+FileHandle *fh_create_virtual(char *bytes, size_t size);
+FileHandle *fh_create_export(Export *ex);
+void        fh_destroy(FileHandle *fh);
+int         fh_read(FileHandle *fh, char *buffer, size_t size, off_t offset);
+int         fh_slice(FileHandle *fh, size_t size, off_t offset, const char **mem, int *fd);
+int         fh_write(FileHandle *fh, const char *buffer, size_t size, off_t offset);
+int         fh_truncate(FileHandle *fh, off_t size);
+int         fh_allocate(FileHandle *fh, off_t offset, off_t length);
+int         fh_flush(FileHandle *fh);
+bool        fh_lookup_size(const Tokens *toks, size_t *size);
+
+#endif // FILE_HANDLE_H
@@ -0,0 +1,361 @@
+#include "inode.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "path.h"
+
+#define INO_BUCKETS 16384
+
+// Kind of an encoded inode (bits 62..60)
+typedef enum InoKind {
+    INO_KIND_TABLE,         // /table
+    INO_KIND_BUCKET,        // /table/000123xxx: bucket in the rowid bits
+    INO_KIND_RECORD,        // /table/123
+    INO_KIND_BUCKET_RECORD, // /table/000000xxx/123
+    INO_KIND_ATTR,          // any path of /table/123/column.vfs2db but a symlink
+    INO_KIND_LINK,          // /table/123/fk.vfs2db
+    INO_KIND_BUCKET_LINK,   // /table/000000xxx/123/fk.vfs2db
+    INO_KIND_EXPORT,        // /table/.rows.csv...: ExportFormat in the column bits
+} InoKind;
+
+/**
+ * Dynamic Inode
+ *
+ * ino:       inode number
+ * nlookup:   lookups the kernel didn't forget yet
+ * path:      path the inode stands for, resolved again by each operation
+ * next_path: next node in the same bucket of ino_by_path
+ * next_ino:  next node in the same bucket of ino_by_ino
+ */
+typedef struct InoNode {
+    uint64_t        ino;
+    uint64_t        nlookup;
+    char           *path;
+    struct InoNode *next_path;
+    struct InoNode *next_ino;
+} InoNode;
+
+static pthread_mutex_t  ino_lock = PTHREAD_MUTEX_INITIALIZER;
+static InoNode         *ino_by_path[INO_BUCKETS];
+static InoNode         *ino_by_ino[INO_BUCKETS];
+static uint64_t         ino_next = INO_FIRST_DYNAMIC;
+
+static size_t ino_path_hash(const char *path) {
+    // FNV-1a
+    uint64_t h = 1469598103934665603ULL;
+    for (const char *p = path; *p; p++) { h ^= (unsigned char)*p; h *= 1099511628211ULL; }
+    return h % INO_BUCKETS;
+}
+
+static inline bool ino_rowid_fits(int64_t rowid) {
+    return rowid >= 0 && rowid < (1LL << INO_ROWID_BITS);
+}
+
+static inline uint64_t ino_make(InoKind kind, int table_id, int col_id, int64_t rowid) {
+    return INO_ENCODED | (uint64_t)kind << INO_KIND_SHIFT
+         | (uint64_t)table_id << INO_TABLE_SHIFT
+         | (uint64_t)col_id << INO_COL_SHIFT
+         | (uint64_t)rowid;
+}
+
+bool ino_is_encoded(uint64_t ino) {
+    return (ino & INO_ENCODED) != 0;
+}
+
+/**
+ * Encode Inode
+ *
+ * @brief Inode of a resolved path, made of its ids. An attribute file has
+ *        the same inode whatever directory it is reached through, so
+ *        tools that compare inodes see a single file. Symlinks and
+ *        directories can't: the target of a symlink is relative to its
+ *        directory, and a directory has a single parent.
+ *
+ * @param toks Resolved path (the rowid of a .pk record already looked up)
+ * @param ino  Filled with the inode
+ *
+ * @return whether the path can be encoded, otherwise it needs a dynamic
+ *         inode (see ino_dynamic_get)
+ */
+bool ino_encode(const Tokens *toks, uint64_t *ino) {
+    if (toks->depth == 0) {
+        *ino = INO_ROOT;
+        return true;
+    }
+    if (toks->table_id >= (1 << INO_TABLE_BITS)) return false;
+
+    const Schema *schema = catalog_table(toks->table_id);
+    bool flat = !toks->where && !toks->by_pk;
+
+    switch (toks->depth) {
+        case 1:
+            if (!flat) return false;
+            if (!toks->in_bucket) {
+                *ino = ino_make(INO_KIND_TABLE, toks->table_id, 0, 0);
+                return true;
+            }
+            if (!ino_rowid_fits(toks->bucket)) return false;
+            *ino = ino_make(INO_KIND_BUCKET, toks->table_id, 0, toks->bucket);
+            return true;
+        case 2:
+            if (!flat || !ino_rowid_fits(toks->rowid)) return false;
+            if (toks->export != EXPORT_NONE) {
+                *ino = ino_make(INO_KIND_EXPORT, toks->table_id, toks->export,
+                                toks->export == EXPORT_ROW_JSON ? toks->rowid : 0);
+                return true;
+            }
+            *ino = ino_make(toks->in_bucket ? INO_KIND_BUCKET_RECORD : INO_KIND_RECORD,
+                            toks->table_id, 0, toks->rowid);
+            return true;
+        case 3: {
+            if (schema->without_rowid || !ino_rowid_fits(toks->rowid)
+             || toks->col_id >= (1 << INO_COL_BITS)) return false;
+
+            InoKind kind = INO_KIND_ATTR;
+            if (schema->cols[toks->col_id].fk) {
+                if (!flat) return false;
+                kind = toks->in_bucket ? INO_KIND_BUCKET_LINK : INO_KIND_LINK;
+            }
+            *ino = ino_make(kind, toks->table_id, toks->col_id, toks->rowid);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+/**
+ * Decode Inode
+ *
+ * @brief Inverse of ino_encode, without touching the database: whether
+ *        the record exists is left to the operation.
+ *
+ * @return 0 on success, -ENOENT if ino isn't a valid encoded inode
+ */
+int ino_decode(uint64_t ino, Tokens *toks) {
+    path_root(toks);
+    if (ino == INO_ROOT) return 0;
+    if (!ino_is_encoded(ino)) return -ENOENT;
+
+    InoKind kind = (InoKind)((ino >> INO_KIND_SHIFT) & 0x7);
+    int table_id = (int)((ino >> INO_TABLE_SHIFT) & ((1ULL << INO_TABLE_BITS) - 1));
+    int col_id = (int)((ino >> INO_COL_SHIFT) & ((1ULL << INO_COL_BITS) - 1));
+    int64_t rowid = (int64_t)(ino & ((1ULL << INO_ROWID_BITS) - 1));
+
+    // Inodes of a dropped (or redefined) table are gone with it
+    if (!catalog_table_name(table_id)) return -ENOENT;
+    const Schema *schema = catalog_table(table_id);
+    bool bucketed = kind == INO_KIND_BUCKET || kind == INO_KIND_BUCKET_RECORD || kind == INO_KIND_BUCKET_LINK;
+    if (bucketed && mount_opts.bucket_fanout == 0) return -ENOENT;
+
+    toks->table_id = table_id;
+    toks->table = schema->name;
+
+    switch (kind) {
+        case INO_KIND_TABLE:
+            toks->depth = 1;
+            return 0;
+        case INO_KIND_BUCKET:
+            toks->depth = 1;
+            toks->in_bucket = true;
+            toks->bucket = rowid;
+            return 0;
+        case INO_KIND_EXPORT:
+            if (col_id != EXPORT_CSV && col_id != EXPORT_JSONL && col_id != EXPORT_ROW_JSON) return -ENOENT;
+            toks->depth = 2;
+            toks->export = (ExportFormat)col_id;
+            toks->rowid = rowid;
+            return 0;
+        default:
+            break;
+    }
+
+    if (schema->without_rowid) return -ENOENT;
+    toks->rowid = rowid;
+    toks->in_bucket = bucketed;
+    if (bucketed) toks->bucket = path_bucket_of(rowid);
+
+    if (kind == INO_KIND_RECORD || kind == INO_KIND_BUCKET_RECORD) {
+        toks->depth = 2;
+        return 0;
+    }
+
+    if (col_id >= schema->n_cols) return -ENOENT;
+    toks->depth = 3;
+    toks->col_id = col_id;
+    toks->attribute = schema->cols[col_id].name;
+    return 0;
+}
+
+/**
+ * Path of an Inode
+ *
+ * @brief A path of the inode, as the high-level callbacks take it: the
+ *        flat one for the attribute files reachable through several.
+ *
+ * @return 0 on success, -ENOENT if the inode doesn't exist, -ENAMETOOLONG
+ *         if the path doesn't fit
+ */
+int ino_path(uint64_t ino, char *path, size_t size) {
+    const char *fixed = ino == INO_ROOT ? "/"
+                      : ino == INO_META_DIR ? META_DIR
+                      : ino == INO_META_STATS ? META_STATS
+                      : NULL;
+    if (fixed) return snprintf(path, size, "%s", fixed) < (int)size ? 0 : -ENAMETOOLONG;
+
+    if (!ino_is_encoded(ino)) {
+        pthread_mutex_lock(&ino_lock);
+        InoNode *node = ino_by_ino[ino % INO_BUCKETS];
+        while (node && node->ino != ino) node = node->next_ino;
+        int n = node ? snprintf(path, size, "%s", node->path) : -1;
+        pthread_mutex_unlock(&ino_lock);
+
+        if (n < 0) return -ENOENT;
+        return (size_t)n < size ? 0 : -ENAMETOOLONG;
+    }
+
+    Tokens toks;
+    if (ino_decode(ino, &toks) != 0) return -ENOENT;
+
+    int n = snprintf(path, size, "/%s", toks.table);
+    if (toks.in_bucket) {
+        char bucket[32];
+        if (path_bucket_name(toks.bucket, bucket, sizeof(bucket)) < 0) return -ENOENT;
+        n += snprintf(path + n, n < (int)size ? size - n : 0, "/%s", bucket);
+    }
+
+    if (toks.export == EXPORT_CSV || toks.export == EXPORT_JSONL) {
+        const char *name = toks.export == EXPORT_CSV ? EXPORT_CSV_NAME : EXPORT_JSONL_NAME;
+        n += snprintf(path + n, n < (int)size ? size - n : 0, "/%s", name);
+    } else if (toks.export == EXPORT_ROW_JSON) {
+        n += snprintf(path + n, n < (int)size ? size - n : 0, "/%lld" EXPORT_ROW_EXT, (long long)toks.rowid);
+    } else if (toks.depth >= 2) {
+        n += snprintf(path + n, n < (int)size ? size - n : 0, "/%lld", (long long)toks.rowid);
+    }
+
+    if (toks.depth == 3) {
+        n += snprintf(path + n, n < (int)size ? size - n : 0, "/%s" ATTR_EXT, toks.attribute);
+    }
+    return n < (int)size ? 0 : -ENAMETOOLONG;
+}
+
+// =============================================================
+// Dynamic Inodes
+// =============================================================
+
+// With ino_lock held
+static InoNode *ino_find_path(const char *path) {
+    InoNode *node = ino_by_path[ino_path_hash(path)];
+    while (node && strcmp(node->path, path) != 0) node = node->next_path;
+    return node;
+}
+
+/**
+ * Get Dynamic Inode
+ *
+ * @brief Inode of a path that can't be encoded, for a lookup: the same
+ *        path keeps the same inode until the kernel forgets it.
+ *
+ * @return the inode, 0 on failure
+ */
+uint64_t ino_dynamic_get(const char *path) {
+    pthread_mutex_lock(&ino_lock);
+
+    InoNode *node = ino_find_path(path);
+    if (node) {
+        node->nlookup++;
+        pthread_mutex_unlock(&ino_lock);
+        return node->ino;
+    }
+
+    node = malloc(sizeof(InoNode));
+    if (node) node->path = strdup(path);
+    if (!node || !node->path) {
+        free(node);
+        pthread_mutex_unlock(&ino_lock);
+        return 0;
+    }
+
+    node->ino = ino_next++;
+    node->nlookup = 1;
+
+    size_t b = ino_path_hash(path);
+    node->next_path = ino_by_path[b];
+    ino_by_path[b] = node;
+
+    b = node->ino % INO_BUCKETS;
+    node->next_ino = ino_by_ino[b];
+    ino_by_ino[b] = node;
+
+    pthread_mutex_unlock(&ino_lock);
+    return node->ino;
+}
+
+/**
+ * Find Dynamic Inode
+ *
+ * @return the inode of path if the kernel holds one, 0 otherwise
+ */
+uint64_t ino_dynamic_find(const char *path) {
+    pthread_mutex_lock(&ino_lock);
+    InoNode *node = ino_find_path(path);
+    uint64_t ino = node ? node->ino : 0;
+    pthread_mutex_unlock(&ino_lock);
+    return ino;
+}
+
+/**
+ * Forget Inode
+ *
+ * @brief The kernel dropped nlookup lookups of ino: a dynamic inode goes
+ *        away with the last one. Encoded inodes have no state.
+ */
+void ino_forget(uint64_t ino, uint64_t nlookup) {
+    if (ino_is_encoded(ino) || ino < INO_FIRST_DYNAMIC) return;
+
+    pthread_mutex_lock(&ino_lock);
+
+    InoNode **p = &ino_by_ino[ino % INO_BUCKETS];
+    while (*p && (*p)->ino != ino) p = &(*p)->next_ino;
+    InoNode *node = *p;
+    if (!node) {
+        pthread_mutex_unlock(&ino_lock);
+        return;
+    }
+
+    node->nlookup = nlookup < node->nlookup ? node->nlookup - nlookup : 0;
+    if (node->nlookup > 0) {
+        pthread_mutex_unlock(&ino_lock);
+        return;
+    }
+
+    *p = node->next_ino;
+    InoNode **q = &ino_by_path[ino_path_hash(node->path)];
+    while (*q != node) q = &(*q)->next_path;
+    *q = node->next_path;
+
+    pthread_mutex_unlock(&ino_lock);
+
+    free(node->path);
+    free(node);
+}
+
+void ino_cleanup(void) {
+    pthread_mutex_lock(&ino_lock);
+    for (size_t i = 0; i < INO_BUCKETS; i++) {
+        InoNode *node = ino_by_ino[i];
+        while (node) {
+            InoNode *next = node->next_ino;
+            free(node->path);
+            free(node);
+            node = next;
+        }
+        ino_by_ino[i] = NULL;
+        ino_by_path[i] = NULL;
+    }
+    pthread_mutex_unlock(&ino_lock);
+}
@@ -0,0 +1,42 @@
+#ifndef INODE_H
+#define INODE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../db_handler/db_handler.h"
+
+// Fixed inodes: the root is FUSE_ROOT_ID
+#define INO_ROOT       1
+#define INO_META_DIR   2
+#define INO_META_STATS 3
+
+/*
+ * Encoded inodes (bit 63 set): the kind of node, then the ids of its
+ * table, column and record, so that they are resolved with no lookup.
+ *
+ *   63 | 62..60 kind | 59..46 table_id | 45..36 col_id | 35..0 rowid
+ *
+ * The other inodes (paths through .where or .pk, rowids out of range)
+ * are numbered as they are looked up, from INO_FIRST_DYNAMIC.
+ */
+#define INO_ENCODED       (1ULL << 63)
+#define INO_KIND_SHIFT    60
+#define INO_TABLE_BITS    14
+#define INO_TABLE_SHIFT   46
+#define INO_COL_BITS      10
+#define INO_COL_SHIFT     36
+#define INO_ROWID_BITS    36
+#define INO_FIRST_DYNAMIC 16
+
+bool ino_is_encoded(uint64_t ino);
+bool ino_encode(const Tokens *toks, uint64_t *ino);
+int  ino_decode(uint64_t ino, Tokens *toks);
+int  ino_path(uint64_t ino, char *path, size_t size);
+
+uint64_t ino_dynamic_get(const char *path);
+uint64_t ino_dynamic_find(const char *path);
+void     ino_forget(uint64_t ino, uint64_t nlookup);
+void     ino_cleanup(void);
+
+#endif // INODE_H
@@ -0,0 +1,266 @@
+#include "invalidation.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../db_handler/db_handler.h"
+
+#define INVAL_BUCKETS 16384
+
+/**
+ * Invalidation Entry
+ *
+ * path: mount-relative path, as given to the FUSE callbacks
+ * next: next entry in the same bucket (or queue)
+ */
+typedef struct InvalPath {
+    char             *path;
+    struct InvalPath *next;
+} InvalPath;
+
+static InvalFn          inval_fn = NULL;
+static unsigned int     inval_poll_ms = 0;
+static bool             inval_running = false;
+static bool             inval_stopping = false;
+static pthread_t        inval_thread;
+static pthread_mutex_t  inval_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   inval_cond = PTHREAD_COND_INITIALIZER;
+
+// Paths the kernel may hold in its caches, invalidated on external changes
+static InvalPath      **inval_tracked = NULL;
+static size_t           inval_n_tracked = 0;
+
+// Paths changed by our own write path, waiting to be invalidated
+static InvalPath       *inval_pending = NULL;
+
+static size_t inval_hash(const char *path) {
+    // FNV-1a
+    uint64_t h = 1469598103934665603ULL;
+    for (const char *p = path; *p; p++) { h ^= (unsigned char)*p; h *= 1099511628211ULL; }
+    return h % INVAL_BUCKETS;
+}
+
+static void inval_free_list(InvalPath *e) {
+    while (e) {
+        InvalPath *next = e->next;
+        free(e->path);
+        free(e);
+        e = next;
+    }
+}
+
+// Errors (mostly -ENOENT) just mean there was nothing cached
+static void inval_list(InvalPath *e) {
+    for (; e; e = e->next) inval_fn(e->path);
+}
+
+// External commits bump data_version: the changed rows are unknown,
+// so every tracked path and every cached row is invalidated.
+// The commit may have been DDL: the catalog follows it first
+static void inval_check_data_version(sqlite3_int64 *last) {
+    sqlite3_int64 version;
+    if (get_data_version(&version) != 0 || version == *last) return;
+
+    bool first = *last < 0;
+    *last = version;
+    if (first) return;
+
+    LOG_INFO("invalidation: database changed externally\n");
+    catalog_refresh();
+    row_cache_clear();
+
+    pthread_mutex_lock(&inval_lock);
+    InvalPath **tracked = inval_tracked;
+    inval_tracked = calloc(INVAL_BUCKETS, sizeof(InvalPath*));
+    inval_n_tracked = 0;
+    pthread_mutex_unlock(&inval_lock);
+
+    if (!tracked) return;
+    for (size_t i = 0; i < INVAL_BUCKETS; i++) {
+        inval_list(tracked[i]);
+        inval_free_list(tracked[i]);
+    }
+    free(tracked);
+}
+
+static void *inval_worker(void *arg) {
+    (void)arg;
+    sqlite3_int64 last_version = -1;
+
+    pthread_mutex_lock(&inval_lock);
+    while (!inval_stopping) {
+        if (!inval_pending) {
+            if (inval_poll_ms == 0) {
+                pthread_cond_wait(&inval_cond, &inval_lock);
+            } else {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec  += inval_poll_ms / 1000;
+                ts.tv_nsec += (long)(inval_poll_ms % 1000) * 1000000L;
+                if (ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+                pthread_cond_timedwait(&inval_cond, &inval_lock, &ts);
+            }
+            if (inval_stopping) break;
+        }
+
+        InvalPath *pending = inval_pending;
+        inval_pending = NULL;
+        pthread_mutex_unlock(&inval_lock);
+
+        inval_list(pending);
+        inval_free_list(pending);
+        if (inval_poll_ms > 0) inval_check_data_version(&last_version);
+
+        pthread_mutex_lock(&inval_lock);
+    }
+    pthread_mutex_unlock(&inval_lock);
+
+    return NULL;
+}
+
+/**
+ * Start Invalidation
+ *
+ * @brief Starts the thread that keeps the kernel caches (and the row
+ *        cache) coherent.
+ *        Invalidations never run inside a FUSE callback: notifying the
+ *        kernel about the inode an operation is working on can deadlock.
+ *
+ * @param inval   Invalidates a path in the kernel caches
+ * @param poll_ms Interval between two data_version checks, 0 to only
+ *                invalidate the changes made through the mount
+ *
+ * @return 0 on success, -1 on failure
+ */
+int inval_start(InvalFn inval, unsigned int poll_ms) {
+    inval_tracked = calloc(INVAL_BUCKETS, sizeof(InvalPath*));
+    if (!inval_tracked) return -1;
+
+    inval_fn = inval;
+    inval_poll_ms = poll_ms;
+    inval_stopping = false;
+
+    if (pthread_create(&inval_thread, NULL, inval_worker, NULL) != 0) {
+        free(inval_tracked);
+        inval_tracked = NULL;
+        return -1;
+    }
+
+    inval_running = true;
+    return 0;
+}
+
+void inval_stop(void) {
+    if (!inval_running) return;
+
+    pthread_mutex_lock(&inval_lock);
+    inval_stopping = true;
+    pthread_cond_signal(&inval_cond);
+    pthread_mutex_unlock(&inval_lock);
+
+    pthread_join(inval_thread, NULL);
+    inval_running = false;
+
+    inval_free_list(inval_pending);
+    inval_pending = NULL;
+    for (size_t i = 0; i < INVAL_BUCKETS; i++) inval_free_list(inval_tracked[i]);
+    free(inval_tracked);
+    inval_tracked = NULL;
+    inval_n_tracked = 0;
+}
+
+/**
+ * Tracking Paths
+ *
+ * @return whether inval_track remembers paths: callers that have to build
+ *         them can skip it otherwise
+ */
+bool inval_tracking(void) {
+    return inval_running && inval_poll_ms > 0;
+}
+
+// Makes room for one more path (inval_lock held): the oldest one of the
+// first non-empty bucket from b is invalidated right away instead, the
+// kernel then no longer holds anything an external change could outdate
+static void inval_evict(size_t b) {
+    InvalPath **link = NULL;
+    for (size_t i = 0; i < INVAL_BUCKETS && !link; i++) {
+        size_t j = (b + i) % INVAL_BUCKETS;
+        if (inval_tracked[j]) link = &inval_tracked[j];
+    }
+    if (!link) return;
+
+    while ((*link)->next) link = &(*link)->next;
+    InvalPath *e = *link;
+    *link = NULL;
+    inval_n_tracked--;
+
+    e->next = inval_pending;
+    inval_pending = e;
+    pthread_cond_signal(&inval_cond);
+}
+
+/**
+ * Track Path
+ *
+ * @brief Remembers a path whose attributes were handed to the kernel, so
+ *        that an external change can invalidate it. Nothing to do when
+ *        data_version isn't polled. Past INVAL_MAX_TRACKED paths, an
+ *        older one is invalidated to make room (see inval_evict).
+ */
+void inval_track(const char *path) {
+    if (!inval_running || inval_poll_ms == 0) return;
+
+    size_t b = inval_hash(path);
+
+    pthread_mutex_lock(&inval_lock);
+    if (!inval_tracked) {
+        pthread_mutex_unlock(&inval_lock);
+        return;
+    }
+
+    for (InvalPath *e = inval_tracked[b]; e; e = e->next) {
+        if (strcmp(e->path, path) == 0) {
+            pthread_mutex_unlock(&inval_lock);
+            return;
+        }
+    }
+
+    if (inval_n_tracked >= INVAL_MAX_TRACKED) inval_evict(b);
+
+    InvalPath *e = malloc(sizeof(InvalPath));
+    if (e) e->path = strdup(path);
+    if (e && e->path) {
+        e->next = inval_tracked[b];
+        inval_tracked[b] = e;
+        inval_n_tracked++;
+    } else {
+        free(e);
+    }
+    pthread_mutex_unlock(&inval_lock);
+}
+
+/**
+ * Queue Invalidation
+ *
+ * @brief Schedules the invalidation of a path changed through the mount.
+ *        The worker thread handles it right away.
+ */
+void inval_queue(const char *path) {
+    if (!inval_running) return;
+
+    InvalPath *e = malloc(sizeof(InvalPath));
+    if (!e) return;
+    e->path = strdup(path);
+    if (!e->path) { free(e); return; }
+
+    pthread_mutex_lock(&inval_lock);
+    e->next = inval_pending;
+    inval_pending = e;
+    pthread_cond_signal(&inval_cond);
+    pthread_mutex_unlock(&inval_lock);
+}
@@ -0,0 +1,28 @@
+#ifndef INVALIDATION_H
+#define INVALIDATION_H
+
+#include <stdbool.h>
+
+#define FUSE_USE_VERSION 30
+#include <fuse3/fuse.h>
+
+// Most paths remembered for invalidation: beyond that, the older ones are
+// invalidated right away to make room (see inval_track)
+#define INVAL_MAX_TRACKED 65536
+
+/**
+ * Invalidation Callback
+ *
+ * Drops what the kernel caches about a path (attributes and contents):
+ * fuse_invalidate_path or its low-level equivalent. Errors just mean that
+ * nothing was cached.
+ */
+typedef int (*InvalFn)(const char *path);
+
+int  inval_start(InvalFn inval, unsigned int poll_ms);
+void inval_stop(void);
+bool inval_tracking(void);
+void inval_track(const char *path);
+void inval_queue(const char *path);
+
+#endif // INVALIDATION_H
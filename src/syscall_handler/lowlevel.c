@@ -0,0 +1,602 @@
+#include "lowlevel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "inode.h"
+
+/*
+ * Low-level backend
+ *
+ * The kernel addresses nodes by inode: tables, buckets, records, attribute
+ * and export files have their ids encoded in it (see ino_encode), so an
+ * operation on them starts from the decoded tokens, with no path to build
+ * and parse again. Paths through .where or .pk keep a path-keyed inode
+ * (see ino_dynamic_get) and are resolved as the high-level backend would.
+ * The driver's own files (META_DIR) are served by the path callbacks.
+ */
+
+// Session of the mount, for the invalidation notifications
+static struct fuse_session *ll_session = NULL;
+
+// Kernel cache timeouts (see vfs2db_kernel_timeouts)
+static double ll_entry_timeout, ll_attr_timeout, ll_negative_timeout;
+
+// Whether replies can be spliced from a file descriptor
+static bool ll_splice = false;
+
+static inline FileHandle *ll_file_handle(const struct fuse_file_info *fi) {
+    return fi ? (FileHandle*)(uintptr_t)fi->fh : NULL;
+}
+
+static inline bool ll_is_meta(fuse_ino_t ino) {
+    return ino == INO_META_DIR || ino == INO_META_STATS;
+}
+
+/*
+ * Resolves an inode. Encoded inodes are decoded, the others resolved
+ * through their path (filled in path, "" for encoded inodes).
+ * Returns 0 on success, 1 for the driver's own files (path only),
+ * a negative errno on failure.
+ */
+static int ll_node(fuse_ino_t ino, Tokens *toks, char *path, size_t size) {
+    path[0] = '\0';
+    if (ino == INO_ROOT || ino_is_encoded(ino)) return ino_decode(ino, toks);
+
+    int rc = ino_path(ino, path, size);
+    if (rc != 0) return rc;
+    if (ll_is_meta(ino)) return 1;
+    return vfs2db_resolve_path(path, toks);
+}
+
+// Path of an inode resolved by ll_node, built for encoded ones
+static int ll_node_path(fuse_ino_t ino, char *path, size_t size) {
+    if (path[0] != '\0') return 0;
+    return ino_path(ino, path, size);
+}
+
+// The kernel may cache the attributes of ino until attr_timeout
+static void ll_track(fuse_ino_t ino, char *path, size_t size) {
+    if (inval_tracking() && ll_node_path(ino, path, size) == 0) inval_track(path);
+}
+
+/*
+ * Invalidation callback (see InvalFn): the inode of the path, if the
+ * kernel can hold one, loses its cached attributes and pages.
+ */
+static int ll_invalidate(const char *path) {
+    Tokens toks;
+    uint64_t ino = 0;
+    if (vfs2db_resolve_path(path, &toks) != 0 || !ino_encode(&toks, &ino)) {
+        ino = ino_dynamic_find(path);
+    }
+    if (ino == 0) return -ENOENT;
+    return fuse_lowlevel_notify_inval_inode(ll_session, ino, 0, 0);
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn) {
+    (void)userdata;
+    LOG_DEBUG("ll init\n");
+
+    if (vfs2db_setup(ll_invalidate) != 0) {
+        fuse_session_exit(ll_session);
+        return;
+    }
+    vfs2db_kernel_timeouts(&ll_entry_timeout, &ll_attr_timeout, &ll_negative_timeout);
+
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) conn->want |= FUSE_CAP_SPLICE_WRITE;
+    ll_splice = conn->want & FUSE_CAP_SPLICE_WRITE;
+}
+
+static void ll_destroy(void *userdata) {
+    (void)userdata;
+    vfs2db_teardown();
+    ino_cleanup();
+}
+
+// =============================================================
+// Names and attributes
+// =============================================================
+
+/*
+ * lookup below a parent resolved to toks: the child is resolved from its
+ * name alone, its record looked up by key if it is named by key.
+ */
+static int ll_lookup_toks(fuse_ino_t parent, const Tokens *toks, char *path, size_t size,
+                          const char *name, struct fuse_entry_param *e) {
+    Tokens child = *toks;
+    int rc = path_resolve_name(&child, name);
+    if (rc < 0) return rc;
+
+    if (rc == 0 && child.by_pk && child.depth == 2) {
+        rc = lookup_pk(&child);
+        if (rc != 0) return rc > 0 ? -ENOENT : -EIO;
+    }
+
+    rc = vfs2db_getattr_toks(&child, &e->attr);
+    if (rc != 0) return rc;
+
+    // Path of the child: for the dynamic inodes and the tracked attributes
+    bool tracking = inval_tracking();
+    uint64_t ino;
+    bool encoded = ino_encode(&child, &ino);
+    if (!encoded || tracking) {
+        rc = ll_node_path(parent, path, size);
+        size_t len = strlen(path);
+        if (rc == 0 && snprintf(path + len, size - len, "%s%s", len > 1 ? "/" : "", name) >= (int)(size - len)) {
+            rc = -ENAMETOOLONG;
+        }
+        if (rc != 0) return rc;
+    }
+
+    if (!encoded) {
+        ino = ino_dynamic_get(path);
+        if (ino == 0) return -ENOMEM;
+    }
+    if (tracking) inval_track(path);
+
+    e->ino = ino;
+    e->attr.st_ino = ino;
+    e->entry_timeout = ll_entry_timeout;
+    e->attr_timeout = ll_attr_timeout;
+    return 0;
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    LOG_DEBUG("lookup: %llu/%s\n", (unsigned long long)parent, name);
+
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+
+    char path[PATH_MAX];
+    Tokens toks;
+    int res = ll_node(parent, &toks, path, sizeof(path));
+
+    // The driver's own files: /.vfs2db/stats
+    uint64_t meta = 0;
+    if (parent == INO_ROOT && strcmp(name, META_DIR_NAME) == 0) meta = INO_META_DIR;
+    if (res == 1) meta = parent == INO_META_DIR && strcmp(name, META_STATS_NAME) == 0 ? INO_META_STATS : 0;
+
+    if (meta) {
+        res = ino_path(meta, path, sizeof(path));
+        if (res == 0) res = vfs2db_getattr(path, &e.attr, NULL);
+        e.ino = meta;
+        e.attr.st_ino = meta;
+        e.entry_timeout = ll_entry_timeout;
+        e.attr_timeout = ll_attr_timeout;
+    } else if (res == 1) {
+        res = parent == INO_META_DIR ? -ENOENT : -ENOTDIR;
+    } else if (res == 0) {
+        uint64_t start = stats_now();
+        res = ll_lookup_toks(parent, &toks, path, sizeof(path), name, &e);
+        stats_record(STATS_GETATTR, start, res);
+    }
+
+    // Missing names are cached as an entry with no inode
+    if (res == -ENOENT && ll_negative_timeout > 0) {
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = ll_negative_timeout;
+        res = 0;
+    }
+
+    if (res != 0) fuse_reply_err(req, -res);
+    else fuse_reply_entry(req, &e);
+    arena_reset();
+}
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    ino_forget(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+static void ll_reply_attr(fuse_req_t req, fuse_ino_t ino, struct stat *st, int res) {
+    if (res != 0) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    st->st_ino = ino;
+    fuse_reply_attr(req, st, ll_attr_timeout);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    LOG_DEBUG("getattr: %llu\n", (unsigned long long)ino);
+
+    struct stat st;
+    char path[PATH_MAX];
+    Tokens toks;
+    int res = ll_node(ino, &toks, path, sizeof(path));
+
+    if (res == 1) {
+        res = vfs2db_getattr(path, &st, fi);
+    } else if (res == 0) {
+        uint64_t start = stats_now();
+        res = vfs2db_getattr_toks(&toks, &st);
+        if (res == 0) ll_track(ino, path, sizeof(path));
+        stats_record(STATS_GETATTR, start, res);
+    }
+    ll_reply_attr(req, ino, &st, res);
+    arena_reset();
+}
+
+/*
+ * Only the size can be set: modes and owners are the mount's, times are
+ * always the current one (see fill_file_stat) and are left alone.
+ */
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+                       struct fuse_file_info *fi) {
+    LOG_DEBUG("setattr: %llu\n", (unsigned long long)ino);
+
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+
+    struct stat st;
+    char path[PATH_MAX];
+    Tokens toks;
+    int res = ll_node(ino, &toks, path, sizeof(path));
+    if (res == 1) res = -EACCES;
+
+    if (res == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+        res = vfs2db_truncate_toks(&toks, path[0] ? path : NULL, attr->st_size, ll_file_handle(fi));
+    }
+    if (res == 0) res = vfs2db_getattr_toks(&toks, &st);
+    ll_reply_attr(req, ino, &st, res);
+    arena_reset();
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+    LOG_DEBUG("readlink: %llu\n", (unsigned long long)ino);
+
+    uint64_t start = stats_now();
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    Tokens toks;
+    int res = ll_node(ino, &toks, path, sizeof(path));
+    if (res == 1) res = -EINVAL;
+    if (res == 0) res = vfs2db_readlink_toks(&toks, target, sizeof(target));
+    stats_record(STATS_READLINK, start, res);
+
+    if (res != 0) fuse_reply_err(req, -res);
+    else fuse_reply_readlink(req, target);
+    arena_reset();
+}
+
+static void ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size) {
+    char path[PATH_MAX];
+    Tokens toks;
+    int res = ll_node(ino, &toks, path, sizeof(path));
+    if (res != 0) {
+        fuse_reply_err(req, ENODATA);
+        return;
+    }
+
+    char *value = size > 0 ? arena_alloc(size) : NULL;
+    if (size > 0 && !value) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    res = vfs2db_getxattr_toks(&toks, name, value, size);
+    if (res < 0) fuse_reply_err(req, -res);
+    else if (size == 0) fuse_reply_xattr(req, res);
+    else fuse_reply_buf(req, value, res);
+    arena_reset();
+}
+
+// =============================================================
+// Directories
+// =============================================================
+
+/**
+ * Directory Buffer
+ *
+ * The fuse_fill_dir_t buffer of a low-level readdir: vfs2db_readdir_toks
+ * fills it through ll_fill as it would fill a high-level one.
+ *
+ * req:  request being answered
+ * ino:  inode of the directory
+ * dir:  the directory (NULL for META_DIR)
+ * plus: whether entries come with their attributes (readdirplus)
+ * buf:  reply buffer, of size bytes, used of which are filled
+ */
+typedef struct LlDirBuf {
+    fuse_req_t    req;
+    fuse_ino_t    ino;
+    const Tokens *dir;
+    bool          plus;
+    char         *buf;
+    size_t        size;
+    size_t        used;
+} LlDirBuf;
+
+/*
+ * Inode and file type of an entry. Entries that would need a dynamic
+ * inode get none (0): the kernel looks them up if they are accessed.
+ */
+static uint64_t ll_child_ino(const LlDirBuf *d, const char *name, mode_t *type) {
+    *type = S_IFDIR;
+    if (strcmp(name, ".") == 0) return d->ino;
+    if (strcmp(name, "..") == 0) return 0;
+    if (!d->dir) {
+        *type = S_IFREG;
+        return INO_META_STATS;
+    }
+    if (d->dir->depth == 0 && strcmp(name, META_DIR_NAME) == 0) return INO_META_DIR;
+
+    Tokens child = *d->dir;
+    int rc = path_resolve_name(&child, name);
+    if (rc < 0) {
+        *type = 0;
+        return 0;
+    }
+
+    if (child.export != EXPORT_NONE) *type = S_IFREG;
+    else if (child.depth == 3) *type = catalog_table(child.table_id)->cols[child.col_id].fk ? S_IFLNK : S_IFREG;
+
+    // A record named by key has no rowid until it is looked up
+    uint64_t ino;
+    if (child.by_pk && child.depth == 2 && rc == 0) return 0;
+    return ino_encode(&child, &ino) ? ino : 0;
+}
+
+static int ll_fill(void *buffer, const char *name, const struct stat *st, off_t off,
+                   enum fuse_fill_dir_flags flags) {
+    (void)flags;
+    LlDirBuf *d = buffer;
+
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+
+    mode_t type;
+    uint64_t ino = ll_child_ino(d, name, &type);
+    if (st) e.attr = *st;
+    else e.attr.st_mode = type;
+    e.attr.st_ino = ino;
+
+    size_t left = d->size - d->used;
+    size_t len;
+    if (d->plus) {
+        // Entries with an inode and attributes spare the kernel a lookup
+        // ("." and ".." never do)
+        if (st && ino && ino != d->ino) {
+            e.ino = ino;
+            e.entry_timeout = ll_entry_timeout;
+            e.attr_timeout = ll_attr_timeout;
+        }
+        len = fuse_add_direntry_plus(d->req, d->buf + d->used, left, name, &e, off);
+    } else {
+        len = fuse_add_direntry(d->req, d->buf + d->used, left, name, &e.attr, off);
+    }
+
+    if (len > left) return 1;
+    d->used += len;
+    return 0;
+}
+
+static void ll_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, bool plus) {
+    LOG_DEBUG("readdir: %llu (offset %lld)\n", (unsigned long long)ino, (long long)offset);
+
+    uint64_t start = stats_now();
+    char path[PATH_MAX];
+    Tokens toks;
+    int res = ll_node(ino, &toks, path, sizeof(path));
+    if (res == 1 && ino != INO_META_DIR) res = -ENOTDIR;
+
+    LlDirBuf d = {
+        .req = req,
+        .ino = ino,
+        .dir = res == 0 ? &toks : NULL,
+        .plus = plus,
+        .buf = arena_alloc(size),
+        .size = size,
+        .used = 0,
+    };
+    if (res >= 0 && !d.buf) res = -ENOMEM;
+
+    if (res >= 0) {
+        // The attributes listed by readdirplus are tracked as with getattr
+        const char *dir_path = plus && inval_tracking() && ll_node_path(ino, path, sizeof(path)) == 0 ? path : NULL;
+        res = vfs2db_readdir_toks(d.dir, dir_path, &d, ll_fill, offset, plus);
+    }
+    stats_record(STATS_READDIR, start, res);
+
+    if (res != 0) fuse_reply_err(req, -res);
+    else fuse_reply_buf(req, d.buf, d.used);
+    arena_reset();
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                       struct fuse_file_info *fi) {
+    (void)fi;
+    ll_do_readdir(req, ino, size, offset, false);
+}
+
+static void ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                           struct fuse_file_info *fi) {
+    (void)fi;
+    ll_do_readdir(req, ino, size, offset, true);
+}
+
+// =============================================================
+// Files
+// =============================================================
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    LOG_DEBUG("open: %llu\n", (unsigned long long)ino);
+
+    char path[PATH_MAX];
+    Tokens toks;
+    int res = ll_node(ino, &toks, path, sizeof(path));
+    if (res == 1) res = vfs2db_open(path, fi);
+    else if (res == 0) res = vfs2db_open_toks(&toks, fi);
+
+    // kernel_cache, as the high-level backend applies it
+    if (res == 0 && mount_opts.kernel_cache && !fi->direct_io) fi->keep_cache = 1;
+
+    if (res != 0) fuse_reply_err(req, -res);
+    else if (fuse_reply_open(req, fi) == -ENOENT) vfs2db_release(NULL, fi);
+    arena_reset();
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                    struct fuse_file_info *fi) {
+    LOG_DEBUG("read: %llu\n", (unsigned long long)ino);
+
+    uint64_t start = stats_now();
+
+    // Read-only values are replied as they are: spliced from their memfd
+    // or written from the handle's memory, never copied here
+    const char *mem;
+    int fd;
+    int len = fh_slice(ll_file_handle(fi), size, offset, &mem, &fd);
+    if (len >= 0) {
+        struct fuse_bufvec buf = FUSE_BUFVEC_INIT(len);
+        if (fd >= 0 && ll_splice) {
+            buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            buf.buf[0].fd = fd;
+            buf.buf[0].pos = offset;
+        } else {
+            buf.buf[0].mem = (void*)mem;
+        }
+        stats_record(STATS_READ, start, len);
+        fuse_reply_data(req, &buf, 0);
+        return;
+    }
+
+    char *buffer = arena_alloc(size);
+    int res = buffer ? fh_read(ll_file_handle(fi), buffer, size, offset) : -ENOMEM;
+
+    // Handles that don't hold the value read it from the database
+    if (res < 0 && buffer) {
+        char path[PATH_MAX];
+        Tokens toks;
+        res = ll_node(ino, &toks, path, sizeof(path));
+        if (res == 1) res = -EBADF;
+        if (res == 0) res = vfs2db_read_toks(&toks, buffer, size, offset);
+    }
+    stats_record(STATS_READ, start, res);
+
+    if (res < 0) fuse_reply_err(req, -res);
+    else fuse_reply_buf(req, buffer, res);
+    arena_reset();
+}
+
+// Every open file has its handle: writes are buffered by it
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buffer, size_t size,
+                     off_t offset, struct fuse_file_info *fi) {
+    LOG_DEBUG("write: %llu\n", (unsigned long long)ino);
+    LOG_DEBUG("\tsize: %zu\n", size);
+    LOG_DEBUG("\toffset: %ld\n", (long)offset);
+
+    uint64_t start = stats_now();
+    FileHandle *fh = ll_file_handle(fi);
+    int res;
+    if (mount_opts.read_only) res = -EROFS;
+    else if (!fh) res = -EBADF;
+    else res = fh_write(fh, buffer, size, offset) >= 0 ? (int)size : -EIO;
+    stats_record(STATS_WRITE, start, res);
+
+    if (res < 0) fuse_reply_err(req, -res);
+    else fuse_reply_write(req, res);
+}
+
+static void ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+                         struct fuse_file_info *fi) {
+    (void)ino;
+    fuse_reply_err(req, -vfs2db_fallocate(NULL, mode, offset, length, fi));
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void)ino;
+    fuse_reply_err(req, -vfs2db_flush(NULL, fi));
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    (void)ino;
+    fuse_reply_err(req, -vfs2db_fsync(NULL, datasync, fi));
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void)ino;
+    fuse_reply_err(req, -vfs2db_release(NULL, fi));
+}
+
+const struct fuse_lowlevel_ops vfs2db_ll_oper = {
+    .init        = ll_init,
+    .destroy     = ll_destroy,
+    .lookup      = ll_lookup,
+    .forget      = ll_forget,
+    .getattr     = ll_getattr,
+    .setattr     = ll_setattr,
+    .readlink    = ll_readlink,
+    .open        = ll_open,
+    .read        = ll_read,
+    .write       = ll_write,
+    .fallocate   = ll_fallocate,
+    .flush       = ll_flush,
+    .release     = ll_release,
+    .fsync       = ll_fsync,
+    .readdir     = ll_readdir,
+    .readdirplus = ll_readdirplus,
+    .getxattr    = ll_getxattr,
+};
+
+/**
+ * Low-Level Main
+ *
+ * @brief fuse_main for the low-level backend: parses the FUSE command
+ *        line, mounts, daemonizes and serves the requests until unmounted.
+ *
+ * @param args Command line, without the driver's own options
+ *
+ * @return 0 on success, 1 on failure
+ */
+int vfs2db_ll_main(struct fuse_args *args) {
+    struct fuse_cmdline_opts opts;
+    if (fuse_parse_cmdline(args, &opts) != 0) return 1;
+
+    if (opts.show_help) {
+        printf("usage: %s [options] <mountpoint>\n\n", args->argv[0]);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        free(opts.mountpoint);
+        return 0;
+    }
+    if (opts.show_version) {
+        printf("FUSE library version %s\n", fuse_pkgversion());
+        fuse_lowlevel_version();
+        free(opts.mountpoint);
+        return 0;
+    }
+    if (!opts.mountpoint) {
+        fprintf(stderr, "usage: %s [options] <mountpoint>\n", args->argv[0]);
+        return 1;
+    }
+
+    int res = 1;
+    struct fuse_session *se = fuse_session_new(args, &vfs2db_ll_oper, sizeof(vfs2db_ll_oper), NULL);
+    if (!se) goto out;
+    ll_session = se;
+
+    if (fuse_set_signal_handlers(se) != 0) goto out_destroy;
+    if (fuse_session_mount(se, opts.mountpoint) != 0) goto out_signals;
+
+    // Connections are opened by ll_init, after the fork
+    fuse_daemonize(opts.foreground);
+
+    res = opts.singlethread ? fuse_session_loop(se) : fuse_session_loop_mt(se, opts.clone_fd);
+    res = res != 0;
+
+    fuse_session_unmount(se);
+out_signals:
+    fuse_remove_signal_handlers(se);
+out_destroy:
+    fuse_session_destroy(se);
+    ll_session = NULL;
+out:
+    free(opts.mountpoint);
+    return res;
+}
@@ -0,0 +1,12 @@
+#ifndef LOWLEVEL_H
+#define LOWLEVEL_H
+
+#include "syscall_handler.h"
+
+#include <fuse3/fuse_lowlevel.h>
+
+extern const struct fuse_lowlevel_ops vfs2db_ll_oper;
+
+int vfs2db_ll_main(struct fuse_args *args);
+
+#endif // LOWLEVEL_H
@@ -0,0 +1,401 @@
+#include "path.h"
+
+/*
+ * Rowids as readdir lists them ("%lld"): other spellings of the same
+ * number ("007", "+7", "-0") are rejected, so a record has a single name.
+ */
+static int path_parse_rowid(const char *s, size_t len, int64_t *rowid) {
+    bool neg = len > 0 && s[0] == '-';
+    size_t i = neg ? 1 : 0;
+
+    if (i == len || len - i > 19) return -1;
+    if (s[i] == '0' && (len - i > 1 || neg)) return -1;
+
+    uint64_t v = 0;
+    for (; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9') return -1;
+        v = v * 10 + (uint64_t)(s[i] - '0');
+    }
+
+    // 19 digits can't overflow v, but can exceed the int64 range
+    if (v > (uint64_t)INT64_MAX + (neg ? 1 : 0)) return -1;
+
+    if (!neg) *rowid = (int64_t)v;
+    else *rowid = v > (uint64_t)INT64_MAX ? INT64_MIN : -(int64_t)v;
+    return 0;
+}
+
+static inline bool path_component_is(const char *s, size_t len, const char *name) {
+    return strlen(name) == len && memcmp(s, name, len) == 0;
+}
+
+// Export files of a table: the fixed names or "<rowid>.json"
+static int path_parse_export(const char *s, size_t len, Tokens *toks) {
+    const size_t ext_len = strlen(EXPORT_ROW_EXT);
+
+    if (path_component_is(s, len, EXPORT_CSV_NAME)) {
+        toks->export = EXPORT_CSV;
+    } else if (path_component_is(s, len, EXPORT_JSONL_NAME)) {
+        toks->export = EXPORT_JSONL;
+    } else if (len > ext_len && memcmp(s + len - ext_len, EXPORT_ROW_EXT, ext_len) == 0
+            && path_parse_rowid(s, len - ext_len, &toks->rowid) == 0) {
+        toks->export = EXPORT_ROW_JSON;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static inline int path_hex(char ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Percent-decoding ("%2F" for '/'): values can hold any byte but NUL.
+ * out must hold len bytes plus the terminator.
+ */
+static int path_decode(const char *s, size_t len, char *out, size_t *out_len) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] != '%') { out[n++] = s[i]; continue; }
+
+        int hi = i + 2 < len ? path_hex(s[i + 1]) : -1;
+        int lo = i + 2 < len ? path_hex(s[i + 2]) : -1;
+        if (hi < 0 || lo < 0 || (hi | lo) == 0) return -1;
+        out[n++] = (char)(hi << 4 | lo);
+        i += 2;
+    }
+
+    out[n] = '\0';
+    *out_len = n;
+    return 0;
+}
+
+// Filter of a query directory: "<column>=<value>"
+static int path_parse_filter(const char *s, size_t len, const Schema *schema, Tokens *toks) {
+    const char *eq = memchr(s, '=', len);
+    if (!eq || len > NAME_MAX) return -1;
+
+    toks->where_col = ni_get_n(&schema->col_index, s, eq - s);
+    if (toks->where_col < 0) return -1;
+
+    return path_decode(eq + 1, len - (eq + 1 - s), toks->value, &toks->value_len);
+}
+
+/*
+ * Key of a record: its n_pk parts, percent-decoded, separated by PK_SEP.
+ * Each part is stored in value followed by a NUL: with len <= NAME_MAX
+ * they always fit, since decoding never makes a part longer.
+ */
+static int path_parse_key(const char *s, size_t len, const Schema *schema, Tokens *toks) {
+    if (len == 0 || len > NAME_MAX) return -1;
+
+    const char *end = s + len;
+    size_t n = 0;
+    toks->n_key = 0;
+
+    for (;;) {
+        const char *sep = memchr(s, PK_SEP, end - s);
+        const char *part_end = sep ? sep : end;
+
+        size_t part_len;
+        if (toks->n_key == schema->n_pk
+         || path_decode(s, part_end - s, toks->value + n, &part_len) != 0) return -1;
+        n += part_len + 1;
+        toks->n_key++;
+
+        if (!sep) break;
+        s = sep + 1;
+    }
+
+    toks->value_len = n;
+    return toks->n_key == schema->n_pk ? 0 : -1;
+}
+
+/**
+ * Encode Key
+ *
+ * @brief Name of a record in the .pk directory, the inverse of its
+ *        parsing by path_resolve: the parts are percent-encoded and
+ *        joined by PK_SEP. Bytes that can't appear in a name or would
+ *        change its meaning are encoded ('/', '%', PK_SEP, control
+ *        characters and a leading '.'), others are kept as they are.
+ *
+ * @param key   Key parts, each one followed by a NUL (see Tokens.value)
+ * @param n_key Number of parts
+ * @param name  Filled with the name
+ * @param size  Size of name
+ *
+ * @return length of the name, -1 if it is empty or doesn't fit
+ */
+int path_encode_key(const char *key, int n_key, char *name, size_t size) {
+    static const char hex[] = "0123456789ABCDEF";
+    size_t n = 0;
+
+    for (int i = 0; i < n_key; i++) {
+        if (i > 0) {
+            if (n + 1 >= size) return -1;
+            name[n++] = PK_SEP;
+        }
+
+        for (; *key; key++) {
+            unsigned char ch = (unsigned char)*key;
+            bool encode = ch < 0x20 || ch == 0x7f || ch == '/' || ch == '%' || ch == PK_SEP
+                       || (ch == '.' && n == 0);
+
+            if (n + (encode ? 3 : 1) >= size) return -1;
+            if (!encode) { name[n++] = (char)ch; continue; }
+            name[n++] = '%';
+            name[n++] = hex[ch >> 4];
+            name[n++] = hex[ch & 0xf];
+        }
+        key++;
+    }
+
+    if (n == 0) return -1;
+    name[n] = '\0';
+    return (int)n;
+}
+
+// =============================================================
+// Bucket Directories
+// =============================================================
+
+// Number of 'x' in the bucket names: log10 of the fanout
+static int path_bucket_digits(void) {
+    int digits = 0;
+    for (unsigned int f = mount_opts.bucket_fanout; f > 1; f /= 10) digits++;
+    return digits;
+}
+
+/**
+ * Bucket of a Rowid
+ *
+ * @brief Rowids are grouped by bucket_fanout: bucket b holds the rowids
+ *        from b * bucket_fanout to (b + 1) * bucket_fanout - 1, negative
+ *        ones included (floor division). Only with bucket_fanout set.
+ */
+int64_t path_bucket_of(int64_t rowid) {
+    const int64_t fanout = mount_opts.bucket_fanout;
+    return rowid >= 0 ? rowid / fanout : -((-(rowid + 1)) / fanout) - 1;
+}
+
+/**
+ * Rowids of a Bucket
+ *
+ * @brief First and last rowid of the bucket, clamped to the int64 range
+ *        for the first and last buckets.
+ */
+void path_bucket_range(int64_t bucket, int64_t *first, int64_t *last) {
+    const int64_t fanout = mount_opts.bucket_fanout;
+
+    if (bucket < INT64_MIN / fanout) {
+        *first = INT64_MIN;
+        *last = (bucket + 1) * fanout - 1;
+        return;
+    }
+    *first = bucket * fanout;
+    *last = bucket > (INT64_MAX - fanout + 1) / fanout ? INT64_MAX : *first + fanout - 1;
+}
+
+/**
+ * Bucket Name
+ *
+ * @brief Name of a bucket directory: its number padded with zeros, then
+ *        an 'x' for each digit of the rowids it holds, BUCKET_NAME_DIGITS
+ *        characters at least (e.g. "000123xxx" for 123000..123999 with a
+ *        fanout of 1000). Records keep their own names inside it.
+ *
+ * @param bucket Number of the bucket (see path_bucket_of)
+ * @param name   Filled with the name
+ * @param size   Size of name
+ *
+ * @return length of the name, -1 if it doesn't fit
+ */
+int path_bucket_name(int64_t bucket, char *name, size_t size) {
+    int digits = path_bucket_digits();
+    int width = digits < BUCKET_NAME_DIGITS ? BUCKET_NAME_DIGITS - digits : 1;
+
+    int n = snprintf(name, size, "%0*lld%.*s", width, (long long)bucket, digits, "xxxxxxxxxx");
+    return n > 0 && (size_t)n < size ? n : -1;
+}
+
+/*
+ * Inverse of path_bucket_name: only the name it gives is accepted, so a
+ * bucket has a single name, and only for buckets that can hold a rowid.
+ */
+static int path_parse_bucket(const char *s, size_t len, int64_t *bucket) {
+    int digits = path_bucket_digits();
+    if (len <= (size_t)digits || len >= 32) return -1;
+    for (size_t i = len - digits; i < len; i++) {
+        if (s[i] != 'x') return -1;
+    }
+
+    char number[32];
+    memcpy(number, s, len - digits);
+    number[len - digits] = '\0';
+
+    char *end;
+    errno = 0;
+    long long b = strtoll(number, &end, 10);
+    if (errno || *end != '\0' || b < path_bucket_of(INT64_MIN) || b > path_bucket_of(INT64_MAX)) return -1;
+
+    char name[32];
+    if (path_bucket_name(b, name, sizeof(name)) != (int)len || memcmp(name, s, len) != 0) return -1;
+
+    *bucket = b;
+    return 0;
+}
+
+/*
+ * Resolves one more component (len bytes at s) below toks, in place.
+ * Returns 1 if it stands for the same directory (.where, its filter,
+ * .pk, a bucket), 0 if it adds a level, -ENOENT if it doesn't exist.
+ */
+static int path_step(Tokens *toks, const char *s, size_t len) {
+    const size_t ext_len = strlen(ATTR_EXT);
+    const Schema *schema = toks->depth > 0 ? catalog_table(toks->table_id) : NULL;
+
+    switch (toks->depth) {
+        case 0:
+            catalog_check();
+            toks->table_id = catalog_table_id(s, len);
+            if (toks->table_id < 0) return -ENOENT;
+            toks->table = catalog_table(toks->table_id)->name;
+            break;
+        case 1:
+            if (toks->by_pk) {
+                if (path_parse_key(s, len, schema, toks) != 0) return -ENOENT;
+                break;
+            }
+            if (!toks->where && !toks->in_bucket && schema->n_pk > 0 && path_component_is(s, len, PK_DIR_NAME)) {
+                toks->by_pk = true;
+                return 1;
+            }
+            if (schema->without_rowid) return -ENOENT;
+
+            // .where, then its filter: both stand for the table
+            if (toks->where && toks->where_col < 0) {
+                if (path_parse_filter(s, len, schema, toks) != 0) return -ENOENT;
+                return 1;
+            }
+            if (toks->in_bucket) {
+                if (path_parse_rowid(s, len, &toks->rowid) != 0
+                 || path_bucket_of(toks->rowid) != toks->bucket) return -ENOENT;
+                break;
+            }
+            if (!toks->where && path_component_is(s, len, WHERE_DIR_NAME)) {
+                toks->where = true;
+                return 1;
+            }
+            if (!toks->where && mount_opts.bucket_fanout > 0
+             && path_parse_bucket(s, len, &toks->bucket) == 0) {
+                toks->in_bucket = true;
+                return 1;
+            }
+
+            // Exports cover the whole table, not a query directory
+            if (!toks->where && path_parse_export(s, len, toks) == 0) break;
+            if (path_parse_rowid(s, len, &toks->rowid) != 0) return -ENOENT;
+            break;
+        case 2:
+            if (toks->export != EXPORT_NONE) return -ENOENT;
+            if (len <= ext_len || memcmp(s + len - ext_len, ATTR_EXT, ext_len) != 0) return -ENOENT;
+            toks->col_id = ni_get_n(&schema->col_index, s, len - ext_len);
+            if (toks->col_id < 0) return -ENOENT;
+            toks->attribute = schema->cols[toks->col_id].name;
+            break;
+        default:
+            // Attribute and export files have no children
+            return -ENOENT;
+    }
+
+    toks->depth++;
+    return 0;
+}
+
+/**
+ * Root Tokens
+ *
+ * @brief Fills toks with the root of the mount (depth 0).
+ */
+void path_root(Tokens *toks) {
+    toks->depth = 0;
+    toks->table_id = -1;
+    toks->col_id = -1;
+    toks->rowid = 0;
+    toks->table = NULL;
+    toks->attribute = NULL;
+    toks->export = EXPORT_NONE;
+    toks->where = false;
+    toks->where_col = -1;
+    toks->value_len = 0;
+    toks->value[0] = '\0';
+    toks->by_pk = false;
+    toks->n_key = 0;
+    toks->in_bucket = false;
+    toks->bucket = 0;
+}
+
+/**
+ * Resolve Path
+ *
+ * @brief Resolves /table/record/attribute.vfs2db against the catalog,
+ *        in place: components are looked up as slices of the path, with no
+ *        copy and no heap allocation. Unknown tables and columns, records
+ *        that aren't rowids and attribute files without the extension are
+ *        rejected here, before any SQL runs.
+ *        Export files resolve at depth 2, with export set.
+ *        /table/.where/<column>=<value> resolves like /table (depth 1),
+ *        with the filter set; records and attributes below it follow.
+ *        So does /table/.pk, with by_pk set: its records are named by key
+ *        and their rowid is left to the caller (see lookup_pk).
+ *        With bucket_fanout set, so does a bucket directory, with
+ *        in_bucket set: only the records of its range are found below it.
+ *        Records keep resolving directly below the table as well.
+ *        Tables WITHOUT ROWID only have their .pk records.
+ *        The META_DIR paths are not handled (see is_meta_path).
+ *
+ * @param path Path as given to the FUSE callbacks (trailing '/' allowed)
+ * @param toks Filled with the resolved path
+ *
+ * @return 0 on success, -ENOENT if the path doesn't exist
+ */
+int path_resolve(const char *path, Tokens *toks) {
+    path_root(toks);
+
+    const char *p = path;
+    while (*p == '/') p++;
+
+    while (*p) {
+        size_t len = strcspn(p, "/");
+        if (path_step(toks, p, len) < 0) return -ENOENT;
+
+        p += len;
+        while (*p == '/') p++;
+    }
+
+    return 0;
+}
+
+/**
+ * Resolve Name
+ *
+ * @brief Resolves a single component below an already resolved path, as
+ *        path_resolve would (the lookup of the low-level API).
+ *
+ * @param toks Resolved parent, updated in place
+ * @param name Name of the child, without '/'
+ *
+ * @return 0 if it adds a level (depth + 1), 1 if it stands for the same
+ *         directory (.where and its filter, .pk, a bucket), -ENOENT if it
+ *         doesn't exist
+ */
+int path_resolve_name(Tokens *toks, const char *name) {
+    size_t len = strlen(name);
+    if (len == 0 || memchr(name, '/', len)) return -ENOENT;
+    return path_step(toks, name, len);
+}
@@ -0,0 +1,15 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include "../db_handler/db_handler.h"
+
+void path_root(Tokens *toks);
+int  path_resolve(const char *path, Tokens *toks);
+int  path_resolve_name(Tokens *toks, const char *name);
+int path_encode_key(const char *key, int n_key, char *name, size_t size);
+
+int64_t path_bucket_of(int64_t rowid);
+void    path_bucket_range(int64_t bucket, int64_t *first, int64_t *last);
+int     path_bucket_name(int64_t bucket, char *name, size_t size);
+
+#endif // PATH_H
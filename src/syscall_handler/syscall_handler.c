@@ -1,172 +1,474 @@
 #include "syscall_handler.h"
 
-extern sqlite3 *db;
+static inline FileHandle *get_file_handle(const struct fuse_file_info *fi) {
+    return fi ? (FileHandle*)(uintptr_t)fi->fh : NULL;
+}
 
-static inline struct tokens* tokenize_path(const char* path) {
-    // path := /table/record/attribute
-    // path := table/record/attribute
-    if (!path) return NULL;
+/**
+ * Resolve Path
+ *
+ * @brief path_resolve, then the records named by primary key are looked up
+ *        through its index: by rowid afterwards, like any other record.
+ *
+ * @return 0 on success, -ENOENT if the path doesn't exist, -EIO on failure
+ */
+int vfs2db_resolve_path(const char *path, Tokens *toks) {
+    int rc = path_resolve(path, toks);
+    if (rc != 0 || !toks->by_pk || toks->depth < 2) return rc;
+
+    rc = lookup_pk(toks);
+    if (rc != 0) return rc > 0 ? -ENOENT : -EIO;
+    return 0;
+}
 
-    struct tokens *toks = malloc(sizeof(struct tokens));
+/**
+ * Open File Handle
+ *
+ * @brief Resolves an attribute file path and creates its handle.
+ *
+ * @param err Filled with the error to return to FUSE on failure
+ *
+ * @return the new handle, NULL on failure
+ */
+static FileHandle *open_file_handle(const char *path, int flags, int *err) {
+    Tokens toks;
+    *err = vfs2db_resolve_path(path, &toks);
+    if (*err != 0) return NULL;
+    if (toks.export != EXPORT_NONE) { *err = -EACCES; return NULL; }
+    if (toks.depth < 3) { *err = -EISDIR; return NULL; }
+
+    FileHandle *fh = fh_create(&toks, flags);
+    if (!fh) *err = -ENOENT;
+    return fh;
+}
 
-    char* path_copy = strdup(path); 
-    if (!path_copy) return NULL;
+/*
+ * Writes the pending changes of a handle back. Changed files are queued
+ * for invalidation: the kernel may have cached their old attributes.
+ * path may be NULL (low-level backend).
+ */
+static int flush_file_handle(const char *path, FileHandle *fh) {
+    int rc = fh_flush(fh);
+    if (rc < 0) return -EIO;
+
+    if (rc > 0 && path) inval_queue(path);
+    if (rc <= 0 || catalog_table(fh->toks.table_id)->without_rowid) return 0;
+
+    // Changed through a query, key or bucket directory (or with no path at
+    // all, by inode): the record's own path too
+    bool flat = !fh->toks.where && !fh->toks.by_pk && !fh->toks.in_bucket;
+    if (!flat || !path) {
+        char canonical[PATH_MAX];
+        snprintf(canonical, sizeof(canonical), "/%s/%lld/%s" ATTR_EXT,
+                 fh->toks.table, (long long)fh->toks.rowid, fh->toks.attribute);
+        inval_queue(canonical);
+    }
 
-    char *cursor = path_copy;
-    if (cursor[0] == '/') cursor++;
+    // And the path it is listed under, in its bucket
+    char bucket[32];
+    if (mount_opts.bucket_fanout > 0 && !fh->toks.in_bucket
+     && path_bucket_name(path_bucket_of(fh->toks.rowid), bucket, sizeof(bucket)) > 0) {
+        char listed[PATH_MAX];
+        snprintf(listed, sizeof(listed), "/%s/%s/%lld/%s" ATTR_EXT,
+                 fh->toks.table, bucket, (long long)fh->toks.rowid, fh->toks.attribute);
+        inval_queue(listed);
+    }
+    return 0;
+}
 
-    char* t = strtok(cursor, "/");
-    toks->table = t ? strdup(t) : NULL;
-    t = strtok(NULL, "/");
-    toks->record = t ? strdup(t) : NULL;
-    t = strtok(NULL, "/");
-    toks->attribute = t ? strdup(t) : NULL;
+static inline int check_symlink(const Tokens *toks) {
+    LOG_DEBUG("check_symlink\n");
+    LOG_DEBUG("\tattribute: %s\n", toks->attribute);
 
-    free(path_copy);
+    // Foreign keys are symlinks to the referenced record's attribute
+    if (catalog_table(toks->table_id)->cols[toks->col_id].fk) {
+        LOG_DEBUG("\tfk found: %s\n", toks->attribute);
+        return 1;
+    }
+    return 0;
+}
 
-    return toks;
+static inline void fill_dir_stat(struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFDIR | 0755;
+    st->st_nlink = 2;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_atime = st->st_mtime = time(NULL);
 }
 
-static inline char *remove_extension(const char *path) {
-    int noext_path_length = strlen(path) - 7;
-    if (noext_path_length <= 0) return NULL;
+// st_size is left to the caller
+static inline void fill_file_stat(struct stat *st, int is_symlink) {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = (is_symlink ? S_IFLNK : S_IFREG) | (mount_opts.read_only ? 0444 : 0644);
+    st->st_nlink = 1;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_atime = st->st_mtime = time(NULL);
+}
 
-    char *noext_path = malloc(noext_path_length + 1);
-    strncpy(noext_path, path, noext_path_length);
-    noext_path[noext_path_length] = 0;
+// =============================================================
+// Virtual files (META_DIR)
+// =============================================================
 
-    return noext_path;
+static inline bool is_meta_path(const char *path) {
+    size_t len = strlen(META_DIR);
+    return strncmp(path, META_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
 }
 
-static inline int check_symlink(struct tokens* toks) {
-    printf("check_symlink\n");
-    sqlite3_stmt *pstmt;
-    get_table_fks  (&pstmt, toks->table);
+/*
+ * Renders the stats file: per-operation counters and latency histograms,
+ * then the statement cache, row cache and SQLite page cache counters.
+ */
+static int render_stats(char **bytes, size_t *size) {
+    FILE *out = open_memstream(bytes, size);
+    if (!out) return -1;
+
+    stats_print(out);
+
+    QmStats qm;
+    qm_get_stats(&qm);
+    fprintf(out, "\nstatement cache: %llu hits, %llu misses, %zu statements\n",
+            (unsigned long long)qm.hits, (unsigned long long)qm.misses, qm.entries);
+
+    RowCacheStats rows;
+    row_cache_get_stats(&rows);
+    fprintf(out, "row cache: %llu hits, %llu misses, %llu evictions, %zu rows, %zu/%zu bytes\n",
+            (unsigned long long)rows.hits, (unsigned long long)rows.misses,
+            (unsigned long long)rows.evictions, rows.rows, rows.bytes, rows.max_bytes);
+
+    GroupCommitStats group;
+    group_commit_get_stats(&group);
+    if (group_commit_enabled()) {
+        fprintf(out, "group commit: %llu commits, %llu writes, %llu failures\n",
+                (unsigned long long)group.commits, (unsigned long long)group.writes,
+                (unsigned long long)group.failures);
+    }
+
+    DbPoolStatus db;
+    db_pool_status(&db);
+    fprintf(out, "sqlite: %d connections, page cache %lld bytes (%lld hits, %lld misses, %lld writes), "
+                 "statements %lld bytes\n",
+            db.connections, (long long)db.cache_used, (long long)db.cache_hit,
+            (long long)db.cache_miss, (long long)db.cache_write, (long long)db.stmt_used);
 
-    printf("\tattribute: %s\n", toks->attribute);
-    int rc;
-    while ((rc = sqlite3_step(pstmt)) == SQLITE_ROW) {
-        const char *attr_name = (const char*)sqlite3_column_text(pstmt, 3);
-        printf("\tfk: %s\n", attr_name);
-        if (toks->attribute && strncmp(attr_name, toks->attribute, strlen(toks->attribute)) == 0) {
-            printf("\tfk found: %s\n", toks->attribute);
-            return 1;
-        }
+    if (fclose(out) != 0) {
+        free(*bytes);
+        return -1;
     }
     return 0;
 }
 
-void *vfs2db_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
-    printf("init\n");
+static int getattr_meta(const char *path, struct stat *st) {
+    if (strcmp(path, META_DIR) == 0 || strcmp(path, META_DIR "/") == 0) {
+        fill_dir_stat(st);
+        return 0;
+    }
+    if (strcmp(path, META_STATS) != 0) return -ENOENT;
 
-    // Get all the tables
-    DbSchema db_schema;
-    init_db_schema(&db_schema);
-    printf("\tNumber of tables: %d\n", db_schema.n_tables);
+    char *bytes;
+    size_t size;
+    if (render_stats(&bytes, &size) != 0) return -EIO;
+    free(bytes);
 
-    // For each table, get all the info
-    for (int i=0; i<db_schema.n_tables; i++) {
-        init_schema(db_schema.tables[i]);
+    fill_file_stat(st, 0);
+    st->st_mode = S_IFREG | 0444;
+    st->st_size = size;
+    return 0;
+}
+
+// The content is rendered once per open: reads see a consistent snapshot
+static int open_meta(const char *path, struct fuse_file_info *fi) {
+    if (strcmp(path, META_STATS) != 0) return -ENOENT;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+
+    char *bytes;
+    size_t size;
+    if (render_stats(&bytes, &size) != 0) return -EIO;
+
+    FileHandle *fh = fh_create_virtual(bytes, size);
+    if (!fh) { free(bytes); return -ENOMEM; }
+
+    // The size reported by getattr is already stale
+    fi->direct_io = 1;
+    fi->fh = (uint64_t)(uintptr_t)fh;
+    return 0;
+}
+
+// =============================================================
+// Export files (/table/.rows.csv, /table/.rows.jsonl, /table/<rowid>.json)
+// =============================================================
+
+/*
+ * A table export is only rendered while it's read: its size is unknown and
+ * reported as 0, reads go past it (direct_io) until the end of the stream.
+ */
+static int getattr_export(const Tokens *toks, struct stat *st) {
+    fill_file_stat(st, 0);
+    st->st_mode = S_IFREG | 0444;
+    if (toks->export != EXPORT_ROW_JSON) return 0;
+
+    char *bytes;
+    size_t size;
+    int rc = export_render_row(toks, &bytes, &size);
+    if (rc != 0) return rc > 0 ? -ENOENT : -EIO;
+    free(bytes);
+
+    st->st_size = size;
+    return 0;
+}
+
+static int open_export(const Tokens *toks, struct fuse_file_info *fi) {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
+
+    FileHandle *fh;
+    if (toks->export == EXPORT_ROW_JSON) {
+        // A single row: rendered once per open, like the stats file
+        char *bytes;
+        size_t size;
+        int rc = export_render_row(toks, &bytes, &size);
+        if (rc != 0) return rc > 0 ? -ENOENT : -EIO;
+
+        fh = fh_create_virtual(bytes, size);
+        if (!fh) { free(bytes); return -ENOMEM; }
+    } else {
+        Export *ex = export_create(toks);
+        if (!ex) return -ENOMEM;
+
+        fh = fh_create_export(ex);
+        if (!fh) { export_destroy(ex); return -ENOMEM; }
     }
 
-    // Testing
-    for (int i=0; i<db_schema.n_tables; i++) {
-        // Print table name
-        printf("Table: %s\n", db_schema.tables[i]->name);
-        // Print pks
-        for (int j=0; j<db_schema.tables[i]->n_pk; j++) {
-            printf("\tPK: %s\n", db_schema.tables[i]->pk[j]);
-        }
-        // Print fks
-        for (int j=0; j<db_schema.tables[i]->n_fks; j++) {
-            printf("\tFK: %s -> %s(%s)\n", db_schema.tables[i]->fks[j]->from,
-                                           db_schema.tables[i]->fks[j]->table,
-                                           db_schema.tables[i]->fks[j]->to);
-        }
-        // Print attributes
-        for (int j=0; j<db_schema.tables[i]->n_attr; j++) {
-            printf("\tATT: %s\n", db_schema.tables[i]->attr[j]);
+    fi->direct_io = 1;
+    fi->fh = (uint64_t)(uintptr_t)fh;
+    return 0;
+}
+
+/**
+ * Set Up Mount
+ *
+ * @brief Everything a mount needs but the kernel side, shared by both
+ *        backends: connection pool, group commit, row cache, invalidation
+ *        and catalog.
+ *
+ * @param inval Invalidates a path in the kernel caches (see inval_start)
+ *
+ * @return 0 on success, -1 if the database can't be opened
+ */
+int vfs2db_setup(InvalFn inval) {
+    // Connections are opened here, after fuse_main has daemonized:
+    // one reader per worker thread plus a single writer
+    if (db_pool_open(db_path, &mount_opts) != 0) {
+        LOG_ERROR("db_pool_open failed\n");
+        return -1;
+    }
+
+    unsigned int group_commit_ms = mount_opts.read_only ? 0 : mount_opts.group_commit_ms;
+    if (group_commit_start(group_commit_ms, (size_t)mount_opts.group_commit_kb * 1024) != 0) {
+        LOG_ERROR("group_commit_start failed: every write commits on its own\n");
+    }
+
+    if (row_cache_init((size_t)mount_opts.row_cache_mb * 1024 * 1024) != 0) {
+        LOG_ERROR("row_cache_init failed: rows won't be cached\n");
+    }
+
+    // Kernel caching: long timeouts are safe as long as every change,
+    // ours or made by another process, invalidates what the kernel holds
+    // (and the row cache, cleared on external changes too).
+    // Nothing can change under an immutable snapshot
+    if (!mount_opts.read_only
+     && (mount_opts.entry_timeout > 0 || mount_opts.attr_timeout > 0 || mount_opts.kernel_cache
+      || row_cache_enabled())) {
+        if (inval_start(inval, mount_opts.poll_ms) != 0) {
+            LOG_ERROR("inval_start failed: kernel caches won't be invalidated\n");
         }
     }
 
+    // The catalog lives for the whole mount: tables are listed now, their
+    // columns loaded on first use. The catalog file keeps them across mounts
+    char cache_path[PATH_MAX];
+    const char *cache = mount_opts.catalog_cache;
+    if (!cache) {
+        snprintf(cache_path, sizeof(cache_path), "%s" CATALOG_FILE_EXT, db_path);
+        cache = cache_path;
+    }
+    if (catalog_init(cache) != 0) {
+        LOG_ERROR("catalog_init failed: no table will be listed\n");
+    }
+
+    return 0;
+}
+
+/**
+ * Kernel Cache Timeouts
+ *
+ * @brief Seconds the kernel caches names, attributes and missing names:
+ *        from the mount options, for good on read-only mounts (nothing can
+ *        change under an immutable snapshot).
+ */
+void vfs2db_kernel_timeouts(double *entry, double *attr, double *negative) {
+    if (mount_opts.read_only) {
+        *entry = *attr = *negative = RO_CACHE_TIMEOUT;
+        return;
+    }
+    *entry = mount_opts.entry_timeout;
+    *attr = mount_opts.attr_timeout;
+    *negative = 0;
+}
+
+/**
+ * Tear Down Mount
+ *
+ * @brief Inverse of vfs2db_setup: the last group is committed first.
+ */
+void vfs2db_teardown(void) {
+    QmStats stats;
+    qm_get_stats(&stats);
+    LOG_INFO("statement cache: %lu hits, %lu misses, %zu statements\n",
+             (unsigned long)stats.hits, (unsigned long)stats.misses, stats.entries);
+
+    // The last group transaction is committed before anything else stops
+    group_commit_stop();
+
+    // The invalidation thread uses the writer connection
+    inval_stop();
+
+    // Cached statements are finalized before closing each connection
+    catalog_save();
+    db_pool_close();
+    row_cache_cleanup();
+    catalog_free();
+    LOG_DEBUG("db_pool_close executed correctly.\n");
+}
+
+// FUSE instance of the high-level backend, for fuse_invalidate_path
+static struct fuse *mount_fuse = NULL;
+
+// fuse_invalidate_path only acts on paths the kernel looked up
+static int invalidate_path(const char *path) {
+    return fuse_invalidate_path(mount_fuse, path);
+}
+
+void *vfs2db_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    LOG_DEBUG("init\n");
+
+    mount_fuse = fuse_get_context()->fuse;
+    if (vfs2db_setup(invalidate_path) != 0) {
+        fuse_exit(mount_fuse);
+        return NULL;
+    }
+
+    vfs2db_kernel_timeouts(&cfg->entry_timeout, &cfg->attr_timeout, &cfg->negative_timeout);
+    cfg->kernel_cache = mount_opts.kernel_cache;
+
+    // Values in a memfd are spliced to the kernel (see vfs2db_read_buf)
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) conn->want |= FUSE_CAP_SPLICE_WRITE;
     return NULL;
 }
 
 void vfs2db_destroy(void *private_data) {
     struct fuse_args *args = (struct fuse_args*) private_data;
-    if (db) {
-        sqlite3_close(db);
-        printf("sqlite3_close executed correctly.\n");
-    }
+
+    vfs2db_teardown();
 
     fuse_opt_free_args(args);
-    printf("fuse_opt_free_args executed correctly.\n");
+    LOG_DEBUG("fuse_opt_free_args executed correctly.\n");
 }
 
-int vfs2db_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
-    printf("getattr: %s\n", path);
-
+/**
+ * Get Attributes
+ *
+ * @brief getattr of a resolved path (see vfs2db_resolve_path). Records and
+ *        attribute files that don't exist are reported as -ENOENT.
+ */
+int vfs2db_getattr_toks(const Tokens *toks, struct stat *st) {
     memset(st, 0, sizeof(*st));
 
-    // Check if directory --> doesn't finish with .vfs2db
-    // path: test/ciao/1.vfs2db
-    if (strncmp(&path[strlen(path) - 7], ".vfs2db", 7)) {
-        printf("\tDirectory\n");
-        st->st_mode = S_IFDIR | 0755;
-        st->st_nlink = 2;
-        st->st_uid = getuid();
-        st->st_gid = getgid();
-        st->st_atime = st->st_mtime = time(NULL);
-    } else {
-        printf("\tFile\n");
-
-        char *noext_path = remove_extension(path);
-        if (!noext_path) return -ENOMEM;
-        struct tokens *toks = tokenize_path(noext_path);
-
-        // We need to check if it is a symlink
-        int is_symlink = check_symlink(toks);
-        if (is_symlink) {
-            st->st_mode = S_IFLNK | 0644;
-            st->st_nlink = 1;
-            st->st_uid = getuid();
-            st->st_gid = getgid();
-            st->st_atime = st->st_mtime = time(NULL);
-        } else {
-            st->st_mode = S_IFREG | 0644;
-            st->st_nlink = 1;
-            st->st_uid = getuid();
-            st->st_gid = getgid();
-            st->st_atime = st->st_mtime = time(NULL);
+    if (toks->export != EXPORT_NONE) {
+        LOG_DEBUG("\tExport\n");
+        return getattr_export(toks, st);
+    }
+
+    if (toks->depth < 3) {
+        LOG_DEBUG("\tDirectory\n");
+
+        // Below a query directory only the matching records exist
+        if (toks->depth == 2 && toks->where) {
+            int rc = match_where(toks);
+            if (rc <= 0) return rc == 0 ? -ENOENT : -EIO;
         }
+        fill_dir_stat(st);
+        return 0;
+    }
 
-        size_t att_size = get_attribute_size(toks);
-        if (att_size < 0) return -1;
+    LOG_DEBUG("\tFile\n");
 
-        st->st_size = att_size;
+    // We need to check if it is a symlink
+    fill_file_stat(st, check_symlink(toks));
 
-        free(toks->table);
-        free(toks->record);
-        free(toks->attribute);
-        free(toks);
-        free(noext_path);
+    // Pending writes of an open handle win over the database
+    size_t pending_size;
+    int att_size = fh_lookup_size(toks, &pending_size)
+        ? (int)pending_size
+        : get_attribute_size(toks);
 
-        printf("\tcontent size: %d\n", att_size);
-    }
+    if (att_size < 0) return -ENOENT;
+    st->st_size = att_size;
 
+    LOG_DEBUG("\tcontent size: %d\n", att_size);
     return 0;
 }
 
+static int do_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+    (void)fi;
+    LOG_DEBUG("getattr: %s\n", path);
+
+    memset(st, 0, sizeof(*st));
+    if (is_meta_path(path)) return getattr_meta(path, st);
+
+    // Unknown tables, records or columns are rejected without touching the database
+    Tokens toks;
+    int rc = vfs2db_resolve_path(path, &toks);
+    if (rc == 0) rc = vfs2db_getattr_toks(&toks, st);
+    if (rc != 0) return rc;
+
+    // The kernel may cache these attributes until attr_timeout
+    inval_track(path);
+    return 0;
+}
+
+int vfs2db_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+    uint64_t start = stats_now();
+    int res = do_getattr(path, st, fi);
+    stats_record(STATS_GETATTR, start, res);
+    arena_reset();
+    return res;
+}
+
 int vfs2db_getxattr(const char *path, const char *name, char *value, size_t size) {
-    if (strcmp(name, "user.type") != 0) return -ENODATA;
+    if (is_meta_path(path)) return -ENODATA;
+
+    Tokens toks;
+    if (vfs2db_resolve_path(path, &toks) != 0) return -ENODATA;
+    int res = vfs2db_getxattr_toks(&toks, name, value, size);
+    arena_reset();
+    return res;
+}
+
+/**
+ * Get Extended Attribute
+ *
+ * @brief getxattr of a resolved path: user.type is the SQLite type of the
+ *        value of an attribute file.
+ */
+int vfs2db_getxattr_toks(const Tokens *toks, const char *name, char *value, size_t size) {
+    if (strcmp(name, "user.type") != 0 || toks->depth != 3) return -ENODATA;
 
-    char *noext_path = remove_extension(path);
-    if (!noext_path) return -ENOMEM;
-    
-    struct tokens *toks = tokenize_path(noext_path);
+    // Served by the row cache, like the getattr and read of the same file
+    int type = get_attribute_type(toks);
 
     const char* t_str;
-    switch (get_attribute_type(toks)) {
+    switch (type) {
         case SQLITE_TEXT:    t_str = "TEXT"; break;
         case SQLITE_INTEGER: t_str = "INTEGER"; break;
         case SQLITE_FLOAT:   t_str = "FLOAT"; break;
@@ -175,199 +477,672 @@ int vfs2db_getxattr(const char *path, const char *name, char *value, size_t size
         default:             t_str = "UNDEFINED"; break;
     }
 
-    printf("type: %s\n", t_str);
+    LOG_DEBUG("type: %s\n", t_str);
 
-    // 3. Return size or copy data
-    if (size == 0) return strlen(t_str);
-    if (size < strlen(t_str)) return -ERANGE;
-    
-    strcpy(value, t_str);
+    // 3. Return size or copy data (xattr values are not NUL terminated)
+    size_t len = strlen(t_str);
+    if (size == 0) return len;
+    if (size < len) return -ERANGE;
 
-    free(toks->table);
-    free(toks->record);
-    free(toks->attribute);
-    free(toks);
+    memcpy(value, t_str, len);
+    return len;
+}
 
-    return strlen(t_str);
+/*
+ * Readdir offsets
+ *
+ * "." and ".." are at offsets 1 and 2, the i-th table or column at i + 3.
+ * Inside a table the offset of a record is its rowid + 4: a later call
+ * resumes with "rowid > offset - 4", without rescanning what was listed.
+ * Negative rowids can't be encoded that way: they all report offset 3,
+ * which resumes from rowid 0, so they are only listed completely when
+ * they fit in the first batch.
+ */
+#define READDIR_FIRST_OFFSET 3
+#define READDIR_ROWID_OFFSET 4
+
+static inline off_t readdir_rowid_offset(sqlite3_int64 rowid) {
+    if (rowid < 0) return READDIR_FIRST_OFFSET;
+    if (rowid > INT64_MAX - READDIR_ROWID_OFFSET) return INT64_MAX;
+    return rowid + READDIR_ROWID_OFFSET;
 }
 
-int vfs2db_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
-    printf("readdir: %s\n", path);
-    filler(buffer, ".", NULL, 0, FUSE_FILL_DIR_DEFAULTS);
-    filler(buffer, "..", NULL, 0, FUSE_FILL_DIR_DEFAULTS);
+/*
+ * Lists the records of a table (or of a query or bucket directory) starting
+ * after offset, one keyset page at a time, until the kernel buffer is full
+ * or the table (the bucket's range) is exhausted.
+ */
+static int readdir_table(const Tokens *toks, void *buffer, fuse_fill_dir_t filler, off_t offset, bool plus) {
+    // Records are directories: readdirplus costs nothing more
+    struct stat st;
+    fill_dir_stat(&st);
+    const struct stat *stp = plus ? &st : NULL;
+    enum fuse_fill_dir_flags fill_flags = plus ? FUSE_FILL_DIR_PLUS : FUSE_FILL_DIR_DEFAULTS;
+
+    int64_t first = INT64_MIN, end = INT64_MAX;
+    if (toks->in_bucket) path_bucket_range(toks->bucket, &first, &end);
+
+    sqlite3_int64 last = offset >= READDIR_FIRST_OFFSET
+        ? (sqlite3_int64)(offset - READDIR_ROWID_OFFSET)
+        : INT64_MIN;
+    if (first > INT64_MIN && last < first - 1) last = first - 1;
+
+    for (;;) {
+        sqlite3_stmt* pstmt;
+        if (toks->where) make_where_select(&pstmt, toks, last, READDIR_BATCH);
+        else make_table_select(&pstmt, toks->table, last, end, READDIR_BATCH);
+        if (!pstmt) return -EIO;
+
+        int rc, n = 0;
+        bool full = false;
+        while ((rc = sqlite3_step(pstmt)) == SQLITE_ROW) {
+            sqlite3_int64 rowid = sqlite3_column_int64(pstmt, 0);
+            char name[32];
+            snprintf(name, sizeof(name), "%lld", (long long)rowid);
+
+            if (filler(buffer, name, stp, readdir_rowid_offset(rowid), fill_flags)) {
+                full = true;
+                break;
+            }
+            last = rowid;
+            n++;
+        }
+
+        qm_release(pstmt);
+        if (full) return 0;
+        if (rc != SQLITE_DONE) return -EIO;
+        if (n < READDIR_BATCH) return 0;
+    }
+}
 
+/*
+ * Lists the bucket directories of a table starting after offset: the
+ * offset of a bucket is that of its last rowid, and each bucket is found
+ * by a single seek past the previous one, so listing them costs a lookup
+ * per bucket, not a scan of the table.
+ */
+static int readdir_buckets(const Tokens *toks, void *buffer, fuse_fill_dir_t filler, off_t offset, bool plus) {
+    struct stat st;
+    fill_dir_stat(&st);
+    const struct stat *stp = plus ? &st : NULL;
+    enum fuse_fill_dir_flags fill_flags = plus ? FUSE_FILL_DIR_PLUS : FUSE_FILL_DIR_DEFAULTS;
+
+    // Past the last possible bucket, which ends at INT64_MAX
+    if (offset == INT64_MAX) return 0;
+
+    sqlite3_int64 last = offset >= READDIR_FIRST_OFFSET
+        ? (sqlite3_int64)(offset - READDIR_ROWID_OFFSET)
+        : INT64_MIN;
+
+    for (;;) {
+        sqlite3_stmt *pstmt;
+        make_table_select(&pstmt, toks->table, last, INT64_MAX, 1);
+        if (!pstmt) return -EIO;
+
+        int rc = sqlite3_step(pstmt);
+        sqlite3_int64 rowid = rc == SQLITE_ROW ? sqlite3_column_int64(pstmt, 0) : 0;
+        qm_release(pstmt);
+        if (rc == SQLITE_DONE) return 0;
+        if (rc != SQLITE_ROW) return -EIO;
+
+        int64_t bucket = path_bucket_of(rowid), first, end;
+        path_bucket_range(bucket, &first, &end);
+
+        char name[32];
+        if (path_bucket_name(bucket, name, sizeof(name)) < 0) return -EIO;
+        if (filler(buffer, name, stp, readdir_rowid_offset(end), fill_flags)) return 0;
+
+        if (end == INT64_MAX) return 0;
+        last = end;
+    }
+}
+
+/*
+ * Lists the records of a table by primary key (/table/.pk) starting after
+ * offset: with a rowid the offsets and pages are those of readdir_table,
+ * without one the offset of the i-th key is i + 4 and each page skips the
+ * keys already listed. Keys with a NULL or BLOB part, or too long for a
+ * name, can't be resolved back: they are left out.
+ */
+static int readdir_keys(const Tokens *toks, void *buffer, fuse_fill_dir_t filler, off_t offset, bool plus) {
+    const Schema *schema = catalog_table(toks->table_id);
+
+    struct stat st;
+    fill_dir_stat(&st);
+    const struct stat *stp = plus ? &st : NULL;
+    enum fuse_fill_dir_flags fill_flags = plus ? FUSE_FILL_DIR_PLUS : FUSE_FILL_DIR_DEFAULTS;
+
+    // The last rowid listed, or the number of keys listed without rowid
+    sqlite3_int64 last = offset >= READDIR_FIRST_OFFSET
+        ? (sqlite3_int64)(offset - READDIR_ROWID_OFFSET)
+        : (schema->without_rowid ? -1 : INT64_MIN);
+    int first_col = schema->without_rowid ? 0 : 1;
+
+    for (;;) {
+        sqlite3_stmt *pstmt;
+        make_pk_select(&pstmt, schema, schema->without_rowid ? last + 1 : last, READDIR_BATCH);
+        if (!pstmt) return -EIO;
+
+        int rc, n = 0;
+        bool full = false;
+        while ((rc = sqlite3_step(pstmt)) == SQLITE_ROW) {
+            sqlite3_int64 pos = schema->without_rowid ? last + 1 : sqlite3_column_int64(pstmt, 0);
+            last = pos;
+            n++;
+
+            // The parts as path_resolve decodes them, then encoded
+            char key[NAME_MAX + 1];
+            size_t len = 0;
+            bool valid = true;
+            for (int i = 0; i < schema->n_pk && valid; i++) {
+                int col = first_col + i;
+                int type = sqlite3_column_type(pstmt, col);
+                const char *part = (const char*)sqlite3_column_text(pstmt, col);
+                size_t part_len = sqlite3_column_bytes(pstmt, col);
+
+                valid = type != SQLITE_NULL && type != SQLITE_BLOB && part
+                     && len + part_len + 1 <= sizeof(key) && !memchr(part, '\0', part_len);
+                if (!valid) break;
+                memcpy(key + len, part, part_len);
+                len += part_len;
+                key[len++] = '\0';
+            }
+
+            char name[NAME_MAX + 1];
+            if (!valid || path_encode_key(key, schema->n_pk, name, sizeof(name)) < 0) continue;
+
+            if (filler(buffer, name, stp, readdir_rowid_offset(pos), fill_flags)) {
+                full = true;
+                break;
+            }
+        }
+
+        qm_release(pstmt);
+        if (full) return 0;
+        if (rc != SQLITE_DONE) return -EIO;
+        if (n < READDIR_BATCH) return 0;
+    }
+}
+
+/**
+ * Read Directory
+ *
+ * @brief readdir of a resolved path, or of META_DIR if toks is NULL.
+ *
+ * @param path Path of the directory, to track the files listed with their
+ *             attributes (see inval_track); NULL not to track them
+ * @param plus Whether the entries come with their attributes (readdirplus)
+ *
+ * @return 0 on success, a negative errno on failure
+ */
+int vfs2db_readdir_toks(const Tokens *toks, const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, bool plus) {
     // path: /
     // path: /orders    |   /orders/
     // path: /orders/2  |   /orders/2/
 
-    // Togliamo slash alla fine, se c'e'
-    char *path_copy = strdup(path);
-    printf("\tpath: %s\n", path_copy);
-    if (path_copy[strlen(path)-1] == '/') {
-        path_copy[strlen(path)-1] = 0;
-    }
-    
-    struct tokens *toks = tokenize_path(path_copy);
-    printf("\t\tTable: %s\n", toks->table);
-    printf("\t\tRecord: %s\n", toks->record);
-    printf("\t\tAttribute: %s\n", toks->attribute);
-
-    sqlite3_stmt* pstmt;
-    int slash_count = COUNT_CHAR(path_copy, '/');
-    switch(slash_count) {
-        case 0: // SE SEI NELLA ROOT DEVI FARE UNA QUERY CON LA SQLITE_MASTER
-            make_root_select(&pstmt);
+    // Il path senza gli slash finali, per i file tracciati
+    size_t path_len = path ? strlen(path) : 0;
+    while (path_len > 1 && path[path_len - 1] == '/') path_len--;
+
+    if (toks && toks->export != EXPORT_NONE) return -ENOTDIR;
+
+    // Readdirplus: every entry comes with its attributes, sparing the
+    // kernel a getattr per entry
+    struct stat dir_st;
+    fill_dir_stat(&dir_st);
+    const struct stat *dir_stp = plus ? &dir_st : NULL;
+    enum fuse_fill_dir_flags fill_flags = plus ? FUSE_FILL_DIR_PLUS : FUSE_FILL_DIR_DEFAULTS;
+
+    // A full buffer (filler returning 1) ends the batch: the kernel calls
+    // again with the offset of the last entry it received
+    int res = 0;
+    bool full = false;
+    if (offset < 1) full = filler(buffer, ".", dir_stp, 1, fill_flags);
+    if (!full && offset < 2) full = filler(buffer, "..", dir_stp, 2, fill_flags);
+
+    int depth = toks ? toks->depth : -2;
+
+    switch(full ? -1 : depth) {
+        case -1:
             break;
-        case 1: // SE SEI DENTRO UNA TABELLA DEVI FARE UNA SELECT SUL ROWID
-            make_table_select(&pstmt, toks->table);
+        case -2: { // FILE VIRTUALI DEL DRIVER
+            struct stat st;
+            getattr_meta(META_STATS, &st);
+            if (offset < READDIR_FIRST_OFFSET) {
+                filler(buffer, META_STATS_NAME, plus ? &st : NULL, READDIR_FIRST_OFFSET, fill_flags);
+            }
             break;
-        case 2: // SE SEI DENTRO UN RECORD BASTA FARE UNA SELECT SUL PRAGMA PER OTTENERE I NOMI DEI CAMPI DELLA TABELLA
-            make_record_select(&pstmt, toks->table);
+        }
+        case 0: { // NELLA ROOT I NOMI DELLE TABELLE VENGONO DAL CATALOGO
+            int i;
+            // Offsets are table ids: they stay valid across DDL, dropped tables skipped
+            catalog_check();
+            int n_tables = catalog_n_tables();
+            for (i = 0; i < n_tables; i++) {
+                off_t next = i + READDIR_FIRST_OFFSET;
+                const char *name = catalog_table_name(i);
+                if (next <= offset || !name) continue;
+                if (filler(buffer, name, dir_stp, next, fill_flags)) break;
+            }
+
+            // The virtual files come after the tables
+            if (i == n_tables && i + READDIR_FIRST_OFFSET > offset) {
+                filler(buffer, META_DIR_NAME, dir_stp, i + READDIR_FIRST_OFFSET, fill_flags);
+            }
+            break;
+        }
+        case 1: { // SE SEI DENTRO UNA TABELLA SI SCORRE IL ROWID A PAGINE
+            if (toks->by_pk) {
+                res = readdir_keys(toks, buffer, filler, offset, plus);
+                break;
+            }
+
+            // Without rowid the records are only listed by key
+            if (catalog_table(toks->table_id)->without_rowid) {
+                if (offset < READDIR_FIRST_OFFSET) {
+                    filler(buffer, PK_DIR_NAME, dir_stp, READDIR_FIRST_OFFSET, fill_flags);
+                }
+                break;
+            }
+
+            // .where itself can't list every possible filter
+            if (toks->where && toks->where_col < 0) break;
+
+            // Bucketed layout: the table lists its buckets, each bucket its records
+            if (!toks->where && !toks->in_bucket && mount_opts.bucket_fanout > 0) {
+                res = readdir_buckets(toks, buffer, filler, offset, plus);
+                break;
+            }
+            res = readdir_table(toks, buffer, filler, offset, plus);
+            break;
+        }
+        case 2: { // DENTRO UN RECORD I NOMI DEI CAMPI VENGONO DAL CATALOGO
+            const Schema *schema = catalog_table(toks->table_id);
+
+            // Readdirplus: the sizes of all the attributes come from one query.
+            // If it fails, entries go without attributes and the kernel falls
+            // back to getattr
+            off_t *sizes = plus ? arena_alloc(schema->n_cols * sizeof(off_t)) : NULL;
+            bool with_stat = sizes && get_record_attribute_sizes(toks, sizes) == schema->n_cols;
+
+            for (int i = 0; i < schema->n_cols; i++) {
+                off_t next = i + READDIR_FIRST_OFFSET;
+                if (next <= offset) continue;
+
+                char *file = arena_printf("%s" ATTR_EXT, schema->cols[i].name);
+                if (!file) {
+                    res = -ENOMEM;
+                    break;
+                }
+                LOG_DEBUG("\tfile: %s\n", file);
+
+                if (!with_stat) {
+                    if (filler(buffer, file, NULL, next, FUSE_FILL_DIR_DEFAULTS)) break;
+                    continue;
+                }
+
+                // Same attributes getattr would report, pending writes included
+                Tokens col_toks = *toks;
+                col_toks.depth = 3;
+                col_toks.col_id = i;
+                col_toks.attribute = schema->cols[i].name;
+                size_t pending_size;
+                struct stat st;
+                fill_file_stat(&st, schema->cols[i].fk != NULL);
+                st.st_size = fh_lookup_size(&col_toks, &pending_size) ? (off_t)pending_size : sizes[i];
+
+                if (filler(buffer, file, &st, next, FUSE_FILL_DIR_PLUS)) break;
+                if (!path) continue;
+
+                char *file_path = arena_printf("%.*s/%s", (int)path_len, path, file);
+                if (file_path) inval_track(file_path);
+            }
+            break;
+        }
+        default: // Attribute files aren't directories
+            res = -ENOTDIR;
             break;
-        default:
-            fprintf(stderr, "\tHow the fuck did you end up here?");
-            return -1;
     }
-     
-    const char *pattern = slash_count == 2 ? "%s.vfs2db" : "%s";
 
-    int rc;
-    while ((rc = sqlite3_step(pstmt)) == SQLITE_ROW) {
-        const char *attr_name = (const char*)sqlite3_column_text(pstmt, 0);
+    return res;
+}
 
-        char file[1024];
-        snprintf(file, 1024, pattern, attr_name);
+static int do_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    (void)fi;
+    LOG_DEBUG("readdir: %s (offset %lld)\n", path, (long long)offset);
+    bool plus = flags & FUSE_READDIR_PLUS;
 
-        printf("\tfile: %s\n", file);
-        if (*file != '\0') {
-            filler(buffer, file, NULL, 0, FUSE_FILL_DIR_DEFAULTS);
-        }
+    if (is_meta_path(path)) {
+        size_t path_len = strlen(path);
+        while (path_len > 1 && path[path_len - 1] == '/') path_len--;
+        if (path_len != strlen(META_DIR)) return -ENOTDIR;
+        return vfs2db_readdir_toks(NULL, path, buffer, filler, offset, plus);
     }
 
-    sqlite3_finalize(pstmt);
+    Tokens toks;
+    int rc = vfs2db_resolve_path(path, &toks);
+    if (rc != 0) return rc;
+    LOG_DEBUG("\t\tTable: %s\n", toks.table);
+    LOG_DEBUG("\t\tRecord: %lld\n", (long long)toks.rowid);
+
+    return vfs2db_readdir_toks(&toks, path, buffer, filler, offset, plus);
+}
+
+int vfs2db_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    uint64_t start = stats_now();
+    int res = do_readdir(path, buffer, filler, offset, fi, flags);
+    stats_record(STATS_READDIR, start, res);
+    arena_reset();
+    return res;
+}
+
+int vfs2db_open(const char *path, struct fuse_file_info *fi) {
+    LOG_DEBUG("open: %s\n", path);
+    if (is_meta_path(path)) return open_meta(path, fi);
+
+    Tokens toks;
+    int rc = vfs2db_resolve_path(path, &toks);
+    if (rc != 0) return rc;
+    rc = vfs2db_open_toks(&toks, fi);
+    arena_reset();
+    return rc;
+}
+
+/**
+ * Open
+ *
+ * @brief open of a resolved path: attribute files get a FileHandle,
+ *        export files their stream, in fi->fh.
+ */
+int vfs2db_open_toks(const Tokens *toks, struct fuse_file_info *fi) {
+    if (toks->export != EXPORT_NONE) return open_export(toks, fi);
+    if (toks->depth < 3) return -EISDIR;
+    if (mount_opts.read_only && ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC))) return -EROFS;
+
+    FileHandle *fh = fh_create(toks, fi->flags);
+    if (!fh) return -ENOENT;
 
-    free(path_copy);
-    free(toks->table);
-    free(toks->record);
-    free(toks->attribute);
-    free(toks);
+    // Read-only: the page cache of the file stays valid across opens
+    if (mount_opts.read_only) fi->keep_cache = 1;
 
+    fi->fh = (uint64_t)(uintptr_t)fh;
     return 0;
 }
 
-int vfs2db_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-    printf("read: %s\n", path);
+// The low-level backend has no path: only the record's own paths are invalidated
+int vfs2db_flush(const char *path, struct fuse_file_info *fi) {
+    LOG_DEBUG("flush: %s\n", path ? path : "-");
+    return flush_file_handle(path, get_file_handle(fi));
+}
 
-    size_t path_len = strlen(path);
-    if (path_len < 7) return -1; // Safety check
+int vfs2db_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    (void)datasync;
+    LOG_DEBUG("fsync: %s\n", path ? path : "-");
+    int res = flush_file_handle(path, get_file_handle(fi));
 
-    char *noext_path = remove_extension(path);
-    if (!noext_path) return -ENOMEM;
+    // Group commit: the writes of every file so far become durable together
+    if (group_commit_flush() != 0 && res == 0) res = -EIO;
+    return res;
+}
 
-    struct tokens *toks = tokenize_path(noext_path);
+int vfs2db_release(const char *path, struct fuse_file_info *fi) {
+    LOG_DEBUG("release: %s\n", path ? path : "-");
 
-    struct {
-        char *bytes;
-        size_t size;
-    } content;
+    FileHandle *fh = get_file_handle(fi);
+    int res = flush_file_handle(path, fh);
 
-    content.bytes = NULL;
+    fh_destroy(fh);
+    fi->fh = 0;
+    return res;
+}
 
-    if (get_attribute_value(toks, &content.bytes, &content.size) == -1) {
-        free(toks->table); free(toks->record); free(toks->attribute);
-        free(toks); free(noext_path); free(content.bytes);
-        return -1;
+int vfs2db_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    LOG_DEBUG("truncate: %s\n", path);
+    if (is_meta_path(path)) return -EACCES;
+    if (mount_opts.read_only) return -EROFS;
+
+    // ftruncate: through the open handle (see fh_truncate)
+    FileHandle *fh = get_file_handle(fi);
+    if (fh) return fh_truncate(fh, size) == 0 ? 0 : -EIO;
+
+    Tokens toks;
+    int rc = vfs2db_resolve_path(path, &toks);
+    if (rc != 0) return rc;
+    return vfs2db_truncate_toks(&toks, path, size, NULL);
+}
+
+/**
+ * Truncate
+ *
+ * @brief truncate of a resolved path, through its open handle fh if any,
+ *        otherwise through a one-shot handle written back right away.
+ *
+ * @param path Path to invalidate once written back, NULL for the record's own
+ */
+int vfs2db_truncate_toks(const Tokens *toks, const char *path, off_t size, FileHandle *fh) {
+    if (mount_opts.read_only) return -EROFS;
+    if (fh) return fh_truncate(fh, size) == 0 ? 0 : -EIO;
+    if (toks->export != EXPORT_NONE) return -EACCES;
+    if (toks->depth < 3) return -EISDIR;
+
+    fh = fh_create(toks, O_WRONLY);
+    if (!fh) return -ENOENT;
+
+    int res = fh_truncate(fh, size) == 0 ? flush_file_handle(path, fh) : -EIO;
+    fh_destroy(fh);
+    return res;
+}
+
+/**
+ * Fallocate
+ *
+ * @brief Preallocates the value of an open attribute file, so that a large
+ *        copy fills it in place (see fh_truncate). Only the default mode:
+ *        the value has no holes to punch and its size is its length.
+ */
+int vfs2db_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    LOG_DEBUG("fallocate: %s\n", path ? path : "-");
+    if (mount_opts.read_only) return -EROFS;
+    if (mode != 0) return -EOPNOTSUPP;
+
+    FileHandle *fh = get_file_handle(fi);
+    if (!fh || fh->export || (fh->flags & O_ACCMODE) == O_RDONLY) return -EBADF;
+    return fh_allocate(fh, offset, length) == 0 ? 0 : -EIO;
+}
+
+static int do_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+    LOG_DEBUG("read: %s\n", path);
+
+    // Values materialized at open time are served as slices of the handle
+    int res = fh_read(get_file_handle(fi), buffer, size, offset);
+    if (res >= 0) return res;
+    if (is_meta_path(path)) return -EBADF;
+
+    Tokens toks;
+    int rc = vfs2db_resolve_path(path, &toks);
+    if (rc != 0) return rc;
+    return vfs2db_read_toks(&toks, buffer, size, offset);
+}
+
+/**
+ * Read
+ *
+ * @brief read of a resolved attribute file straight from the database,
+ *        for the handles that don't hold its value (see fh_read).
+ */
+int vfs2db_read_toks(const Tokens *toks, char *buffer, size_t size, off_t offset) {
+    if (toks->export != EXPORT_NONE) return -EIO;
+    if (toks->depth < 3) return -EISDIR;
+    if (offset < 0) return -EINVAL;
+
+    char *bytes = NULL;
+    size_t bytes_size;
+    if (get_attribute_value_arena(toks, &bytes, &bytes_size) == -1) return -EIO;
+
+    size_t bytes_available = 0;
+    if ((size_t)offset < bytes_size) {
+        bytes_available = bytes_size - offset;
+        if (bytes_available > size) bytes_available = size;
+        memcpy(buffer, bytes + offset, bytes_available);
     }
+    return bytes_available;
+}
+
+int vfs2db_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+    uint64_t start = stats_now();
+    int res = do_read(path, buffer, size, offset, fi);
+    stats_record(STATS_READ, start, res);
+    arena_reset();
+    return res;
+}
 
-    if (offset >= content.size) {
-        free(toks->table); free(toks->record); free(toks->attribute);
-        free(toks); free(noext_path); free(content.bytes);
+static int do_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct fuse_bufvec *buf = malloc(sizeof(struct fuse_bufvec));
+    if (!buf) return -ENOMEM;
+    *buf = FUSE_BUFVEC_INIT(size);
+
+    // libfuse frees the memory it's given: only a memfd can be lent
+    const char *mem;
+    int fd;
+    int res = fh_slice(get_file_handle(fi), size, offset, &mem, &fd);
+    if (res >= 0 && fd >= 0) {
+        buf->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        buf->buf[0].fd = fd;
+        buf->buf[0].pos = offset;
+        buf->buf[0].size = res;
+        *bufp = buf;
         return 0;
     }
 
-    size_t bytes_available = content.size - offset;
-    if (bytes_available > size) {
-        bytes_available = size;
+    // Anything else is copied, as libfuse does around read
+    buf->buf[0].mem = malloc(size > 0 ? size : 1);
+    res = buf->buf[0].mem ? do_read(path, buf->buf[0].mem, size, offset, fi) : -ENOMEM;
+    if (res < 0) {
+        free(buf->buf[0].mem);
+        free(buf);
+        return res;
     }
 
-    memcpy(buffer, content.bytes + offset, bytes_available);
+    buf->buf[0].size = res;
+    *bufp = buf;
+    return 0;
+}
 
-    // Cleanup
-    free(toks->table);
-    free(toks->record);
-    free(toks->attribute);
-    free(toks);
-    free(noext_path);
-    free(content.bytes);
+/**
+ * Read Buffer
+ *
+ * @brief read for libfuse's zero-copy path: values materialized in a memfd
+ *        (see fh_slice) are returned as the memfd itself, which libfuse
+ *        splices to the kernel when FUSE_CAP_SPLICE_WRITE is on and reads
+ *        with pread otherwise. Everything else goes through do_read.
+ */
+int vfs2db_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    uint64_t start = stats_now();
+    int res = do_read_buf(path, bufp, size, offset, fi);
+    stats_record(STATS_READ, start, res);
+    arena_reset();
+    return res;
+}
 
-    return bytes_available;
+static int do_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+    LOG_DEBUG("write: %s\n", path);
+    LOG_DEBUG("\tsize: %zu\n", size);
+    LOG_DEBUG("\toffset: %ld\n", (long)offset);
+    if (is_meta_path(path)) return -EACCES;
+    if (mount_opts.read_only) return -EROFS;
+
+    // Writes are buffered by the handle until flush/fsync/release
+    FileHandle *fh = get_file_handle(fi);
+    if (fh) return fh_write(fh, buffer, size, offset) >= 0 ? (int)size : -EIO;
+
+    // No handle: write through a one-shot handle
+    int err;
+    fh = open_file_handle(path, O_WRONLY, &err);
+    if (!fh) return err;
+
+    int res = fh_write(fh, buffer, size, offset) >= 0 ? flush_file_handle(path, fh) : -EIO;
+    if (res == 0) res = size;
+    fh_destroy(fh);
+    return res;
 }
 
 int vfs2db_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-    printf("write: %s\n", path);
-    printf("\tbuffer: %s\n", buffer);
-    printf("\tsize: %zu\n", size);
-    printf("\toffset: %d\n", offset);
-
-    char *noext_path = remove_extension(path);
-    if (!noext_path) return -ENOMEM;
-    
-    struct tokens *toks = tokenize_path(noext_path);
-    
-    int append = (offset == 0) ? 0 : 1;
-    int result = update_attribute_value(toks, buffer, size, append);
-
-    free(toks->table);
-    free(toks->record);
-    free(toks->attribute);
-    free(toks);
-    free(noext_path);
-
-    return result == 0 ? size : result;
+    uint64_t start = stats_now();
+    int res = do_write(path, buffer, size, offset, fi);
+    stats_record(STATS_WRITE, start, res);
+    arena_reset();
+    return res;
 }
 
 int vfs2db_create(const char* path, mode_t mode, struct fuse_file_info *fi) {
+    (void)path; (void)mode; (void)fi;
+    if (mount_opts.read_only) return -EROFS;
+
     // if (insert_record(path, mode) == -1)
     //     return -1;
     return 0;
 }
 
-int vfs2db_readlink(const char* path, char* buffer, size_t size) {
-    printf("readlink\n");
-    char *noext_path = remove_extension(path);
-    if (!noext_path) return -ENOMEM;
-    struct tokens *toks = tokenize_path(noext_path);
+static int do_readlink(const char* path, char* buffer, size_t size) {
+    LOG_DEBUG("readlink\n");
+    if (is_meta_path(path)) return -EINVAL;
+
+    Tokens toks;
+    int rc = vfs2db_resolve_path(path, &toks);
+    if (rc != 0) return rc;
+    return vfs2db_readlink_toks(&toks, buffer, size);
+}
+
+/**
+ * Read Link
+ *
+ * @brief readlink of a resolved foreign key attribute: the target is
+ *        relative, back to the root from the directory the path goes
+ *        through, then down to the referenced record.
+ */
+int vfs2db_readlink_toks(const Tokens *toks, char *buffer, size_t size) {
+    if (toks->depth < 3) return -EINVAL;
+
+    // Back to the root: query directories add two levels (.where/<column>=<value>),
+    // key and bucket directories one (.pk, 000123xxx)
+    char prefix[16] = "";
+    int levels = 2 + (toks->where ? 2 : 0) + (toks->by_pk ? 1 : 0) + (toks->in_bucket ? 1 : 0);
+    for (int i = 0; i < levels; i++) strcat(prefix, "../");
+
+    // 0. chiavi composte e tabelle senza rowid -> ../../ftable/.pk/key/fattribute.vfs2db,
+    // dai valori della chiave nel record stesso (vedi resolve_fk_key)
+    Tokens ftoks;
+    int rc = resolve_fk_key(toks, &ftoks);
+    if (rc < 0) return -EIO;
+    if (rc == 1) return -ENOENT;
+    if (rc == 0) {
+        char key[NAME_MAX + 1];
+        if (path_encode_key(ftoks.value, ftoks.n_key, key, sizeof(key)) < 0) return -ENAMETOOLONG;
+
+        snprintf(buffer, size, "%s%s/" PK_DIR_NAME "/%s/%s" ATTR_EXT, prefix, ftoks.table, key, ftoks.attribute);
+        return 0;
+    }
 
     // 1. dalla path capire la tabella esterna del record
-    char *ftable; char* fattribute;
-    get_foreign_table_attribute_name(toks, &ftable, &fattribute);
-
-    // abbiamo il nome della tabella cui campo (toks->attribute) e' riferito
-    // ma attenzione! per ricavare il rowid, abbiamo bisogno di tutte le chiavi primarie
-    // della tabella riferita --> dobbiamo prendere eventuali altri chiavi esterne della tabella riferita
-
-    // lo facciamo accoppiando tutte le chiavi esterne di toks->table che fanno riferimento
-    // a ftable
-    int num = get_all_fkpk_relationships_length(toks->table, ftable);
-    struct pkfk_relation *pkfk = malloc(num * sizeof(struct pkfk_relation));
-    if (!pkfk) return -1;
-    get_all_fkpk_relationships(toks->table, ftable, pkfk);
-    
-    // una volta ottenute queste coppie, devo conoscere i valori delle chiavi esterne
-    fill_fk_values(toks->table, toks->record, pkfk, num);
-
-    // quindi mi basta fare una query del tipo SELECT rowid FROM ftable WHERE pk1=vfk1, pk2=vfk2, ...
-    int row_id = get_rowid_from_pks(ftable, pkfk, num);
-
-    // 6. creare il path del record -> ../../ftable/row_id/fattribute.vfs2db
-    snprintf(buffer, size, "../../%s/%d/%s.vfs2db", ftable, row_id, fattribute);
-
-    free(toks->table);
-    free(toks->record);
-    free(toks->attribute);
-    free(toks);
-    free(ftable);
-    free(fattribute);
+    const char *ftable; const char *fattribute;
+    if (get_foreign_table_attribute_name(toks, &ftable, &fattribute) != 0 || !fattribute) {
+        return -EINVAL;
+    }
 
+    // 2. il rowid del record riferito, con una sola lookup (vedi build_fk_plan)
+    sqlite3_int64 frowid;
+    rc = resolve_fk(toks, &frowid);
+    if (rc != 0) return rc > 0 ? -ENOENT : -EIO;
+
+    // 3. creare il path del record -> ../../ftable/row_id/fattribute.vfs2db
+    snprintf(buffer, size, "%s%s/%lld/%s" ATTR_EXT, prefix, ftable, (long long)frowid, fattribute);
     return 0;
-}
\ No newline at end of file
+}
+
+int vfs2db_readlink(const char* path, char* buffer, size_t size) {
+    uint64_t start = stats_now();
+    int res = do_readlink(path, buffer, size);
+    stats_record(STATS_READLINK, start, res);
+    arena_reset();
+    return res;
+}
@@ -11,16 +11,15 @@
 #include <fuse3/fuse.h>
 
 #include "../db_handler/db_handler.h"
+#include "file_handle.h"
+#include "path.h"
+#include "invalidation.h"
+#include "../utils/stats.h"
+#include "../utils/arena.h"
 
-#define COUNT_CHAR(str, ch)                                                    \
-  ({                                                                           \
-    int count = 0;                                                             \
-    for (int i = 0; str[i] != '\0'; i++) {                                     \
-      if (str[i] == ch)                                                        \
-        count++;                                                               \
-    }                                                                          \
-    count;                                                                     \
-  })
+int   vfs2db_setup(InvalFn inval);
+void  vfs2db_teardown(void);
+void  vfs2db_kernel_timeouts(double *entry, double *attr, double *negative);
 
 void *vfs2db_init(struct fuse_conn_info *conn, struct fuse_config *cfg);
 void  vfs2db_destroy(void *private_data);
@@ -32,11 +31,35 @@ int vfs2db_getxattr(const char *path, const char *name, char *value,
 int vfs2db_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
                    off_t offset, struct fuse_file_info *fi,
                    enum fuse_readdir_flags flags);
+int vfs2db_open(const char *path, struct fuse_file_info *fi);
+int vfs2db_flush(const char *path, struct fuse_file_info *fi);
+int vfs2db_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+int vfs2db_release(const char *path, struct fuse_file_info *fi);
+int vfs2db_truncate(const char *path, off_t size, struct fuse_file_info *fi);
+int vfs2db_fallocate(const char *path, int mode, off_t offset, off_t length,
+                     struct fuse_file_info *fi);
 int vfs2db_read(const char *path, char *buffer, size_t size, off_t offset,
                 struct fuse_file_info *fi);
+int vfs2db_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                    off_t offset, struct fuse_file_info *fi);
 int vfs2db_write(const char *path, const char *buffer, size_t size,
                  off_t offset, struct fuse_file_info *fi);
 int vfs2db_create(const char *path, mode_t mode, struct fuse_file_info *fi);
 int vfs2db_readlink(const char *path, char *buffer, size_t size);
 
+// The same operations on a resolved path (see vfs2db_resolve_path),
+// shared with the low-level backend
+int vfs2db_resolve_path(const char *path, Tokens *toks);
+int vfs2db_getattr_toks(const Tokens *toks, struct stat *st);
+int vfs2db_getxattr_toks(const Tokens *toks, const char *name, char *value,
+                         size_t size);
+int vfs2db_readdir_toks(const Tokens *toks, const char *path, void *buffer,
+                        fuse_fill_dir_t filler, off_t offset, bool plus);
+int vfs2db_open_toks(const Tokens *toks, struct fuse_file_info *fi);
+int vfs2db_truncate_toks(const Tokens *toks, const char *path, off_t size,
+                         FileHandle *fh);
+int vfs2db_read_toks(const Tokens *toks, char *buffer, size_t size,
+                     off_t offset);
+int vfs2db_readlink_toks(const Tokens *toks, char *buffer, size_t size);
+
 #endif // SYSCALL_HANDLER_H
@@ -0,0 +1,168 @@
+#include "arena.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "const.h"
+
+/**
+ * Arena Block
+ *
+ * Blocks are stacked: allocations are carved from the top one, and a new
+ * block is pushed when it's full (a dedicated one for larger requests).
+ *
+ * prev: block pushed before this one (NULL for the first)
+ * size: bytes of data
+ * used: bytes of data handed out
+ * data: the memory, aligned for any type
+ */
+typedef struct ArenaBlock {
+    struct ArenaBlock *prev;
+    size_t             size;
+    size_t             used;
+    max_align_t        data[];
+} ArenaBlock;
+
+// Top block of each thread's arena, freed when the thread exits
+static pthread_key_t  arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static void arena_destructor(void *value) {
+    ArenaBlock *b = value;
+    while (b) {
+        ArenaBlock *prev = b->prev;
+        free(b);
+        b = prev;
+    }
+}
+
+static void arena_key_init(void) {
+    pthread_key_create(&arena_key, arena_destructor);
+}
+
+static inline ArenaBlock *arena_top(void) {
+    pthread_once(&arena_once, arena_key_init);
+    return pthread_getspecific(arena_key);
+}
+
+/**
+ * Arena Allocation
+ *
+ * @brief Scratch memory of the calling thread, for what a FUSE operation
+ *        only needs until it returns (values, names, SQL text): a pointer
+ *        bump instead of a malloc/free pair, with no fragmentation across
+ *        operations and threads. Valid until arena_reset (or arena_release
+ *        of an earlier mark): never keep it in a FileHandle or a cache.
+ *
+ * @return ARENA_ALIGN aligned memory, NULL on failure
+ */
+void *arena_alloc(size_t size) {
+    if (size > SIZE_MAX - sizeof(ArenaBlock) - ARENA_ALIGN) return NULL;
+    size = size ? (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1) : ARENA_ALIGN;
+
+    ArenaBlock *top = arena_top();
+    if (!top || top->size - top->used < size) {
+        size_t data = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock *b = malloc(sizeof(ArenaBlock) + data);
+        if (!b) return NULL;
+
+        b->prev = top;
+        b->size = data;
+        b->used = 0;
+        if (pthread_setspecific(arena_key, b) != 0) {
+            free(b);
+            return NULL;
+        }
+        top = b;
+    }
+
+    void *p = (char*)top->data + top->used;
+    top->used += size;
+    return p;
+}
+
+/**
+ * Arena Copy
+ *
+ * @return copy of size bytes of src, NUL terminated, NULL on failure
+ */
+char *arena_memdup(const void *src, size_t size) {
+    char *copy = size < SIZE_MAX ? arena_alloc(size + 1) : NULL;
+    if (!copy) return NULL;
+    if (size > 0) memcpy(copy, src, size);
+    copy[size] = '\0';
+    return copy;
+}
+
+/**
+ * Arena Format
+ *
+ * @brief snprintf into the arena, sized to fit: no fixed buffer to
+ *        truncate long names.
+ *
+ * @return the formatted string, NULL on failure
+ */
+char *arena_printf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (len < 0) return NULL;
+
+    char *s = arena_alloc((size_t)len + 1);
+    if (!s) return NULL;
+
+    va_start(ap, fmt);
+    vsnprintf(s, (size_t)len + 1, fmt, ap);
+    va_end(ap);
+    return s;
+}
+
+/**
+ * Arena Mark
+ *
+ * @brief Current position of the calling thread's arena: code that may run
+ *        outside of a FUSE operation (or allocates a lot in a loop) frees
+ *        its scratch memory with arena_release.
+ */
+ArenaMark arena_mark(void) {
+    ArenaBlock *top = arena_top();
+    return (ArenaMark){ top, top ? top->used : 0 };
+}
+
+/**
+ * Arena Release
+ *
+ * @brief Frees everything allocated since mark. The first block is kept
+ *        for the next allocations, unless it was a dedicated one.
+ */
+void arena_release(ArenaMark mark) {
+    ArenaBlock *top = arena_top();
+    if (!top) return;
+
+    while (top != mark.block && (top->prev || top->size > ARENA_BLOCK_SIZE)) {
+        ArenaBlock *prev = top->prev;
+        free(top);
+        top = prev;
+        if (!top) break;
+    }
+
+    if (top) top->used = top == mark.block ? mark.used : 0;
+    pthread_setspecific(arena_key, top);
+}
+
+/**
+ * Arena Reset
+ *
+ * @brief Frees the calling thread's scratch memory, at the end of a FUSE
+ *        operation. An operation that doesn't reset leaves its memory to
+ *        the next one that does, on the same thread.
+ */
+void arena_reset(void) {
+    arena_release((ArenaMark){ NULL, 0 });
+}
@@ -0,0 +1,24 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/**
+ * Arena Mark
+ *
+ * Position in the calling thread's arena, to release what was allocated
+ * after it (see arena_release).
+ */
+typedef struct ArenaMark {
+    struct ArenaBlock *block;
+    size_t             used;
+} ArenaMark;
+
+void     *arena_alloc(size_t size);
+char     *arena_memdup(const void *src, size_t size);
+char     *arena_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+ArenaMark arena_mark(void);
+void      arena_release(ArenaMark mark);
+void      arena_reset(void);
+
+#endif // ARENA_H
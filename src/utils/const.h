@@ -11,6 +11,68 @@
     count; \
 })
 
-#define MAX_SIZE 1024
+// Catalog file kept next to the database (see catalog_init) and its header
+#define CATALOG_FILE_EXT   ".vfs2db-catalog"
+#define CATALOG_FILE_MAGIC "vfs2db-catalog 2"
+
+// Interval between two schema_version checks made by the lookups in the
+// root (see catalog_check)
+#define CATALOG_CHECK_MS 1000
+
+// Extension of the attribute files (/table/record/<column>.vfs2db)
+#define ATTR_EXT ".vfs2db"
+
+// Per-open value cache: largest value materialized by a single handle
+// and memory budget shared by all the open handles
+#define FH_MAX_VALUE_SIZE (16 * 1024 * 1024)
+#define FH_CACHE_BUDGET   (256 * 1024 * 1024)
+
+// Smallest value materialized in a memfd rather than on the heap: reads
+// hand the kernel the memfd (spliced when supported) instead of a copy
+#define FH_SPLICE_MIN_VALUE (64 * 1024)
+
+// Per-thread arena of the FUSE operations: block kept across operations
+// (larger ones are freed by arena_reset) and alignment of the allocations
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN      16
+
+// Row cache: largest value kept along with the sizes and types of a row
+#define ROW_CACHE_MAX_VALUE 4096
+
+// Virtual files served by the driver itself, outside of any table
+#define META_DIR        "/.vfs2db"
+#define META_DIR_NAME   ".vfs2db"
+#define META_STATS      "/.vfs2db/stats"
+#define META_STATS_NAME "stats"
+
+// Read-only mounts: kernel cache timeouts (seconds, never expiring in
+// practice) and default mmap_size, capped by SQLite's own limit
+#define RO_CACHE_TIMEOUT 1e9
+#define RO_MMAP_SIZE     "1099511627776"
+
+// Rows fetched by each keyset query of a table listing
+#define READDIR_BATCH 1024
+
+// Bucket directories of a table listing (bucket_fanout): digits of their
+// names, "x" included, so that they sort by number up to 10^9 rowids
+#define BUCKET_NAME_DIGITS 9
+
+// Query directory of a table: /table/.where/<column>=<value>/
+#define WHERE_DIR_NAME ".where"
+
+// Records of a table by primary key: /table/.pk/<key>/, where <key> is the
+// comma separated tuple of the percent-encoded key values
+#define PK_DIR_NAME ".pk"
+#define PK_SEP      ','
+
+// Export files of a table (see ExportFormat) and rows rendered per query
+#define EXPORT_CSV_NAME   ".rows.csv"
+#define EXPORT_JSONL_NAME ".rows.jsonl"
+#define EXPORT_ROW_EXT    ".json"
+#define EXPORT_BATCH      256
+
+// Bytes of an export stream between two cursor checkpoints: a read that
+// goes back renders at most this much (plus a row) again
+#define EXPORT_CHECKPOINT_BYTES (64 * 1024)
 
 #endif // CONST_H
\ No newline at end of file
@@ -0,0 +1,31 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+
+// Compile-time ceiling: messages above it are compiled out entirely
+// (e.g. -DLOG_MAX_LEVEL=LOG_LEVEL_WARN for production builds)
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// Runtime level, set by the log_level mount option
+extern int log_level;
+
+#define LOG_AT(level, ...) do {                                               \
+    if ((level) <= LOG_MAX_LEVEL && (level) <= log_level) {                   \
+        fprintf(stderr, __VA_ARGS__);                                         \
+    }                                                                         \
+} while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)  LOG_AT(LOG_LEVEL_WARN,  __VA_ARGS__)
+#define LOG_INFO(...)  LOG_AT(LOG_LEVEL_INFO,  __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#endif // LOG_H
@@ -0,0 +1,131 @@
+#include "name_index.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static inline uint64_t ni_hash_n(const char *key, size_t len) {
+    // FNV-1a
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static inline uint64_t ni_hash(const char *key) {
+    return ni_hash_n(key, strlen(key));
+}
+
+static int ni_resize(NameIndex *ni, size_t cap) {
+    const char **keys = calloc(cap, sizeof(char*));
+    int *values = malloc(cap * sizeof(int));
+    if (!keys || !values) { free(keys); free(values); return -1; }
+
+    for (size_t i = 0; i < ni->cap; i++) {
+        if (!ni->keys[i]) continue;
+        size_t slot = ni_hash(ni->keys[i]) & (cap - 1);
+        while (keys[slot]) slot = (slot + 1) & (cap - 1);
+        keys[slot] = ni->keys[i];
+        values[slot] = ni->values[i];
+    }
+
+    free(ni->keys);
+    free(ni->values);
+    ni->keys = keys;
+    ni->values = values;
+    ni->cap = cap;
+    return 0;
+}
+
+/**
+ * Initialize Name Index
+ *
+ * @param ni       Index to initialize
+ * @param expected Number of keys expected, used to size the table
+ *
+ * @return 0 on success, -1 on failure
+ */
+int ni_init(NameIndex *ni, size_t expected) {
+    size_t cap = 8;
+    while (cap < expected * 2) cap <<= 1;
+
+    ni->keys = calloc(cap, sizeof(char*));
+    ni->values = malloc(cap * sizeof(int));
+    ni->cap = cap;
+    ni->count = 0;
+
+    if (!ni->keys || !ni->values) { ni_free(ni); return -1; }
+    return 0;
+}
+
+/**
+ * Insert or replace a key
+ *
+ * @return 0 on success, -1 on failure
+ */
+int ni_put(NameIndex *ni, const char *key, int value) {
+    // Keep the load factor under 1/2
+    if ((ni->count + 1) * 2 > ni->cap && ni_resize(ni, ni->cap * 2) != 0) return -1;
+
+    size_t slot = ni_hash(key) & (ni->cap - 1);
+    while (ni->keys[slot]) {
+        if (strcmp(ni->keys[slot], key) == 0) {
+            ni->values[slot] = value;
+            return 0;
+        }
+        slot = (slot + 1) & (ni->cap - 1);
+    }
+
+    ni->keys[slot] = key;
+    ni->values[slot] = value;
+    ni->count++;
+    return 0;
+}
+
+/**
+ * Lookup a key
+ *
+ * @return the value stored for key, -1 if missing
+ */
+int ni_get(const NameIndex *ni, const char *key) {
+    if (!ni->keys || !key) return -1;
+
+    size_t slot = ni_hash(key) & (ni->cap - 1);
+    while (ni->keys[slot]) {
+        if (strcmp(ni->keys[slot], key) == 0) return ni->values[slot];
+        slot = (slot + 1) & (ni->cap - 1);
+    }
+    return -1;
+}
+
+/**
+ * Lookup a key by length
+ *
+ * @brief Same as ni_get for the first len bytes of key, which doesn't need
+ *        to be NUL terminated (e.g. a component in the middle of a path)
+ *        but must not contain a NUL before len.
+ *
+ * @return the value stored for the key, -1 if missing
+ */
+int ni_get_n(const NameIndex *ni, const char *key, size_t len) {
+    if (!ni->keys || !key) return -1;
+
+    size_t slot = ni_hash_n(key, len) & (ni->cap - 1);
+    while (ni->keys[slot]) {
+        const char *k = ni->keys[slot];
+        if (strncmp(k, key, len) == 0 && k[len] == '\0') return ni->values[slot];
+        slot = (slot + 1) & (ni->cap - 1);
+    }
+    return -1;
+}
+
+void ni_free(NameIndex *ni) {
+    free(ni->keys);
+    free(ni->values);
+    ni->keys = NULL;
+    ni->values = NULL;
+    ni->cap = 0;
+    ni->count = 0;
+}
@@ -0,0 +1,30 @@
+#ifndef NAME_INDEX_H
+#define NAME_INDEX_H
+
+#include <stddef.h>
+
+/**
+ * Name Index Structure
+ *
+ * Open addressing hash map from a name to a non-negative integer.
+ * Keys are borrowed: they must outlive the index.
+ *
+ * keys:   borrowed key pointers (NULL marks an empty slot)
+ * values: value of each slot
+ * cap:    number of slots (power of two)
+ * count:  number of keys stored
+ */
+typedef struct NameIndex {
+    const char **keys;
+    int         *values;
+    size_t       cap;
+    size_t       count;
+} NameIndex;
+
+int  ni_init(NameIndex *ni, size_t expected);
+int  ni_put(NameIndex *ni, const char *key, int value);
+int  ni_get(const NameIndex *ni, const char *key);
+int  ni_get_n(const NameIndex *ni, const char *key, size_t len);
+void ni_free(NameIndex *ni);
+
+#endif // NAME_INDEX_H
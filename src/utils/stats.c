@@ -0,0 +1,130 @@
+#include "stats.h"
+
+#include <time.h>
+#include <stdatomic.h>
+
+/**
+ * Operation Statistics
+ *
+ * Updated by every FUSE worker thread with relaxed atomics: readers may
+ * see a count and a histogram that are a few calls apart.
+ *
+ * calls:    completed calls
+ * errors:   calls that returned a negative errno
+ * total_ns: sum of the latencies
+ * max_ns:   slowest call
+ * buckets:  latency histogram (see STATS_BUCKETS)
+ */
+typedef struct OpStats {
+    atomic_uint_least64_t calls;
+    atomic_uint_least64_t errors;
+    atomic_uint_least64_t total_ns;
+    atomic_uint_least64_t max_ns;
+    atomic_uint_least64_t buckets[STATS_BUCKETS];
+} OpStats;
+
+static OpStats op_stats[STATS_OP_COUNT];
+
+static const char *op_names[STATS_OP_COUNT] = {
+    [STATS_GETATTR]  = "getattr",
+    [STATS_READDIR]  = "readdir",
+    [STATS_READ]     = "read",
+    [STATS_WRITE]    = "write",
+    [STATS_READLINK] = "readlink",
+};
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int stats_bucket(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int b = 0;
+    while (us && b < STATS_BUCKETS - 1) { us >>= 1; b++; }
+    return b;
+}
+
+// Upper bound of a bucket, in microseconds
+static uint64_t stats_bucket_us(int b) {
+    return 1ULL << b;
+}
+
+/**
+ * Record Operation
+ *
+ * @param op       Operation
+ * @param start_ns stats_now() when the operation started
+ * @param res      Value returned to FUSE (negative errno on failure)
+ */
+void stats_record(StatsOp op, uint64_t start_ns, int res) {
+    uint64_t ns = stats_now() - start_ns;
+    OpStats *s = &op_stats[op];
+
+    atomic_fetch_add_explicit(&s->calls, 1, memory_order_relaxed);
+    if (res < 0) atomic_fetch_add_explicit(&s->errors, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->total_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->buckets[stats_bucket(ns)], 1, memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit(&s->max_ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&s->max_ns, &max, ns,
+                                                              memory_order_relaxed, memory_order_relaxed));
+}
+
+// Upper bound of the bucket holding the p-th percentile (never above the
+// slowest call), in microseconds
+static uint64_t stats_percentile(const uint64_t *buckets, uint64_t calls, double p, uint64_t max_us) {
+    uint64_t rank = (uint64_t)(calls * p);
+    uint64_t seen = 0;
+    int b;
+    for (b = 0; b < STATS_BUCKETS - 1; b++) {
+        seen += buckets[b];
+        if (seen > rank) break;
+    }
+    uint64_t us = stats_bucket_us(b);
+    return us < max_us ? us : max_us;
+}
+
+/**
+ * Print Statistics
+ *
+ * @brief Writes a summary line per operation, followed by the non-empty
+ *        buckets of its latency histogram ("<bound_us>:<calls>").
+ */
+void stats_print(FILE *out) {
+    fprintf(out, "%-10s %12s %10s %10s %10s %10s %12s\n",
+            "op", "calls", "errors", "avg_us", "p50_us", "p99_us", "max_us");
+
+    for (int op = 0; op < STATS_OP_COUNT; op++) {
+        OpStats *s = &op_stats[op];
+
+        uint64_t buckets[STATS_BUCKETS];
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            buckets[b] = atomic_load_explicit(&s->buckets[b], memory_order_relaxed);
+        }
+        uint64_t calls = atomic_load_explicit(&s->calls, memory_order_relaxed);
+        uint64_t errors = atomic_load_explicit(&s->errors, memory_order_relaxed);
+        uint64_t total = atomic_load_explicit(&s->total_ns, memory_order_relaxed);
+        uint64_t max = atomic_load_explicit(&s->max_ns, memory_order_relaxed);
+
+        fprintf(out, "%-10s %12llu %10llu %10llu %10llu %10llu %12llu\n",
+                op_names[op],
+                (unsigned long long)calls,
+                (unsigned long long)errors,
+                (unsigned long long)(calls ? total / calls / 1000 : 0),
+                (unsigned long long)(calls ? stats_percentile(buckets, calls, 0.50, max / 1000) : 0),
+                (unsigned long long)(calls ? stats_percentile(buckets, calls, 0.99, max / 1000) : 0),
+                (unsigned long long)(max / 1000));
+    }
+
+    fprintf(out, "\nlatency histograms (bucket upper bound in us:calls)\n");
+    for (int op = 0; op < STATS_OP_COUNT; op++) {
+        fprintf(out, "%-10s", op_names[op]);
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            uint64_t n = atomic_load_explicit(&op_stats[op].buckets[b], memory_order_relaxed);
+            if (n) fprintf(out, " %llu:%llu", (unsigned long long)stats_bucket_us(b), (unsigned long long)n);
+        }
+        fprintf(out, "\n");
+    }
+}
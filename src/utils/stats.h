@@ -0,0 +1,24 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Latency buckets: bucket 0 counts calls under 1us, bucket b (b > 0)
+// calls in [2^(b-1), 2^b) us; the last one everything slower
+#define STATS_BUCKETS 32
+
+typedef enum {
+    STATS_GETATTR,
+    STATS_READDIR,
+    STATS_READ,
+    STATS_WRITE,
+    STATS_READLINK,
+    STATS_OP_COUNT
+} StatsOp;
+
+uint64_t stats_now(void);
+void     stats_record(StatsOp op, uint64_t start_ns, int res);
+void     stats_print(FILE *out);
+
+#endif // STATS_H
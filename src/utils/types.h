@@ -1,7 +1,13 @@
 #ifndef TYPES_H
 #define TYPES_H
 
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "const.h"
+#include "name_index.h"
 
 // =============================================================
 // Metadata Structures
@@ -10,37 +16,75 @@
 /**
  * Foreign Key Structure
  * 
- * from:  attribute in the current table
- * table: referenced table name
- * to:    referenced attribute in the referenced table
+ * from:        attribute in the current table
+ * table:       referenced table name
+ * to:          referenced attribute in the referenced table
+ * id:          foreign key constraint, shared by the columns of a composite key
+ * resolve_sql: plan of the referenced rowid lookup (QUERY_RESOLVE_FK),
+ *              NULL if it couldn't be built
  */
 typedef struct Fk {
     char *from;
     char *table;
     char *to;
+    int   id;
+    char *resolve_sql;
 } Fk;
 
+/**
+ * Column Structure
+ *
+ * name:  column name
+ * is_pk: whether the column is part of the primary key
+ * fk:    foreign key starting from this column (NULL if none)
+ */
+typedef struct Column {
+    char *name;
+    bool  is_pk;
+    Fk   *fk;
+} Column;
+
 /**
  * Schema Structure
  *
- * name:    table name
- * pk:      primary key's attributes' names
- * attr:    attributes' names
- * fks:     foreign keys' structures
- * n_pk:    primary key's attributes' number
- * n_attr:  attributes' number
- * n_fks:   foreign keys' attributes' number
+ * Created when the table is listed, its columns loaded on first use (see
+ * catalog_table): cols, col_names, pk, attr, fks and the foreign keys'
+ * strings then share a single allocation, starting at cols.
+ *
+ * name:          table name
+ * without_rowid: the table is WITHOUT ROWID: records only exist by key
+ * sql_hash:      hash of the CREATE statement, to tell a table redefined
+ *                by DDL from an unchanged one
+ * loaded:        the columns below are filled in
+ * cols:          all the columns, in table order
+ * col_names:     names of cols, in the same order
+ * pk:            primary key's attributes' names, in key order
+ * attr:          attributes' names
+ * fks:           foreign keys' structures
+ * col_index:     column name -> index in cols
+ * n_pk:          primary key's attributes' number
+ * n_attr:        attributes' number
+ * n_fks:         foreign keys' attributes' number
+ * n_cols:        columns' number
  */
 typedef struct Schema {
-    char *name;
+    char       *name;
+    bool        without_rowid;
+    uint64_t    sql_hash;
+    atomic_bool loaded;
+
+    Column  *cols;
+    char   **col_names;
+    char   **pk;
+    char   **attr;
+    Fk     **fks;
 
-    char *pk[MAX_SIZE];
-    char *attr[MAX_SIZE];
-    Fk   *fks[MAX_SIZE];
+    NameIndex col_index;
     
     int   n_pk;
     int   n_attr;
     int   n_fks;
+    int   n_cols;
 } Schema; 
 
 // =============================================================
@@ -48,32 +92,145 @@ typedef struct Schema {
 // =============================================================
 
 /**
- * Global Database Schema Structure
- * 
- * tables:   tables schemas
- * n_tables: number of tables schemas
+ * Database Schema Snapshot
+ *
+ * Replaced as a whole when DDL changes the schema (see catalog_refresh).
+ * Table ids are never reused: a dropped or redefined table keeps its
+ * Schema and id, only out of table_index, so that open files and inodes
+ * never point to another table.
+ *
+ * tables:         tables schemas, by id (dropped ones included)
+ * table_index:    live table name -> index in tables
+ * n_tables:       number of tables schemas
+ * schema_version: PRAGMA schema_version the snapshot was read at
+ * retired:        previous snapshot, freed with the catalog
  */
 typedef struct DbSchema {
-    Schema *tables[MAX_SIZE];
-    int     n_tables;
+    Schema          **tables;
+    NameIndex         table_index;
+    int               n_tables;
+    int64_t           schema_version;
+    struct DbSchema  *retired;
 } DbSchema;
 
 // =============================================================
 // Other Structures
 // =============================================================
 
-// FIX: make it a type, like Tokens
-struct tokens {
-    char *table;
-    char *record;    char *attribute;
-};
+/**
+ * Mount Options Structure (-o name=value)
+ *
+ * entry_timeout: seconds the kernel caches name lookups
+ * attr_timeout:  seconds the kernel caches file attributes
+ * kernel_cache:  keep file contents in the page cache across opens
+ * poll_ms:       interval between two checks for external changes
+ *                (PRAGMA data_version), 0 to disable them
+ * row_cache_mb:  memory cap of the row cache in MiB, 0 to disable it
+ * bucket_fanout: rowids per bucket directory of the table listings, a power
+ *                of 10, 0 to list the records flat (see path_bucket_name)
+ * read_only:     ro, the database is an immutable snapshot: opened read-only
+ *                with immutable=1 and mmap, every write rejected with EROFS
+ *                and the kernel caches never expire (see vfs2db_init)
+ *
+ * SQLite tuning, as the value of the PRAGMA of the same name
+ * (NULL leaves SQLite's default, see db_pool_check_options):
+ * journal_mode:  journal mode of the database (WAL if NULL)
+ * synchronous:   sync level of the writer connection
+ * cache_size:    page cache of each connection (pages, or KiB if negative)
+ * mmap_size:     bytes of the database mapped by each connection
+ * temp_store:    where each connection keeps temporary tables and indexes
+ * busy_timeout:  milliseconds a connection waits for a lock
+ *
+ * Group commit (see group_commit_start):
+ * group_commit_ms: longest a write transaction stays open, 0 to commit each write
+ * group_commit_kb: KiB written before the transaction commits
+ *
+ * catalog_cache: file the catalog is kept in across mounts (see catalog_init),
+ *                "" to disable it, NULL for the database path + CATALOG_FILE_EXT
+ */
+typedef struct MountOptions {
+    double       entry_timeout;
+    double       attr_timeout;
+    int          kernel_cache;
+    unsigned int poll_ms;
+    unsigned int row_cache_mb;
+    unsigned int bucket_fanout;
+    int          read_only;
+
+    const char  *journal_mode;
+    const char  *synchronous;
+    const char  *cache_size;
+    const char  *mmap_size;
+    const char  *temp_store;
+    unsigned int busy_timeout;
+
+    unsigned int group_commit_ms;
+    unsigned int group_commit_kb;
+
+    const char  *catalog_cache;
+} MountOptions;
+
+/**
+ * Export Files
+ *
+ * Read-only files generated from a whole table or row:
+ * /table/.rows.csv, /table/.rows.jsonl and /table/<rowid>.json
+ */
+typedef enum ExportFormat {
+    EXPORT_NONE,
+    EXPORT_CSV,
+    EXPORT_JSONL,
+    EXPORT_ROW_JSON,
+} ExportFormat;
+
+/**
+ * Path Tokens Structure
+ *
+ * A path resolved against the catalog by path_resolve: names are borrowed
+ * from the catalog, so tokens are plain values with nothing to free.
+ * A query directory (/table/.where/<column>=<value>) stands for the table
+ * itself: it doesn't count in depth. So does the key directory
+ * (/table/.pk), whose children are records named by their primary key,
+ * and a bucket directory (/table/000123xxx), holding a range of rowids.
+ *
+ * depth:     components of the path (0 root, 1 table, 2 record, 3 attribute)
+ * table_id:  id of the table in the catalog (-1 if depth < 1)
+ * col_id:    index of the column in the table's cols (-1 if depth < 3)
+ * rowid:     record's rowid (valid if depth >= 2, unless by_pk: then set
+ *            by the caller once the key is looked up)
+ * table:     table name (NULL if depth < 1)
+ * attribute: column name (NULL if depth < 3)
+ * export:    export file inside the table (depth 2), EXPORT_NONE otherwise
+ * where:     whether the path goes through the table's .where directory
+ * where_col: index of the filtered column (-1 for .where itself)
+ * by_pk:     whether the path goes through the table's .pk directory
+ * n_key:     parts of the record's key (n_pk of the table, depth >= 2)
+ * in_bucket: whether the path goes through a bucket directory
+ * bucket:    number of the bucket (see path_bucket_of)
+ * value:     decoded filter value or, by_pk, the decoded key parts,
+ *            each one followed by a NUL
+ * value_len: bytes in value
+ */
+typedef struct Tokens {
+    int           depth;
+    int           table_id;
+    int           col_id;
+    int64_t       rowid;
+    const char   *table;
+    const char   *attribute;
+    ExportFormat  export;
+
+    bool          where;
+    int           where_col;
+    char          value[NAME_MAX + 1];
+    size_t        value_len;
+
+    bool          by_pk;
+    int           n_key;
 
+    bool          in_bucket;
+    int64_t       bucket;
+} Tokens;
 
-// FIX: destroy this
-struct pkfk_relation {
-    char *fk_name;
-    char *pk_name;
-    char *value;
-};
 
 #endif // TYPES_H
\ No newline at end of file